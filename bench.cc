@@ -0,0 +1,440 @@
+// Benchmark harness: runs ships of several sizes with no frame pacing,
+// timing each stage of the simulation and drawing, and prints the results
+// as JSON (so that they can be compared between builds).
+
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <unistd.h>  // getpid
+
+#define GLFW_INCLUDE_GLCOREARB
+#include <GLFW/glfw3.h>
+
+#include <png.h>
+
+#include "ship.h"
+#include "shaders.h"
+#include "headless.h"
+#include "profiler.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Command-line options
+struct BenchOptions
+{
+    BenchOptions() : frames(300), warmup(30), steps(50),
+                     width(640), height(480), backend(Ship::GPU),
+                     half(false) {}
+
+    size_t frames;
+    size_t warmup;  // untimed frames run before the timed ones
+    int steps;      // RK4 substeps per frame
+    int width;      // size of the offscreen framebuffer
+    int height;
+    Ship::Backend backend;
+    bool half;      // store derivatives at half precision (GPU only)
+
+    // Ships to run.  If empty, reference ships are generated instead.
+    std::vector<std::string> images;
+};
+
+// Sizes of the generated reference ships
+static const int REFERENCE_SIZES[][2] = {{16, 12}, {64, 48}, {256, 192}};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Writes a reference ship (an elliptical hull, with thrust engines along
+// its bottom edge and a steering engine on each side) to a temporary PNG,
+// returning the filename.
+std::string WriteReferenceShip(const int width, const int height)
+{
+    const std::string filename = std::string(P_tmpdir) + "/pixelsim_bench_" +
+        std::to_string(width) + "x" + std::to_string(height) + "_" +
+        std::to_string(getpid()) + ".png";
+
+    std::vector<png_byte> pixels(width * height * 4, 0);
+    auto set = [&](const int x, const int y, const png_byte r,
+                   const png_byte g, const png_byte b)
+    {
+        png_byte* p = &pixels[(y*width + x) * 4];
+        p[0] = r;
+        p[1] = g;
+        p[2] = b;
+        p[3] = 255;
+    };
+
+    const float cx = (width - 1) / 2.0f;
+    const float cy = (height - 1) / 2.0f;
+    for (int y=0; y < height; ++y)
+    {
+        for (int x=0; x < width; ++x)
+        {
+            const float dx = (x - cx) / (width / 2.0f);
+            const float dy = (y - cy) / (height / 2.0f);
+            if (dx*dx + dy*dy <= 1)     set(x, y, 128, 128, 128);
+        }
+    }
+
+    // Image rows run from top to bottom, so the bottom edge is the last
+    // filled pixel in each column.
+    for (int x=width/4; x < width - width/4; ++x)
+    {
+        for (int y=height - 1; y >= 0; --y)
+        {
+            if (pixels[(y*width + x) * 4 + 3])
+            {
+                set(x, y, SHIP_ENGINE_THRUST_R, SHIP_ENGINE_THRUST_G,
+                          SHIP_ENGINE_THRUST_B);
+                break;
+            }
+        }
+    }
+    const int y = height / 2;
+    set(0, y, SHIP_ENGINE_LEFT_R, SHIP_ENGINE_LEFT_G, SHIP_ENGINE_LEFT_B);
+    set(width - 1, y, SHIP_ENGINE_RIGHT_R, SHIP_ENGINE_RIGHT_G,
+                      SHIP_ENGINE_RIGHT_B);
+
+    png_structp png_ptr = png_create_write_struct(
+            PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+
+    FILE* output = fopen(filename.c_str(), "wb");
+    if (!output)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot write '" << filename << "'"
+                  << std::endl;
+        exit(-1);
+    }
+
+    png_set_IHDR(png_ptr, info_ptr, width, height,
+                 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+    std::vector<png_bytep> rows(height);
+    for (int i=0; i < height; ++i)
+    {
+        rows[i] = &pixels[i*width*4];
+    }
+
+    png_init_io(png_ptr, output);
+    png_set_rows(png_ptr, info_ptr, &rows[0]);
+    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+    fclose(output);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    return filename;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns a string as a quoted JSON string
+std::string Quote(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')  out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs frame i of a ship, then draws it if draw is true.  The thrusters
+// fire throughout, and the ship steers back and forth, so that it deforms
+// (and the engine code paths run).
+void RunFrame(const BenchOptions& opts, Ship* ship, const size_t i,
+              const bool draw)
+{
+    ship->thrustEnginesOn = true;
+    ship->leftEnginesOn = (i / 30) % 2;
+    ship->Update(1.0f/60, opts.steps);
+
+    if (draw)
+    {
+        glClearColor(0.933f, 0.933f, 0.933f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        ship->Draw(opts.width, opts.height, true, 0.9);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns the largest distance between the same node in two copies of a
+// ship, and the distance between their centroids
+void GetError(Ship* a, Ship* b, float* node_error, float* centroid_error)
+{
+    const size_t size = (a->GetWidth() + 1)*(a->GetHeight() + 1)*4;
+    std::vector<float> sa(size), sb(size);
+    a->GetState(&sa[0]);
+    b->GetState(&sb[0]);
+
+    // Empty nodes are zero in both states
+    *node_error = 0;
+    for (size_t i=0; i < size; i += 4)
+    {
+        *node_error = std::max(*node_error,
+                std::hypot(sa[i] - sb[i], sa[i + 1] - sb[i + 1]));
+    }
+
+    float ca[2], cb[2], v[2];
+    a->WaitForPosition();
+    a->GetPosition(ca, v);
+    b->WaitForPosition();
+    b->GetPosition(cb, v);
+    *centroid_error = std::hypot(ca[0] - cb[0], ca[1] - cb[1]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs one ship and prints its results as a JSON object
+void RunShip(const BenchOptions& opts, const std::string& image,
+             const bool graphics)
+{
+    Ship ship(image, opts.backend, graphics);
+    if (opts.half)  ship.SetPrecision(Ship::HALF);
+    Profiler profiler(graphics);
+
+    auto frame = [&](const size_t i)
+    {
+        RunFrame(opts, &ship, i, graphics);
+    };
+
+    for (size_t i=0; i < opts.warmup; ++i)  frame(i);
+    if (graphics)   glFinish();
+
+    ship.SetProfiler(&profiler);
+    const auto t0 = std::chrono::steady_clock::now();
+    for (size_t i=0; i < opts.frames; ++i)
+    {
+        frame(opts.warmup + i);
+        profiler.Collect(false);
+    }
+    if (graphics)   glFinish();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - t0;
+    ship.SetProfiler(NULL);
+    profiler.Collect(true);
+
+    // With reduced precision, measure how far the ship ends up from one
+    // run with the same inputs at full precision
+    float node_error = 0;
+    float centroid_error = 0;
+    if (opts.half)
+    {
+        Ship reference(image, opts.backend, graphics);
+        for (size_t i=0; i < opts.warmup + opts.frames; ++i)
+        {
+            RunFrame(opts, &reference, i, false);
+        }
+        GetError(&ship, &reference, &node_error, &centroid_error);
+    }
+
+    // Total time in the profiled stages (the rest of a frame is spent in
+    // driver overhead, uploads and synchronization)
+    double staged_cpu = 0;
+    double staged_gpu = 0;
+
+    std::cout << "    {\n"
+              << "      \"image\": " << Quote(image) << ",\n"
+              << "      \"width\": " << ship.GetWidth() << ",\n"
+              << "      \"height\": " << ship.GetHeight() << ",\n"
+              << "      \"nodes\": " << ship.GetNodeCount() << ",\n";
+    if (opts.backend == Ship::GPU)
+    {
+        const Ship::Precision p = opts.half ? Ship::HALF : Ship::FULL;
+        std::cout << "      \"bytes_per_substep\": "
+                  << ship.GetSubstepBytes(p) << ",\n"
+                  << "      \"texture_bytes\": "
+                  << ship.GetTextureBytes(p) << ",\n";
+    }
+    if (opts.half)
+    {
+        // The savings against full precision (which only cover the
+        // derivatives, so come to about 24% and 33%, not 50%)
+        const double traffic =
+            double(ship.GetSubstepBytes(Ship::HALF)) /
+            ship.GetSubstepBytes(Ship::FULL);
+        const double memory =
+            double(ship.GetTextureBytes(Ship::HALF)) /
+            ship.GetTextureBytes(Ship::FULL);
+        std::cout << "      \"traffic_saving\": " << 1 - traffic << ",\n"
+                  << "      \"texture_saving\": " << 1 - memory << ",\n";
+        std::cout << "      \"max_node_error\": " << node_error << ",\n"
+                  << "      \"centroid_error\": " << centroid_error << ",\n";
+    }
+    std::cout << "      \"stages\": {\n";
+    for (int s=0; s < Profiler::STAGE_COUNT; ++s)
+    {
+        const Profiler::Stage stage = Profiler::Stage(s);
+        const Profiler::Totals& t = profiler.GetTotals(stage);
+        staged_cpu += t.cpu_ms;
+        staged_gpu += t.gpu_ms;
+
+        std::cout << "        " << Quote(Profiler::GetName(stage)) << ": {"
+                  << "\"calls\": " << t.calls
+                  << ", \"cpu_ms_per_frame\": " << t.cpu_ms / opts.frames
+                  << ", \"gpu_ms_per_frame\": " << t.gpu_ms / opts.frames
+                  << "}" << (s + 1 < Profiler::STAGE_COUNT ? "," : "")
+                  << "\n";
+    }
+    std::cout << "      },\n"
+              << "      \"staged_cpu_ms_per_frame\": "
+              << staged_cpu / opts.frames << ",\n"
+              << "      \"staged_gpu_ms_per_frame\": "
+              << staged_gpu / opts.frames << ",\n"
+              << "      \"frame_ms\": " << elapsed.count() / opts.frames
+              << "\n"
+              << "    }";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void PrintUsage()
+{
+    std::cout << "Usage: pixelsim_bench [...] [ship.png ...]\n\n"
+        << "Runs each ship (or generated reference ships of several sizes)\n"
+        << "without frame pacing, and prints per-stage timings as JSON.\n\n"
+        << "Arguments:\n"
+        << "    --frames N    Number of timed frames (default: 300)\n"
+        << "    --warmup N    Untimed frames to run first (default: 30)\n"
+        << "    --steps N     RK4 substeps per frame (default: 50)\n"
+        << "    --cpu         Simulate on the CPU instead of the GPU\n"
+        << "    --half        Store derivatives at half precision (the\n"
+        << "                  state stays full), and report the savings\n"
+        << "                  and the error against full precision\n";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void GetArgs(int argc, char** argv, BenchOptions* opts)
+{
+    for (int a=1; a < argc; ++a)
+    {
+        auto count = [&](const char* name)
+        {
+            if (++a >= argc || std::atoi(argv[a]) <= 0)
+            {
+                std::cerr << "[pixelsim]    Error: " << name
+                          << " requires a positive count" << std::endl;
+                exit(-1);
+            }
+            return std::atoi(argv[a]);
+        };
+
+        if (!strcmp(argv[a], "--help") || !strcmp(argv[a], "-h"))
+        {
+            PrintUsage();
+            exit(0);
+        }
+        else if (!strcmp(argv[a], "--frames"))
+        {
+            opts->frames = count("--frames");
+        }
+        else if (!strcmp(argv[a], "--warmup"))
+        {
+            opts->warmup = count("--warmup");
+        }
+        else if (!strcmp(argv[a], "--steps"))
+        {
+            opts->steps = count("--steps");
+        }
+        else if (!strcmp(argv[a], "--cpu"))
+        {
+            opts->backend = Ship::CPU;
+        }
+        else if (!strcmp(argv[a], "--half"))
+        {
+            opts->half = true;
+        }
+        else if (argv[a][0] == '-')
+        {
+            std::cerr << "[pixelsim]    Error: Unknown argument '"
+                      << argv[a] << "'" << std::endl;
+            exit(-1);
+        }
+        else
+        {
+            FILE* input = fopen(argv[a], "rb");
+            if (input == NULL)
+            {
+                std::cerr << "[pixelsim]    Error: Cannot open file '"
+                          << argv[a] << "'" << std::endl;
+                exit(-1);
+            }
+            fclose(input);
+            opts->images.push_back(argv[a]);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    BenchOptions opts;
+    GetArgs(argc, argv, &opts);
+
+    // Without an offscreen context, the CPU solver still runs (but Draw and
+    // the GPU timings are skipped).
+    const bool graphics = MakeHeadlessContext(opts.width, opts.height);
+    if (!graphics)
+    {
+        std::cerr << "[pixelsim]    No offscreen context; "
+                  << "benchmarking the CPU solver without drawing"
+                  << std::endl;
+        opts.backend = Ship::CPU;
+    }
+    else
+    {
+        Shaders::init();
+    }
+
+    if (opts.half && opts.backend != Ship::GPU)
+    {
+        std::cerr << "[pixelsim]    Error: --half requires the GPU backend"
+                  << std::endl;
+        exit(-1);
+    }
+
+    // Generated ships are deleted at the end of the run
+    std::vector<std::string> generated;
+    if (opts.images.empty())
+    {
+        for (auto size : REFERENCE_SIZES)
+        {
+            generated.push_back(WriteReferenceShip(size[0], size[1]));
+        }
+        opts.images = generated;
+    }
+
+    std::cout << "{\n"
+              << "  \"backend\": \""
+              << (opts.backend == Ship::GPU ? "gpu" : "cpu") << "\",\n"
+              << "  \"gpu_timing\": " << (graphics ? "true" : "false")
+              << ",\n"
+              << "  \"frames\": " << opts.frames << ",\n"
+              << "  \"steps\": " << opts.steps << ",\n"
+              << "  \"precision\": \"" << (opts.half ? "half" : "full")
+              << "\",\n"
+              << "  \"ships\": [\n";
+    for (size_t i=0; i < opts.images.size(); ++i)
+    {
+        RunShip(opts, opts.images[i], graphics);
+        std::cout << (i + 1 < opts.images.size() ? ",\n" : "\n");
+    }
+    std::cout << "  ]\n}" << std::endl;
+
+    for (auto& f : generated)   std::remove(f.c_str());
+    if (graphics)   DestroyHeadlessContext();
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "trace.h"
+
+static const char MAGIC[8] = {'p', 'i', 'x', 'e', 'l', 's', 'i', 'm'};
+static const uint32_t CHECKPOINT_VERSION = 1;
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// Sections start on multiples of this many bytes
+static const uint64_t ALIGNMENT = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t Align(const uint64_t offset)
+{
+    return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Checkpoint::Header Checkpoint::MakeHeader(const size_t width,
+                                          const size_t height)
+{
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = CHECKPOINT_VERSION;
+    h.byte_order = BYTE_ORDER_MARK;
+    h.width = width;
+    h.height = height;
+
+    h.pixels_offset = Align(sizeof(Header));
+    h.pixels_size = width*height*4;
+    h.filled_offset = Align(h.pixels_offset + h.pixels_size);
+    h.filled_size = (width+1)*(height+1);
+    h.state_offset = Align(h.filled_offset + h.filled_size);
+    h.state_size = (width+1)*(height+1)*4*sizeof(float);
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Checkpoint::Write(const std::string& filename,
+                       const size_t width, const size_t height,
+                       const uint8_t* pixels, const uint8_t* filled,
+                       const float* state,
+                       const float centroid[2], const float velocity[2],
+                       const uint8_t engines, const uint64_t frame)
+{
+    TRACE_SCOPE("Checkpoint::Write");
+
+    FILE* output = fopen(filename.c_str(), "wb");
+    if (!output)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot write checkpoint to '"
+                  << filename << "'" << std::endl;
+        return false;
+    }
+
+    Header h = MakeHeader(width, height);
+    h.frame = frame;
+    h.centroid[0] = centroid[0];
+    h.centroid[1] = centroid[1];
+    h.velocity[0] = velocity[0];
+    h.velocity[1] = velocity[1];
+    h.engines = engines;
+
+    // Writes a section, padding up to its offset first
+    auto write = [&](const void* data, const uint64_t offset,
+                     const uint64_t size)
+    {
+        static const char zeros[ALIGNMENT] = {0};
+        fwrite(zeros, 1, offset - ftell(output), output);
+        fwrite(data, 1, size, output);
+    };
+    write(&h, 0, sizeof(h));
+    write(pixels, h.pixels_offset, h.pixels_size);
+    write(filled, h.filled_offset, h.filled_size);
+    write(state, h.state_offset, h.state_size);
+
+    const bool ok = !ferror(output);
+    fclose(output);
+    if (!ok)
+    {
+        std::cerr << "[pixelsim]    Error: Failed to write checkpoint '"
+                  << filename << "'" << std::endl;
+    }
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Checkpoint::Checkpoint(const std::string& filename)
+    : header(NULL), size(0)
+{
+    TRACE_SCOPE("Checkpoint::Checkpoint");
+
+    auto fail = [&](const std::string& reason)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot load checkpoint '"
+                  << filename << "': " << reason << std::endl;
+        exit(-1);
+    };
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)     fail("can't open file");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)    fail("can't stat file");
+    size = st.st_size;
+    if (size < sizeof(Header))  fail("file is too short");
+
+    void* const map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)  fail("can't map file");
+    header = static_cast<const Header*>(map);
+
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)))
+    {
+        fail("not a checkpoint");
+    }
+    else if (header->byte_order != BYTE_ORDER_MARK)
+    {
+        fail("written on a machine with a different byte order");
+    }
+    else if (header->version != CHECKPOINT_VERSION)
+    {
+        fail("unsupported version " + std::to_string(header->version));
+    }
+
+    // The sections must be where this version puts them (which also
+    // checks that they're aligned), and fit in the file
+    const Header expected = MakeHeader(header->width, header->height);
+    if (header->pixels_offset != expected.pixels_offset ||
+        header->pixels_size != expected.pixels_size ||
+        header->filled_offset != expected.filled_offset ||
+        header->filled_size != expected.filled_size ||
+        header->state_offset != expected.state_offset ||
+        header->state_size != expected.state_size ||
+        header->state_offset + header->state_size > size)
+    {
+        fail("invalid section layout");
+    }
+
+    // The state is read front to back (by uploads or copies)
+    madvise(map, size, MADV_SEQUENTIAL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Checkpoint::~Checkpoint()
+{
+    munmap(const_cast<Header*>(header), size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const uint8_t* Checkpoint::GetPixels() const
+{
+    return reinterpret_cast<const uint8_t*>(header) + header->pixels_offset;
+}
+
+const uint8_t* Checkpoint::GetFilled() const
+{
+    return reinterpret_cast<const uint8_t*>(header) + header->filled_offset;
+}
+
+const float* Checkpoint::GetState() const
+{
+    return reinterpret_cast<const float*>(
+            reinterpret_cast<const uint8_t*>(header) + header->state_offset);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Checkpoint::GetPosition(float centroid[2], float velocity[2]) const
+{
+    for (int i=0; i < 2; ++i)
+    {
+        centroid[i] = header->centroid[i];
+        velocity[i] = header->velocity[i];
+    }
+}
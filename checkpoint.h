@@ -0,0 +1,78 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Checkpoints of a ship's simulation, which a Ship can be rebuilt from
+// without its original image.
+//
+// A checkpoint file is a fixed-size header followed by three sections,
+// each starting on a 64-byte boundary: the ship's image (RGBA8, top row
+// first, as loaded from the PNG), its node types (the filled array) and
+// its state (RGBA32F position and velocity per node, in state_tex's
+// layout, with empty nodes zeroed).  Everything is stored in native byte
+// order.  Loading maps the file into memory rather than reading it, so the
+// state can be uploaded to a texture or copied into the solver straight
+// from the mapping.
+class Checkpoint
+{
+public:
+    // Maps a checkpoint file, exiting if it can't be read or isn't valid.
+    Checkpoint(const std::string& filename);
+    ~Checkpoint();
+
+    // Writes a checkpoint, returning false if the file can't be written.
+    static bool Write(const std::string& filename,
+                      const size_t width, const size_t height,
+                      const uint8_t* pixels, const uint8_t* filled,
+                      const float* state,
+                      const float centroid[2], const float velocity[2],
+                      const uint8_t engines, const uint64_t frame);
+
+    size_t GetWidth() const { return header->width; }
+    size_t GetHeight() const { return header->height; }
+
+    // Pointers into the mapped file (valid for the Checkpoint's lifetime)
+    const uint8_t* GetPixels() const;
+    const uint8_t* GetFilled() const;
+    const float* GetState() const;
+
+    void GetPosition(float centroid[2], float velocity[2]) const;
+
+    // Engine flags (as FLEET_*_BIT values) when the checkpoint was saved
+    uint8_t GetEngines() const { return header->engines; }
+
+    // Frame number passed to Write
+    uint64_t GetFrame() const { return header->frame; }
+
+private:
+    struct Header
+    {
+        char magic[8];          // "pixelsim"
+        uint32_t version;
+        uint32_t byte_order;    // 0x01020304, in the writer's byte order
+        uint32_t width;
+        uint32_t height;
+        uint64_t frame;
+        float centroid[2];
+        float velocity[2];
+        uint32_t engines;
+        uint32_t reserved;
+
+        // Byte offsets and sizes of each section
+        uint64_t pixels_offset, pixels_size;
+        uint64_t filled_offset, filled_size;
+        uint64_t state_offset, state_size;
+    };
+
+    // Fills in everything but the position and engines, with sections
+    // laid out one after another
+    static Header MakeHeader(const size_t width, const size_t height);
+
+    const Header* header;   // start of the mapping
+    size_t size;            // size of the mapping, in bytes
+};
+
+#endif
@@ -19,4 +19,40 @@
 #define SHIP_ENGINE_LEFT_B      2
 #define SHIP_ENGINE_LEFT        4
 
+// Bits of the engine masks used by Fleet and Simulation
+#define FLEET_THRUST_BIT        1
+#define FLEET_LEFT_BIT          2
+#define FLEET_RIGHT_BIT         4
+
+// Returns the mask of engines that fire for a set of key states.  Thrust
+// also fires the turning engines, unless the other one is on.  (This file
+// is pasted into the shaders too, which skip this function.)
+#ifdef __cplusplus
+inline int FiringEngines(const bool thrust, const bool left, const bool right)
+{
+    return (thrust ? FLEET_THRUST_BIT : 0) |
+           (left || (thrust && !right) ? FLEET_LEFT_BIT : 0) |
+           (right || (thrust && !left) ? FLEET_RIGHT_BIT : 0);
+}
+#endif
+
+// Engine acceleration (applied perpendicular to the node's orientation)
+#define SHIP_ENGINE_ACCEL       1000.0f
+
+// Spring-damper parameters for the links between nodes
+#define SHIP_SPRING_K           10000.0f
+#define SHIP_SPRING_C           1000.0f
+#define SHIP_NODE_MASS          1.0f
+#define SHIP_NODE_INERTIA       1.0f
+
+// Contacts between ships in a Fleet with collisions turned on: nodes of
+// different ships closer than the radius (and nodes past the walls) are
+// pushed apart by a penalty spring and damper.  Nodes are hashed into
+// square cells of the given size, which is small enough that a cell
+// rarely holds more than one node.
+#define SHIP_CONTACT_RADIUS     1.0f
+#define SHIP_CONTACT_K          10000.0f
+#define SHIP_CONTACT_C          100.0f
+#define SHIP_CONTACT_CELL       0.5f
+
 #endif
@@ -2,33 +2,42 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
-uniform sampler2D filled;
 uniform sampler2D state;
 
-uniform ivec2 ship_size;
-
 uniform float k;     // linear spring constant
 uniform float c;     // linear damping
 
 uniform float m;    // point's mass
 uniform float I;    // point's inertia
 
-uniform int thrustEnginesOn;
-uniform int leftEnginesOn;
-uniform int rightEnginesOn;
+// Bitmask of links to neighbors, and whether this node is an engine that's
+// currently firing (from node.vert or fleet_node.vert)
+flat in uint links;
+flat in uint firing;
 
 out vec4 fragColor;
 
 ////////////////////////////////////////////////////////////////////////////////
 
-vec2 accel(vec2 a, vec2 a_dot, vec2 d,
+// Neighbor offsets, in the same order as Nodes::offsets (so that bit i of
+// links refers to offsets[i]), with their rest lengths and directions.
+const ivec2 offsets[8] = ivec2[8](
+        ivec2(-1, -1), ivec2(-1, 0), ivec2(-1, 1), ivec2(0, -1),
+        ivec2(0, 1), ivec2(1, -1), ivec2(1, 0), ivec2(1, 1));
+const float rest_lengths[8] = float[8](
+        1.41421356f, 1.0f, 1.41421356f, 1.0f,
+        1.0f, 1.41421356f, 1.0f, 1.41421356f);
+
+////////////////////////////////////////////////////////////////////////////////
+
+vec2 accel(vec2 a, vec2 a_dot, float rest,
            vec2 b, vec2 b_dot)
 {
     vec2 v  = b.xy - a.xy;
     vec2 v_ = normalize(v.xy);
 
     // Force from linear spring
-    vec2 F_kL = -k * (length(d.xy) - length(v.xy)) * v_.xy;
+    vec2 F_kL = -k * (rest - length(v.xy)) * v_.xy;
 
     // Force from linear damper (check this!)
     vec2 F_cL = v_.xy * c * dot(b_dot.xy - a_dot.xy, v_.xy);
@@ -38,69 +47,172 @@ vec2 accel(vec2 a, vec2 a_dot, vec2 d,
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void main()
+#ifdef CONTACTS
+
+// Layers of the spatial hash of every node in the fleet (see hash.vert and
+// Fleet::BuildHash), the state that it was built from, and the ship that
+// this node belongs to (from fleet_node.vert)
+uniform isampler2DArray table;
+uniform int layers;
+uniform sampler2D hashed;
+flat in uint owner;
+
+// World-space box (xmin, ymin, xmax, ymax) that nodes are kept inside, or
+// all zeros for no walls
+uniform vec4 walls;
+
+// Returns the slot of a cell (which must match Slot in hash.vert)
+ivec2 Slot(ivec2 cell, int table_size)
+{
+    uint h = (uint(cell.x) * 73856093u) ^ (uint(cell.y) * 19349663u);
+    h &= uint(table_size * table_size - 1);
+    return ivec2(h % uint(table_size), h / uint(table_size));
+}
+
+// Penalty force for a penetration depth and a closing speed, which only
+// ever pushes (never pulls)
+float penalty(float depth, float closing)
+{
+    if (depth <= 0.0f)  return 0.0f;
+    return max(0.0f, SHIP_CONTACT_K * depth + SHIP_CONTACT_C * closing);
+}
+
+// Returns the contact force on a node at pos (with velocity vel) from the
+// node in a hash table entry, if it's from another ship and was hashed
+// into the given cell (so that it isn't found through other cells)
+vec2 contact(ivec4 e, ivec2 cell, vec2 pos, vec2 vel)
+{
+    if (e.y == int(owner) || e.zw != cell)  return vec2(0.0f);
+
+    int atlas_width = textureSize(state, 0).x;
+    vec4 other = texelFetch(state, ivec2(e.x % atlas_width,
+                                         e.x / atlas_width), 0);
+    vec2 d = pos - other.xy;
+    float dist = length(d);
+    if (dist >= SHIP_CONTACT_RADIUS || dist == 0.0f)    return vec2(0.0f);
+
+    vec2 n = d / dist;
+    return n * penalty(SHIP_CONTACT_RADIUS - dist, dot(other.zw - vel, n));
+}
+
+// Returns true if the node at an atlas texel was stored in the hash (which
+// only fails when its slot holds more nodes than the hash has layers)
+bool hashed_node(ivec2 coord, int table_size)
+{
+    int index = coord.x + coord.y * textureSize(state, 0).x;
+    ivec2 cell = ivec2(floor(texelFetch(hashed, coord, 0).xy /
+                             SHIP_CONTACT_CELL));
+    ivec2 slot = Slot(cell, table_size);
+    for (int i=0; i < layers; ++i) {
+        int e = texelFetch(table, ivec3(slot, i), 0).x;
+        if (e < 0)  break;
+        if (e == index)     return true;
+    }
+    return false;
+}
+
+// Returns the acceleration of a node from contacts with nodes of other
+// ships (found in the cells within the contact radius) and with the walls
+vec2 contacts(ivec2 coord, vec2 pos, vec2 vel)
 {
-    vec2 tex_coord = vec2(gl_FragCoord.x / float(ship_size.x + 1),
-                          gl_FragCoord.y / float(ship_size.y + 1));
+    vec2 total = vec2(0.0f);
+
+    // A node that other nodes can't find ignores them too, so that every
+    // contact force has an equal and opposite one.  Each slot's layers are
+    // filled in order, so its lookups stop at the first empty one.
+    int table_size = textureSize(table, 0).x;
+    if (hashed_node(coord, table_size))
+    {
+        ivec2 lo = ivec2(floor((pos - SHIP_CONTACT_RADIUS) /
+                               SHIP_CONTACT_CELL));
+        ivec2 hi = ivec2(floor((pos + SHIP_CONTACT_RADIUS) /
+                               SHIP_CONTACT_CELL));
+        for (int y=lo.y; y <= hi.y; ++y) {
+            for (int x=lo.x; x <= hi.x; ++x) {
+                ivec2 cell = ivec2(x, y);
+                ivec2 slot = Slot(cell, table_size);
+                for (int i=0; i < layers; ++i) {
+                    ivec4 e = texelFetch(table, ivec3(slot, i), 0);
+                    if (e.x < 0)    break;
+                    total += contact(e, cell, pos, vel);
+                }
+            }
+        }
+    }
 
-    if (texture(filled, tex_coord).r == 0)
+    if (walls.z > walls.x)
+    {
+        total.x += penalty(walls.x - pos.x, -vel.x);
+        total.x -= penalty(pos.x - walls.z, vel.x);
+    }
+    if (walls.w > walls.y)
     {
-        fragColor = vec4(0.0f, 0.0f, 0.0f, 0.0f);
-        return;
+        total.y += penalty(walls.y - pos.y, -vel.y);
+        total.y -= penalty(pos.y - walls.w, vel.y);
     }
 
-    vec4 near_state = texture(state, tex_coord);
+    return total / m;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+void main()
+{
+    ivec2 coord = ivec2(gl_FragCoord.xy);
+
+    // This shader only runs on filled nodes (see Ship::RenderToFBO)
+    vec4 near_state = texelFetch(state, coord, 0);
     vec2 near_pos = near_state.rg;
     vec2 near_vel = near_state.ba;
 
     vec2 total_accel = vec2(0.0f);
     vec2 total_angle = vec2(0.0f);
 
-    // Iterate over the nine neighboring cells, accumulating forces.
-    for (int dx=-1; dx <= 1; ++dx) {
-        for (int dy=-1; dy <= 1; ++dy) {
-            // Find the texture coordinate of the far pixel's data
-            vec2 far_tex_coord = tex_coord +
-                                 vec2(float(dx) / float(ship_size.x + 2),
-                                      float(dy) / float(ship_size.y + 2));
-            // If the chosen pixel is within the image (i.e. it has texture
-            // coordinates between 0 and 1) and is marked as filled in the
-            // pixel occupancy texture, then find and add its acceleration.
-            if (far_tex_coord.x > 0.0f && far_tex_coord.x < 1.0f &&
-                far_tex_coord.y > 0.0f && far_tex_coord.y < 1.0f &&
-                (dx != 0 || dy != 0) &&
-                texture(filled, far_tex_coord).r != 0)
-            {
-                // Get the actual state of the far point from the textures
-                vec4 far_state = texture(state, far_tex_coord);
-                vec2 far_pos = far_state.rg;
-                vec2 far_vel = far_state.ba;
-
-                // Find the nominal offset and angle between the points.
-                vec2 delta = vec2(float(dx), float(dy));
-
-                // Accumulate angle between desired and actual positions.
-                float angle = atan(far_pos.y - near_pos.y,
-                                   far_pos.x - near_pos.x) - atan(dy, dx);
-                total_angle += vec2(cos(angle), sin(angle));
-
-                // Find the acceleration caused by this node-neighbor linkage
-                total_accel += accel(near_pos, near_vel, delta,
-                                     far_pos, far_vel);
-            }
+    // Iterate over the linked neighbors, accumulating forces.
+    for (int i=0; i < 8; ++i) {
+        if ((links & (1u << i)) != 0u)
+        {
+            // Get the actual state of the far point from the textures
+            vec4 far_state = texelFetch(state, coord + offsets[i], 0);
+            vec2 far_pos = far_state.rg;
+            vec2 far_vel = far_state.ba;
+
+            // Accumulate angle between desired and actual positions, as a
+            // (cos, sin) pair: this is the angle of the actual direction
+            // relative to the rest direction.
+            vec2 actual = normalize(far_pos - near_pos);
+            vec2 rest = vec2(offsets[i]) / rest_lengths[i];
+            total_angle += vec2(dot(actual, rest),
+                                actual.y*rest.x - actual.x*rest.y);
+
+            // Find the acceleration caused by this node-neighbor linkage
+            total_accel += accel(near_pos, near_vel, rest_lengths[i],
+                                 far_pos, far_vel);
         }
     }
 
-    // Accelerate engine pixels upwards
-    float type = texture(filled, tex_coord).r;
-    if ((type == SHIP_ENGINE_THRUST/255.0f && thrustEnginesOn != 0) ||
-        (type == SHIP_ENGINE_RIGHT/255.0f &&  rightEnginesOn != 0) ||
-        (type == SHIP_ENGINE_LEFT/255.0f &&   leftEnginesOn != 0))
+    // Accelerate engine pixels perpendicular to their average orientation
+    if (firing != 0u)
     {
-        float angle = atan(total_angle.y, total_angle.x);
-        total_accel += vec2(-sin(angle), cos(angle))*1000.0f;
+        vec2 dir = length(total_angle) > 0.0f ? normalize(total_angle)
+                                              : vec2(1.0f, 0.0f);
+        total_accel += vec2(-dir.y, dir.x)*SHIP_ENGINE_ACCEL;
     }
 
+#ifdef CONTACTS
+    total_accel += contacts(coord, near_pos, near_vel);
+#endif
+
+#ifdef HALF
+    // RGBA16F overflows to infinity above 65504, which the springs reach
+    // at about 6.5 node widths of stretch, and RK4 would then turn the
+    // infinities into NaNs; clamp to the largest half instead.
+    total_accel = clamp(total_accel, -65504.0f, 65504.0f);
+    near_vel = clamp(near_vel, -65504.0f, 65504.0f);
+#endif
+
     // Output the final derivatives:
     fragColor = vec4(near_vel, total_accel);
 }
@@ -0,0 +1,18 @@
+# Writes every shader source, and constants.h (which is pasted into each
+# shader), into a C++ file that defines Shaders::sources.  This runs at
+# build time (see CMakeLists.txt) as
+#   cmake -DSOURCE_DIR=<dir> -DOUTPUT=<file> -P embed_shaders.cmake
+
+file(GLOB SHADERS ${SOURCE_DIR}/*.vert ${SOURCE_DIR}/*.frag)
+
+set(TEXT "// Generated from the shader sources by embed_shaders.cmake\n\n")
+set(TEXT "${TEXT}#include \"shaders.h\"\n\n")
+set(TEXT "${TEXT}const Shaders::Source Shaders::sources[] = {\n")
+foreach(f ${SOURCE_DIR}/constants.h ${SHADERS})
+    get_filename_component(name ${f} NAME)
+    file(READ ${f} contents)
+    set(TEXT "${TEXT}    {\"${name}\", R\"glsl(${contents})glsl\"},\n")
+endforeach()
+set(TEXT "${TEXT}    {NULL, NULL}\n};\n")
+
+file(WRITE ${OUTPUT} "${TEXT}")
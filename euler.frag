@@ -4,14 +4,21 @@ uniform sampler2D state;
 uniform sampler2D accel;
 
 uniform float dt;
-uniform ivec2 size;
 
 out vec4 fragColor;
 
+#ifdef HALO
+// Halo texels are recomputed from the node they copy (see halo.vert)
+flat in ivec2 source;
+#endif
+
 void main()
 {
-    vec2 tex_coord = vec2(gl_FragCoord.x / float(size.x + 1),
-                          gl_FragCoord.y / float(size.y + 1));
+#ifdef HALO
+    ivec2 coord = source;
+#else
+    ivec2 coord = ivec2(gl_FragCoord.xy);
+#endif
 
-    fragColor = texture(state, tex_coord) + texture(accel, tex_coord) * dt;
+    fragColor = texelFetch(state, coord, 0) + texelFetch(accel, coord, 0) * dt;
 }
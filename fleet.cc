@@ -0,0 +1,1045 @@
+#include <cmath>
+#include <cstring>  // memcpy
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+#define GLFW_INCLUDE_GLCOREARB
+#include <GLFW/glfw3.h>
+
+#include "fleet.h"
+#include "image.h"
+#include "ship.h"
+#include "shaders.h"
+#include "constants.h"
+#include "nodes.h"
+#include "pool.h"
+#include "trace.h"
+
+// Texture units used by the simulation passes (as in Ship), plus ones
+// for the per-ship engine flags, the spatial hash's layers, the two
+// textures that its layers are peeled through and the position sums.
+enum {STATE_UNIT=0, DERIVATIVE_UNIT=2, ENGINE_UNIT=6, HASH_UNIT=7,
+      PEEL_UNIT=8, REDUCE_UNIT=9};
+
+// Layers that the spatial hash starts with, and the most that it grows to
+static const size_t HASH_LAYERS = 4;
+static const size_t HASH_MAX_LAYERS = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+
+Fleet::Fleet()
+    : packed(false), atlas_width(0), atlas_height(0), pixel_count(0),
+      engines_dirty(true), collisions(false), hash_size(0), hash_layers(0),
+      hash_tex(0), hash_peel{0, 0}, hash_depth(0), hash_built(false),
+      tick(false), position_next(0), position_pending(0)
+{
+    std::fill(walls, walls + 4, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Fleet::~Fleet()
+{
+    for (auto& i : images)  delete i.second;
+
+    if (!packed)    return;
+
+    GLuint buffers[] = {node_buf, link_buf, ship_buf, pixel_buf, engine_buf};
+    glDeleteBuffers(5, buffers);
+
+    glDeleteTextures(2, state_tex);
+    glDeleteTextures(4, derivative_tex);
+    glDeleteTextures(1, &engine_tex);
+
+    glDeleteFramebuffers(2, state_fbo);
+    glDeleteFramebuffers(4, derivative_fbo);
+    glDeleteVertexArrays(1, &node_vao);
+    glDeleteVertexArrays(1, &draw_vao);
+    glDeleteVertexArrays(1, &quad_vao);
+
+    glDeleteTextures(sum_tex.size(), &sum_tex[0]);
+    glDeleteFramebuffers(sum_fbo.size(), &sum_fbo[0]);
+    for (size_t i=0; i < position_pending; ++i)
+    {
+        glDeleteSync(position_fence[(position_next + i + POSITION_READBACKS -
+                                     position_pending) % POSITION_READBACKS]);
+    }
+    glDeleteBuffers(POSITION_READBACKS, position_pbo);
+
+    if (!hash_tex)  return;
+    glDeleteTextures(1, &hash_tex);
+    glDeleteTextures(2, hash_peel);
+    glDeleteRenderbuffers(1, &hash_depth);
+    glDeleteFramebuffers(hash_fbo.size(), &hash_fbo[0]);
+    glDeleteQueries(hash_query.size(), &hash_query[0]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+size_t Fleet::AddShip(const std::string& imagename, const float x, const float y)
+{
+    if (packed)
+    {
+        std::cerr << "[pixelsim]    Error: Can't add ships to a packed fleet"
+                  << std::endl;
+        exit(-1);
+    }
+
+    const Ship* ship = Load(imagename);
+
+    Entry e;
+    e.ship = ship;
+    e.x = x;
+    e.y = y;
+    e.u = 0;
+    e.v = 0;
+    e.begin = 0;
+    e.end = 0;
+    e.engines = 0;
+    e.centroid[0] = x + ship->width/2.0f;
+    e.centroid[1] = y + ship->height/2.0f;
+    e.velocity[0] = 0;
+    e.velocity[1] = 0;
+    ships.push_back(e);
+
+    return ships.size() - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::AddGrid(const std::vector<std::string>& imagenames,
+                    const size_t count)
+{
+    if (imagenames.empty())
+    {
+        std::cerr << "[pixelsim]    Error: Can't add a grid of ships "
+                  << "without any images" << std::endl;
+        exit(-1);
+    }
+
+    LoadImages(imagenames);
+
+    size_t width = 0;
+    size_t height = 0;
+    for (const auto& name : imagenames)
+    {
+        width = std::max(width, Load(name)->width);
+        height = std::max(height, Load(name)->height);
+    }
+
+    const size_t columns = std::ceil(std::sqrt(count));
+    for (size_t i=0; i < count; ++i)
+    {
+        AddShip(imagenames[i % imagenames.size()],
+                (i % columns) * width * 1.5f,
+                (i / columns) * height * 1.5f);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::LoadImages(const std::vector<std::string>& imagenames)
+{
+    TRACE_SCOPE("Fleet::LoadImages");
+
+    std::vector<std::string> missing;
+    for (const auto& name : imagenames)
+    {
+        if (!images.count(name) &&
+            std::find(missing.begin(), missing.end(), name) == missing.end())
+        {
+            missing.push_back(name);
+        }
+    }
+
+    // Images vary in size, so each thread takes the next one as soon as
+    // it's done, rather than a fixed share of them.  Workers can't exit
+    // the program, so their errors are collected and reported here.
+    std::vector<Ship*> loaded(missing.size());
+    std::vector<std::string> errors(missing.size());
+    std::atomic<size_t> next(0);
+    ThreadPool pool;
+    pool.RunThreads([&](size_t, size_t)
+    {
+        for (size_t i; (i = next++) < missing.size();)
+        {
+            Image image;
+            if (Image::Load(missing[i], &image, &errors[i]))
+            {
+                loaded[i] = new Ship(image, Ship::GPU, false);
+            }
+        }
+    });
+
+    bool failed = false;
+    for (size_t i=0; i < missing.size(); ++i)
+    {
+        if (loaded[i])
+        {
+            images[missing[i]] = loaded[i];
+        }
+        else
+        {
+            std::cerr << "[pixelsim]    Error: " << errors[i] << std::endl;
+            failed = true;
+        }
+    }
+    if (failed)     exit(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const Ship* Fleet::Load(const std::string& imagename)
+{
+    // Ships are only used here for their images and node lists, so they're
+    // loaded without any OpenGL objects (or a solver).
+    Ship*& ship = images[imagename];
+    if (!ship)  ship = new Ship(imagename, Ship::GPU, false);
+    return ship;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+size_t Fleet::Pad(const size_t size)
+{
+    return (size + SUM_BLOCK - 1) / SUM_BLOCK * SUM_BLOCK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::Pack()
+{
+    if (ships.empty())
+    {
+        std::cerr << "[pixelsim]    Error: Can't pack an empty fleet"
+                  << std::endl;
+        exit(-1);
+    }
+
+    PackAtlas();
+
+    // Build the fleet-wide node list, in ship order
+    for (auto& e : ships)
+    {
+        e.begin = texels.size();
+        for (auto i : e.ship->nodes->index)
+        {
+            const size_t x = i % (e.ship->width + 1);
+            const size_t y = i / (e.ship->width + 1);
+            texels.push_back(e.u + x + (e.v + y)*atlas_width);
+        }
+        e.end = texels.size();
+    }
+
+    // Find the fleet's bounds at rest (which Draw fits to the window)
+    bounds[0] = bounds[1] = INFINITY;
+    bounds[2] = bounds[3] = -INFINITY;
+    for (const auto& e : ships)
+    {
+        bounds[0] = std::min(bounds[0], e.x);
+        bounds[1] = std::min(bounds[1], e.y);
+        bounds[2] = std::max(bounds[2], e.x + e.ship->width);
+        bounds[3] = std::max(bounds[3], e.y + e.ship->height);
+    }
+
+    MakeTextures();
+    MakeBuffers();
+    MakeFramebuffer();
+    MakeVertexArray();
+    MakeReduction();
+
+    packed = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::PackAtlas()
+{
+    // Pack ships' node grids into shelves (rows), with the atlas roughly
+    // square and a whole number of the widest ship across.  Grids are
+    // padded to whole SUM_BLOCK squares, so that FindPosition can sum
+    // each square without mixing ships.
+    size_t area = 0;
+    size_t widest = 0;
+    for (const auto& e : ships)
+    {
+        area += Pad(e.ship->width + 1) * Pad(e.ship->height + 1);
+        widest = std::max(widest, Pad(e.ship->width + 1));
+    }
+    atlas_width = widest * std::max(
+            size_t(1), size_t(std::ceil(std::sqrt(area) / widest)));
+
+    size_t u = 0, v = 0, shelf = 0;
+    for (auto& e : ships)
+    {
+        const size_t w = Pad(e.ship->width + 1);
+        const size_t h = Pad(e.ship->height + 1);
+        if (u + w > atlas_width)
+        {
+            u = 0;
+            v += shelf;
+            shelf = 0;
+        }
+        e.u = u;
+        e.v = v;
+        u += w;
+        shelf = std::max(shelf, h);
+    }
+    atlas_height = v + shelf;
+
+    GLint max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (atlas_width > size_t(max_size) || atlas_height > size_t(max_size))
+    {
+        std::cerr << "[pixelsim]    Error: Fleet atlas (" << atlas_width
+                  << "x" << atlas_height << ") is larger than the maximum "
+                  << "texture size (" << max_size << ")" << std::endl;
+        exit(-1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::SetEngines(const size_t ship, const bool thrust,
+                       const bool left, const bool right)
+{
+    // Thrust also fires the turning engines, as it does for Ship
+    const uint8_t engines = FiringEngines(thrust, left, right);
+
+    if (ships[ship].engines != engines)
+    {
+        ships[ship].engines = engines;
+        engines_dirty = true;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::SetCollisions(const bool enabled)
+{
+    if (!packed)
+    {
+        std::cerr << "[pixelsim]    Error: Collisions can only be turned on "
+                  << "in a packed fleet" << std::endl;
+        exit(-1);
+    }
+
+    collisions = enabled;
+    if (!enabled || hash_tex)   return;
+
+    // Cells are smaller than the spacing between nodes, so there are
+    // about as many occupied cells as nodes.  Keep the table at most a
+    // quarter full (as far as the GPU allows), so that few cells share
+    // a slot, and most slots need only the first layer or two.
+    GLint max_texture;
+    GLint max_viewport[2];
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture);
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, max_viewport);
+    const size_t limit = std::min(max_texture,
+                                  std::min(max_viewport[0], max_viewport[1]));
+
+    hash_size = 16;
+    while (hash_size * hash_size < 4 * texels.size() && hash_size*2 <= limit)
+    {
+        hash_size *= 2;
+    }
+
+    glGenRenderbuffers(1, &hash_depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, hash_depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32F,
+                          hash_size, hash_size);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenTextures(2, hash_peel);
+    for (auto t : hash_peel)
+    {
+        glBindTexture(GL_TEXTURE_2D, t);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32I, hash_size, hash_size,
+                     0, GL_RGBA_INTEGER, GL_INT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    glGenTextures(1, &hash_tex);
+    MakeHash(HASH_LAYERS);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::MakeHash(const size_t layers)
+{
+    glBindTexture(GL_TEXTURE_2D_ARRAY, hash_tex);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA32I, hash_size, hash_size,
+                 layers, 0, GL_RGBA_INTEGER, GL_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // Each layer's framebuffer draws into the layer and a peel texture
+    for (size_t i=hash_fbo.size(); i < layers; ++i)
+    {
+        GLuint fbo;
+        glGenFramebuffers(1, &fbo);
+        hash_fbo.push_back(fbo);
+
+        GLuint query;
+        glGenQueries(1, &query);
+        hash_query.push_back(query);
+    }
+    const GLenum buffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    for (size_t i=0; i < layers; ++i)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, hash_fbo[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  hash_tex, 0, i);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                               GL_TEXTURE_2D, hash_peel[i % 2], 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                  GL_RENDERBUFFER, hash_depth);
+        glDrawBuffers(2, buffers);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    hash_layers = layers;
+    hash_built = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::CheckHash()
+{
+    if (!hash_built || hash_layers >= HASH_MAX_LAYERS)  return;
+
+    GLuint available = 0;
+    glGetQueryObjectuiv(hash_query[hash_layers - 1],
+                        GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)     return;
+
+    GLuint full = 0;
+    glGetQueryObjectuiv(hash_query[hash_layers - 1], GL_QUERY_RESULT, &full);
+    if (full)   MakeHash(hash_layers * 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::SetWalls(const float box[4])
+{
+    std::copy(box, box + 4, walls);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::GetBounds(float box[4]) const
+{
+    std::copy(bounds, bounds + 4, box);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::GetPosition(const size_t ship, float c[2], float v[2]) const
+{
+    const Entry& e = ships[ship];
+    c[0] = e.centroid[0];
+    c[1] = e.centroid[1];
+    v[0] = e.velocity[0];
+    v[1] = e.velocity[1];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::Update(const float dt, const int steps)
+{
+    TRACE_GL_SCOPE("Fleet::Update");
+
+    if (engines_dirty)
+    {
+        std::vector<GLubyte> engines;
+        for (const auto& e : ships)     engines.push_back(e.engines);
+        glBindBuffer(GL_TEXTURE_BUFFER, engine_buf);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, engines.size(), &engines[0]);
+        engines_dirty = false;
+    }
+
+    // Grow the spatial hash first, since that rebinds its texture
+    if (collisions)     CheckHash();
+
+    // Every pass reads from these units, so bind them once up front.
+    BindTextures();
+
+    const float dt_ = dt / steps;
+    for (int i=0; i < steps; ++i) {
+        if (collisions)     BuildHash();
+
+        GetDerivatives(tick, 0);    // k1 = f(y)
+
+        ApplyDerivatives(dt_/2, 0);  // Calculate y + dt/2 * k1
+        GetDerivatives(!tick, 1);   // k2 = f(y + dt/2 * k1)
+
+        ApplyDerivatives(dt_/2, 1);  // Calculate y + dt/2 * k2
+        GetDerivatives(!tick, 2);   // k3 = f(y + dt/2 * k2)
+
+        ApplyDerivatives(dt_, 2);    // Calculate y + dt * k3
+        GetDerivatives(!tick, 3);   // k4 = f(y + dt * k3)
+
+        // Update state and swap which texture is active
+        GetNextState(dt_);
+    }
+
+    FindPosition();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::GetDerivatives(const int source, const int out)
+{
+    const Shaders::FleetDerivativesProgram& program =
+        collisions ? Shaders::fleet_contacts : Shaders::fleet_derivatives;
+    glUseProgram(program.program);
+
+    glUniform1i(program.state, STATE_UNIT + source);
+    glUniform1i(program.engines, ENGINE_UNIT);
+
+    // Contacts look up nodes (hashed at the start of the substep) in the
+    // source state, so they see where those nodes are at this stage.
+    if (collisions)
+    {
+        glUniform1i(program.table, HASH_UNIT);
+        glUniform1i(program.layers, hash_layers);
+        glUniform1i(program.hashed, STATE_UNIT + tick);
+        glUniform4fv(program.walls, 1, walls);
+    }
+
+    RenderToFBO(derivative_fbo[out]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::ApplyDerivatives(const float dt, const int source)
+{
+    const Shaders::EulerProgram& program = Shaders::euler;
+    glUseProgram(program.program);
+
+    glUniform1i(program.state, STATE_UNIT + tick);
+    glUniform1i(program.accel, DERIVATIVE_UNIT + source);
+    glUniform1f(program.dt, dt);
+
+    RenderToFBO(state_fbo[!tick]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::GetNextState(const float dt)
+{
+    const Shaders::RK4Program& program = Shaders::rk4sum;
+    glUseProgram(program.program);
+
+    glUniform1i(program.y, STATE_UNIT + tick);
+    glUniform1i(program.k1, DERIVATIVE_UNIT + 0);
+    glUniform1i(program.k2, DERIVATIVE_UNIT + 1);
+    glUniform1i(program.k3, DERIVATIVE_UNIT + 2);
+    glUniform1i(program.k4, DERIVATIVE_UNIT + 3);
+    glUniform1f(program.dt, dt);
+
+    RenderToFBO(state_fbo[!tick]);
+
+    tick = !tick;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::FindPosition()
+{
+    TRACE_GL_SCOPE("Fleet::FindPosition");
+
+    const Shaders::ReduceProgram& program = Shaders::reduce;
+    glUseProgram(program.program);
+    glBindVertexArray(quad_vao);
+
+    // Repeatedly sum 2x2 blocks, starting from the current state, until
+    // each texel holds the sums of one SUM_BLOCK square of the atlas
+    glActiveTexture(GL_TEXTURE0 + REDUCE_UNIT);
+    glUniform1i(program.source, REDUCE_UNIT);
+    glUniform1i(program.block, 0);
+
+    size_t w = atlas_width;
+    size_t h = atlas_height;
+    for (size_t i=0; i < sum_tex.size(); ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D, i ? sum_tex[i - 1] : state_tex[tick]);
+        glUniform2i(program.source_size, w, h);
+
+        w /= 2;
+        h /= 2;
+        glBindFramebuffer(GL_FRAMEBUFFER, sum_fbo[i]);
+        glViewport(0, 0, w, h);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // If every buffer is still in flight, wait for the oldest one
+    if (position_pending == POSITION_READBACKS)
+    {
+        ReadPosition(true);
+    }
+
+    // Start reading back the last level, which ReadPosition sums by ship
+    // once it's finished
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, position_pbo[position_next]);
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_FLOAT, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    position_fence[position_next] =
+        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    position_next = (position_next + 1) % POSITION_READBACKS;
+    position_pending++;
+
+    ReadPosition(false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::ReadPosition(const bool wait)
+{
+    TRACE_GL_SCOPE("Fleet::ReadPosition");
+
+    const size_t w = atlas_width / SUM_BLOCK;
+    const size_t h = atlas_height / SUM_BLOCK;
+    while (position_pending)
+    {
+        const size_t i = (position_next + POSITION_READBACKS -
+                          position_pending) % POSITION_READBACKS;
+
+        const GLenum status = glClientWaitSync(
+                position_fence[i], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                wait ? GL_TIMEOUT_IGNORED : 0);
+        if (status != GL_ALREADY_SIGNALED &&
+            status != GL_CONDITION_SATISFIED)
+        {
+            break;
+        }
+        glDeleteSync(position_fence[i]);
+        position_pending--;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, position_pbo[i]);
+        const GLfloat* const sums = static_cast<const GLfloat*>(
+                glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                 w*h*4*sizeof(GLfloat), GL_MAP_READ_BIT));
+        for (auto& e : ships)
+        {
+            const size_t u = e.u / SUM_BLOCK;
+            const size_t v = e.v / SUM_BLOCK;
+            const size_t u_end = u + Pad(e.ship->width + 1) / SUM_BLOCK;
+            const size_t v_end = v + Pad(e.ship->height + 1) / SUM_BLOCK;
+
+            float sum[4] = {0, 0, 0, 0};
+            for (size_t y=v; y < v_end; ++y)
+            {
+                for (size_t x=u; x < u_end; ++x)
+                {
+                    const GLfloat* const t = &sums[4*(x + y*w)];
+                    for (int j=0; j < 4; ++j)   sum[j] += t[j];
+                }
+            }
+
+            const float count = e.end - e.begin;
+            e.centroid[0] = sum[0] / count;
+            e.centroid[1] = sum[1] / count;
+            e.velocity[0] = sum[2] / count;
+            e.velocity[1] = sum[3] / count;
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::WaitForPosition()
+{
+    ReadPosition(true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::Draw(const int window_width, const int window_height,
+                 const bool track, const float scale) const
+{
+    TRACE_GL_SCOPE("Fleet::Draw");
+
+    glViewport(0, 0, window_width, window_height);
+
+    const Shaders::FleetProgram& program = Shaders::fleet;
+    glUseProgram(program.program);
+
+    // Center on the middle of the fleet, or on its mean centroid
+    float center[2] = {(bounds[0] + bounds[2]) / 2,
+                       (bounds[1] + bounds[3]) / 2};
+    if (track)
+    {
+        center[0] = center[1] = 0;
+        for (const auto& e : ships)
+        {
+            center[0] += e.centroid[0] / ships.size();
+            center[1] += e.centroid[1] / ships.size();
+        }
+    }
+    glUniform2f(program.center, center[0], center[1]);
+
+    // Fit the fleet's bounds to the window (as ship.vert does for a ship)
+    const float w = bounds[2] - bounds[0];
+    const float h = bounds[3] - bounds[1];
+    const float aspect = float(window_width) / float(window_height);
+    if (w / h >= aspect)
+    {
+        glUniform2f(program.scale, 2.0f / w * scale,
+                                   2.0f / w * aspect * scale);
+    }
+    else
+    {
+        glUniform2f(program.scale, 2.0f / h / aspect * scale,
+                                   2.0f / h * scale);
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, state_tex[tick]);
+    glUniform1i(program.state, 0);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, engine_tex);
+    glUniform1i(program.engines, 1);
+    glActiveTexture(GL_TEXTURE0);
+
+    // One instance per pixel, each drawn as a quad
+    glBindVertexArray(draw_vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, pixel_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::RenderToFBO(const GLuint fbo)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, atlas_width, atlas_height);
+
+    // Draw one point per live node in the fleet (see Ship::RenderToFBO)
+    glBindVertexArray(node_vao);
+    glDrawArrays(GL_POINTS, 0, texels.size());
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::BuildHash()
+{
+    TRACE_GL_SCOPE("Fleet::BuildHash");
+
+    const Shaders::FleetHashProgram& program = Shaders::fleet_hash;
+    glUseProgram(program.program);
+    glUniform1i(program.state, STATE_UNIT + tick);
+    glUniform1i(program.table_size, hash_size);
+    glViewport(0, 0, hash_size, hash_size);
+    glBindVertexArray(node_vao);
+
+    // Every node is drawn as a point in its cell's slot, all in parallel.
+    // The depth buffer is only used here.
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    const GLint empty[4] = {-1, -1, 0, 0};
+    const GLfloat far = 1.0f;
+    for (size_t i=0; i < hash_layers; ++i)
+    {
+        // Layers are only built (and cleared) while the one before stored
+        // a node.  The first layer that's left empty is still cleared,
+        // which is where lookups stop, so later ones are never read.
+        if (i)  glBeginConditionalRender(hash_query[i - 1], GL_QUERY_WAIT);
+
+        // The first layer doesn't read the previous one, but its sampler
+        // still mustn't point at the texture being drawn into
+        glUniform1i(program.layer, i);
+        glUniform1i(program.previous, PEEL_UNIT + (i + 1) % 2);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, hash_fbo[i]);
+        glClearBufferiv(GL_COLOR, 0, empty);
+        glClearBufferiv(GL_COLOR, 1, empty);
+        glClearBufferfv(GL_DEPTH, 0, &far);
+
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, hash_query[i]);
+        glDrawArrays(GL_POINTS, 0, texels.size());
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+
+        if (i)  glEndConditionalRender();
+    }
+    glDisable(GL_DEPTH_TEST);
+    hash_built = true;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::BindTextures() const
+{
+    for (int i=0; i < 2; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + STATE_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D, state_tex[i]);
+    }
+    for (int i=0; i < 4; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + DERIVATIVE_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D, derivative_tex[i]);
+    }
+    glActiveTexture(GL_TEXTURE0 + ENGINE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, engine_tex);
+    glActiveTexture(GL_TEXTURE0 + HASH_UNIT);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, hash_tex);
+    for (int i=0; i < 2; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + PEEL_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D, hash_peel[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::MakeTextures()
+{
+    // Every ship's nodes start at rest, offset to the ship's world position.
+    // Other texels (including empty nodes) are left at zero, so that
+    // FindPosition's sums only include live nodes.
+    std::vector<GLfloat> pos(atlas_width * atlas_height * 4, 0.0f);
+    for (const auto& e : ships)
+    {
+        for (size_t y=0; y <= e.ship->height; ++y)
+        {
+            for (size_t x=0; x <= e.ship->width; ++x)
+            {
+                if (!e.ship->filled[y*(e.ship->width + 1) + x])  continue;
+                GLfloat* const t = &pos[4*(e.u + x + (e.v + y)*atlas_width)];
+                t[0] = e.x + x;
+                t[1] = e.y + y;
+            }
+        }
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glGenTextures(2, state_tex);
+    glGenTextures(4, derivative_tex);
+    GLuint* textures[] = {&state_tex[0], &state_tex[1],
+                          &derivative_tex[0], &derivative_tex[1],
+                          &derivative_tex[2], &derivative_tex[3]};
+    for (auto t : textures)
+    {
+        glBindTexture(GL_TEXTURE_2D, *t);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, atlas_width, atlas_height,
+                     0, GL_RGBA, GL_FLOAT, &pos[0]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    // Engine flags are one byte per ship, read as a buffer texture
+    glGenBuffers(1, &engine_buf);
+    glBindBuffer(GL_TEXTURE_BUFFER, engine_buf);
+    std::vector<GLubyte> engines;
+    for (const auto& e : ships)     engines.push_back(e.engines);
+    glBufferData(GL_TEXTURE_BUFFER, engines.size(), &engines[0],
+                 GL_DYNAMIC_DRAW);
+
+    glGenTextures(1, &engine_tex);
+    glBindTexture(GL_TEXTURE_BUFFER, engine_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R8UI, engine_buf);
+    engines_dirty = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::MakeBuffers()
+{
+    // Points at the atlas texel of every live node, plus each node's
+    // type, links and ship index (used by fleet_node.vert)
+    std::vector<GLfloat> points;
+    std::vector<GLubyte> links;
+    std::vector<GLuint> owners;
+    for (size_t s=0; s < ships.size(); ++s)
+    {
+        const Entry& e = ships[s];
+        const Nodes& nodes = *e.ship->nodes;
+        for (size_t n=0; n < nodes.size(); ++n)
+        {
+            const uint32_t t = texels[e.begin + n];
+            points.push_back((t % atlas_width + 0.5f) / atlas_width * 2 - 1);
+            points.push_back((t / atlas_width + 0.5f) / atlas_height * 2 - 1);
+            links.push_back(nodes.types[n]);
+            links.push_back(nodes.links[n]);
+            owners.push_back(s);
+        }
+    }
+
+    glGenBuffers(1, &node_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, node_buf);
+    glBufferData(GL_ARRAY_BUFFER, points.size()*sizeof(points[0]),
+                 &points[0], GL_STATIC_DRAW);
+
+    glGenBuffers(1, &link_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, link_buf);
+    glBufferData(GL_ARRAY_BUFFER, links.size()*sizeof(links[0]),
+                 &links[0], GL_STATIC_DRAW);
+
+    glGenBuffers(1, &ship_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, ship_buf);
+    glBufferData(GL_ARRAY_BUFFER, owners.size()*sizeof(owners[0]),
+                 &owners[0], GL_STATIC_DRAW);
+
+    // One instance record per filled pixel: the atlas position of its
+    // lower-left node, its color and its ship index.
+    std::vector<GLushort> corners;
+    std::vector<GLubyte> colors;
+    owners.clear();
+    for (size_t s=0; s < ships.size(); ++s)
+    {
+        const Entry& e = ships[s];
+        const Ship& ship = *e.ship;
+        for (size_t y=0; y < ship.height; ++y)
+        {
+            for (size_t x=0; x < ship.width; ++x)
+            {
+                const uint8_t* const pixel = &ship.data[4*(y*ship.width + x)];
+                if (!pixel[3])  continue;
+
+                corners.push_back(e.u + x);
+                corners.push_back(e.v + ship.height - y - 1);
+                colors.insert(colors.end(), pixel, pixel + 3);
+                owners.push_back(s);
+            }
+        }
+    }
+    pixel_count = owners.size();
+
+    // Pack the instance data into one interleaved buffer
+    const size_t stride = 2*sizeof(GLushort) + 4*sizeof(GLubyte)
+                        + sizeof(GLuint);
+    std::vector<GLubyte> instances(pixel_count * stride, 0);
+    for (size_t i=0; i < pixel_count; ++i)
+    {
+        GLubyte* const p = &instances[i * stride];
+        memcpy(p, &corners[2*i], 2*sizeof(GLushort));
+        memcpy(p + 4, &colors[3*i], 3);
+        memcpy(p + 8, &owners[i], sizeof(GLuint));
+    }
+
+    glGenBuffers(1, &pixel_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, pixel_buf);
+    glBufferData(GL_ARRAY_BUFFER, instances.size(), &instances[0],
+                 GL_STATIC_DRAW);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::MakeFramebuffer()
+{
+    glGenFramebuffers(2, state_fbo);
+    glGenFramebuffers(4, derivative_fbo);
+
+    for (int i=0; i < 6; ++i)
+    {
+        const GLuint fbo = i < 2 ? state_fbo[i] : derivative_fbo[i - 2];
+        const GLuint tex = i < 2 ? state_tex[i] : derivative_tex[i - 2];
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, tex, 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::MakeVertexArray()
+{
+    // Vertex array for simulation passes: one point per live node
+    glGenVertexArrays(1, &node_vao);
+    glBindVertexArray(node_vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, node_buf);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, link_buf);
+    glEnableVertexAttribArray(1);
+    glVertexAttribIPointer(1, 2, GL_UNSIGNED_BYTE, 2*sizeof(GLubyte), 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, ship_buf);
+    glEnableVertexAttribArray(2);
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, sizeof(GLuint), 0);
+
+    // Vertex array for drawing: every attribute advances once per instance
+    // (pixel), while the quad's corners come from gl_VertexID.
+    glGenVertexArrays(1, &draw_vao);
+    glBindVertexArray(draw_vao);
+
+    const GLsizei stride = 2*sizeof(GLushort) + 4*sizeof(GLubyte)
+                         + sizeof(GLuint);
+    glBindBuffer(GL_ARRAY_BUFFER, pixel_buf);
+    glEnableVertexAttribArray(0);
+    glVertexAttribIPointer(0, 2, GL_UNSIGNED_SHORT, stride, (GLvoid*)0);
+    glVertexAttribDivisor(0, 1);
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribIPointer(1, 3, GL_UNSIGNED_BYTE, stride, (GLvoid*)4);
+    glVertexAttribDivisor(1, 1);
+
+    glEnableVertexAttribArray(2);
+    glVertexAttribIPointer(2, 1, GL_UNSIGNED_INT, stride, (GLvoid*)8);
+    glVertexAttribDivisor(2, 1);
+
+    glBindVertexArray(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Fleet::MakeReduction()
+{
+    // Make SUM_LEVELS textures, each half the size of the one before (the
+    // atlas is a whole number of SUM_BLOCK squares, so they halve exactly)
+    size_t w = atlas_width;
+    size_t h = atlas_height;
+    for (size_t i=0; i < SUM_LEVELS; ++i)
+    {
+        w /= 2;
+        h /= 2;
+
+        GLuint tex;
+        glGenTextures(1, &tex);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h,
+                     0, GL_RGBA, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        sum_tex.push_back(tex);
+
+        GLuint fbo;
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, tex, 0);
+        sum_fbo.push_back(fbo);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenVertexArrays(1, &quad_vao);
+
+    // Make the ring of buffers that the last level is read back into
+    glGenBuffers(POSITION_READBACKS, position_pbo);
+    for (auto pbo : position_pbo)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, w*h*4*sizeof(GLfloat), NULL,
+                     GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
@@ -0,0 +1,10 @@
+#version 330
+
+flat in vec4 color_out;
+
+out vec4 fragColor;
+
+void main()
+{
+    fragColor = color_out;
+}
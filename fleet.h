@@ -0,0 +1,220 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <GLFW/glfw3.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+class Ship;
+
+// A set of ships simulated together on the GPU.
+//
+// Every ship's node grid is packed into one shared atlas texture, with
+// positions stored in world coordinates, so each RK4 stage runs as a
+// single pass over every live node in the fleet (rather than one pass per
+// ship).  Engine flags are stored per ship in a buffer texture, and all
+// ships are drawn with a single instanced draw call.
+class Fleet
+{
+public:
+    Fleet();
+    ~Fleet();
+
+    // Adds a ship with its lower-left corner at world position (x, y),
+    // returning the ship's index.  Images are only loaded once, however
+    // many ships use them.  Ships must be added before calling Pack.
+    size_t AddShip(const std::string& imagename, const float x, const float y);
+
+    // Adds count ships in a square grid, starting at the origin, cycling
+    // through the given images (which are loaded together first) and
+    // leaving half of the largest ship's size between neighbors.  There
+    // must be at least one image.
+    void AddGrid(const std::vector<std::string>& imagenames,
+                 const size_t count);
+
+    // Loads every image that isn't loaded yet, decoding them (and building
+    // their node lists) in parallel on a thread pool, so that adding ships
+    // that use them afterwards is cheap.  If any image can't be read, this
+    // exits with its error once the pool has finished.
+    void LoadImages(const std::vector<std::string>& imagenames);
+
+    // Packs every ship into the atlas and builds the textures and buffers
+    // used to simulate and draw them.  Needs an OpenGL context.
+    void Pack();
+
+    // Number of ships in the fleet
+    size_t size() const { return ships.size(); }
+
+    // Sets the engine flags for a ship, with the same meanings as
+    // Ship::thrustEnginesOn, leftEnginesOn and rightEnginesOn.
+    void SetEngines(const size_t ship, const bool thrust,
+                    const bool left, const bool right);
+
+    // Turns on contact forces between the nodes of different ships (see
+    // SHIP_CONTACT_RADIUS), which are found with a spatial hash of every
+    // node, rebuilt on the GPU at the start of every substep.  A node that
+    // doesn't fit in the hash (until it grows; see CheckHash) ignores other
+    // nodes as they ignore it, so contact forces always come in pairs.
+    // Must be called after Pack.
+    void SetCollisions(const bool enabled);
+
+    // Keeps every node inside a world-space box (xmin, ymin, xmax, ymax)
+    // with the same contact forces, while collisions are on.  An empty box
+    // (the default) means no walls.
+    void SetWalls(const float box[4]);
+
+    // Returns the fleet's world-space bounding box at rest
+    void GetBounds(float box[4]) const;
+
+    void Update(const float dt=0.1, const int steps=5);
+
+    // Draws every ship, fitting the fleet's starting bounds to the window
+    // and centering on them (or on the mean centroid, if track is true).
+    void Draw(const int window_width, const int window_height,
+              const bool track, const float scale) const;
+
+    // Returns a ship's centroid and mean velocity.  These are read back
+    // from the GPU asynchronously, so they may be a few frames old.
+    void GetPosition(const size_t ship,
+                     float centroid[2], float velocity[2]) const;
+
+    // Blocks until the positions found by the last Update are available
+    void WaitForPosition();
+
+private:
+    struct Entry
+    {
+        const Ship* ship;   // image and nodes (may be shared between entries)
+
+        float x, y;         // world position of the ship's lower-left node
+        size_t u, v;        // atlas position of the ship's lower-left node
+
+        // Range of this ship's nodes in the fleet's node list
+        size_t begin, end;
+
+        uint8_t engines;    // bitmask of FLEET_*_BIT values
+
+        float centroid[2];
+        float velocity[2];
+    };
+
+    // Returns the ship for the given image, loading it if necessary.
+    const Ship* Load(const std::string& imagename);
+
+    // Returns a size rounded up to a whole number of SUM_BLOCK squares
+    static size_t Pad(const size_t size);
+
+    // Assigns each ship a region of the atlas, and sets the atlas size.
+    void PackAtlas();
+
+    void MakeTextures();
+    void MakeBuffers();
+    void MakeFramebuffer();
+    void MakeVertexArray();
+    void MakeReduction();
+
+    // Same contracts as the Ship functions of the same names,
+    // but running over every ship at once.
+    void GetDerivatives(const int source, const int out);
+    void ApplyDerivatives(const float dt, const int source);
+    void GetNextState(const float dt);
+    void FindPosition();
+    void ReadPosition(const bool wait);
+    void RenderToFBO(const GLuint fbo);
+    void BindTextures() const;
+
+    // Stores every node of state_tex[tick] in the spatial hash, in the slot
+    // of the cell that it's in (see hash.vert).  Each layer keeps the node
+    // with the lowest atlas index that's left in each slot, by depth
+    // testing, and the next layer is only built if that one stored a node
+    // (which the GPU checks with a query, without waiting for the CPU).
+    void BuildHash();
+
+    // (Re)allocates the spatial hash with the given number of layers
+    void MakeHash(const size_t layers);
+
+    // Doubles the spatial hash's layers if its last layer was needed the
+    // last time that it was built (which means that some slot had more
+    // nodes than layers).  Never waits for the GPU.
+    void CheckHash();
+
+    // Loaded images, by filename
+    std::map<std::string, Ship*> images;
+    std::vector<Entry> ships;
+    bool packed;
+
+    // Atlas size, in texels (nodes)
+    size_t atlas_width;
+    size_t atlas_height;
+
+    // Atlas index (u + v*atlas_width) of every live node in the fleet
+    std::vector<uint32_t> texels;
+
+    // Number of filled pixels in the fleet
+    size_t pixel_count;
+
+    // World-space bounding box of the fleet at rest (xmin, ymin, xmax, ymax)
+    float bounds[4];
+
+    // Set when engine flags have changed since they were last uploaded
+    bool engines_dirty;
+
+    // Contacts (see SetCollisions and SetWalls).  The spatial hash is an
+    // array texture of hash_layers layers of hash_size*hash_size slots,
+    // each slot holding the atlas index, ship and cell of one node (or -1
+    // if the slot is empty).  Each layer is also drawn into one of
+    // hash_peel, for the next layer to read, and has a framebuffer and an
+    // any-samples query; the depth buffer is shared by every layer.
+    bool collisions;
+    float walls[4];
+    size_t hash_size;
+    size_t hash_layers;
+    GLuint hash_tex;
+    GLuint hash_peel[2];
+    GLuint hash_depth;
+    std::vector<GLuint> hash_fbo;
+    std::vector<GLuint> hash_query;
+    bool hash_built;    // set once the queries hold results
+
+    // Buffers
+    GLuint node_buf;    // points at the atlas texel of each live node
+    GLuint link_buf;    // type and neighbor bitmask of each live node
+    GLuint ship_buf;    // ship index of each live node
+    GLuint pixel_buf;   // per-pixel instance data for drawing
+    GLuint engine_buf;  // engine bitmask of each ship
+
+    // Textures
+    GLuint state_tex[2];
+    GLuint derivative_tex[4];
+    GLuint engine_tex;  // buffer texture view of engine_buf
+
+    bool tick;
+
+    GLuint state_fbo[2];
+    GLuint derivative_fbo[4];
+
+    GLuint node_vao;
+    GLuint draw_vao;
+    GLuint quad_vao;
+
+    // Reduction chain used by FindPosition, as in Ship, but stopping once
+    // each texel holds the sums of a SUM_BLOCK square of the atlas.  Ships
+    // are packed on SUM_BLOCK boundaries (see PackAtlas), so every texel
+    // of the last level belongs to one ship.
+    enum {SUM_LEVELS=4, SUM_BLOCK=1 << SUM_LEVELS};
+    std::vector<GLuint> sum_tex;
+    std::vector<GLuint> sum_fbo;
+
+    // Ring of pixel-buffer objects that the last level of sums is read
+    // into, with a fence for each readback that hasn't been consumed.
+    enum {POSITION_READBACKS=3};
+    GLuint position_pbo[POSITION_READBACKS];
+    GLsync position_fence[POSITION_READBACKS];
+    size_t position_next;       // index of the next buffer to read into
+    size_t position_pending;    // number of readbacks in flight
+};
+
+#endif
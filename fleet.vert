@@ -0,0 +1,45 @@
+#version 330
+
+// One instance per filled pixel, drawn as a 4-vertex triangle strip
+layout(location=0) in uvec2 pixel;   // atlas coordinate of lower-left node
+layout(location=1) in uvec3 color;
+layout(location=2) in uint ship;
+
+flat out vec4 color_out;
+
+uniform sampler2D state;
+uniform usamplerBuffer engines;
+
+// World position at the center of the window, and world-to-NDC scale
+uniform vec2 center;
+uniform vec2 scale;
+
+bool matches(int r, int g, int b)
+{
+    return color == uvec3(r, g, b);
+}
+
+void main()
+{
+    color_out = vec4(vec3(color) / 255.0f, 1.0f);
+
+    // Hide engine pixels whose engines aren't firing, by moving
+    // them outside of the clip volume.
+    uint mask = texelFetch(engines, int(ship)).r;
+    if ((matches(SHIP_ENGINE_THRUST_R, SHIP_ENGINE_THRUST_G,
+                 SHIP_ENGINE_THRUST_B) && (mask & uint(FLEET_THRUST_BIT)) == 0u) ||
+        (matches(SHIP_ENGINE_LEFT_R, SHIP_ENGINE_LEFT_G,
+                 SHIP_ENGINE_LEFT_B) && (mask & uint(FLEET_LEFT_BIT)) == 0u) ||
+        (matches(SHIP_ENGINE_RIGHT_R, SHIP_ENGINE_RIGHT_G,
+                 SHIP_ENGINE_RIGHT_B) && (mask & uint(FLEET_RIGHT_BIT)) == 0u))
+    {
+        gl_Position = vec4(2.0f, 2.0f, 2.0f, 1.0f);
+        return;
+    }
+
+    // Each corner of the pixel's quad is positioned by its node
+    ivec2 corner = ivec2(gl_VertexID & 1, gl_VertexID >> 1);
+    vec2 xy = texelFetch(state, ivec2(pixel) + corner, 0).xy;
+
+    gl_Position = vec4((xy - center) * scale, 0.0f, 1.0f);
+}
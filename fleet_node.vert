@@ -0,0 +1,27 @@
+#version 330
+
+layout(location=0) in vec2 vertex_position;
+layout(location=1) in uvec2 node;    // node type and neighbor link bitmask
+layout(location=2) in uint ship;     // index of the node's ship in the fleet
+
+// Engine bitmask of each ship (FLEET_*_BIT)
+uniform usamplerBuffer engines;
+
+flat out uint links;
+flat out uint firing;
+flat out uint owner;
+
+// Expects to get points at texel centers of the fleet's atlas,
+// in normalized device coordinates
+void main()
+{
+    uint mask = texelFetch(engines, int(ship)).r;
+
+    links = node.y;
+    owner = ship;
+    firing = uint(
+        (node.x == uint(SHIP_ENGINE_THRUST) && (mask & uint(FLEET_THRUST_BIT)) != 0u) ||
+        (node.x == uint(SHIP_ENGINE_RIGHT) &&  (mask & uint(FLEET_RIGHT_BIT)) != 0u) ||
+        (node.x == uint(SHIP_ENGINE_LEFT) &&   (mask & uint(FLEET_LEFT_BIT)) != 0u));
+    gl_Position = vec4(vertex_position, 0.0f, 1.0f);
+}
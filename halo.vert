@@ -0,0 +1,15 @@
+#version 330
+
+layout(location=0) in vec2 vertex_position;
+layout(location=1) in ivec2 source_texel;   // texel of the node copied
+
+flat out ivec2 source;
+
+// Expects to get points at the centers of halo texels, in normalized device
+// coordinates, each with the texel of the node (in a neighboring block)
+// whose value it holds
+void main()
+{
+    source = source_texel;
+    gl_Position = vec4(vertex_position, 0.0f, 1.0f);
+}
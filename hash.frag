@@ -0,0 +1,14 @@
+#version 330
+
+flat in ivec4 entry;
+
+// The layer being built, and a copy for the next layer to read
+layout(location=0) out ivec4 fragColor;
+layout(location=1) out ivec4 peelColor;
+
+// Stores a node in its slot (if it passes the depth test)
+void main()
+{
+    fragColor = entry;
+    peelColor = entry;
+}
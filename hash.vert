@@ -0,0 +1,55 @@
+#version 330
+
+layout(location=0) in vec2 vertex_position;
+layout(location=2) in uint ship;     // index of the node's ship in the fleet
+
+uniform sampler2D state;
+
+// Spatial hash table size (in slots per side), the layer being built, and
+// a copy of the layer before it (see Fleet::BuildHash)
+uniform int table_size;
+uniform int layer;
+uniform isampler2D previous;
+
+flat out ivec4 entry;
+
+// Returns the slot of a cell (which must match Slot in derivatives.frag)
+ivec2 Slot(ivec2 cell)
+{
+    uint h = (uint(cell.x) * 73856093u) ^ (uint(cell.y) * 19349663u);
+    h &= uint(table_size * table_size - 1);
+    return ivec2(h % uint(table_size), h / uint(table_size));
+}
+
+// Expects to get points at texel centers of the fleet's atlas, in normalized
+// device coordinates, and moves each one to the slot of its node's cell.
+void main()
+{
+    ivec2 atlas_size = textureSize(state, 0);
+    ivec2 texel = ivec2((vertex_position * 0.5f + 0.5f) * vec2(atlas_size));
+    ivec2 cell = ivec2(floor(texelFetch(state, texel, 0).xy /
+                             SHIP_CONTACT_CELL));
+    ivec2 slot = Slot(cell);
+
+    // Each slot holds the atlas index and ship of a node, plus its cell
+    // (so that lookups can skip nodes from other cells in the same slot)
+    int index = texel.x + texel.y * atlas_size.x;
+    entry = ivec4(index, int(ship), cell);
+
+    // The depth test keeps the lowest index in each slot.  Nodes that were
+    // kept by the last layer (or before it) are moved outside the clip
+    // volume, so this layer keeps the next lowest.
+    if (layer > 0)
+    {
+        int kept = texelFetch(previous, slot, 0).x;
+        if (kept < 0 || index <= kept)
+        {
+            gl_Position = vec4(2.0f, 2.0f, 2.0f, 1.0f);
+            return;
+        }
+    }
+
+    float depth = (float(index) + 0.5f) / float(atlas_size.x * atlas_size.y);
+    gl_Position = vec4((vec2(slot) + 0.5f) / float(table_size) * 2.0f - 1.0f,
+                       depth * 2.0f - 1.0f, 1.0f);
+}
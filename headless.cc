@@ -0,0 +1,135 @@
+#include <iostream>
+
+#include "headless.h"
+
+#ifdef PIXELSIM_EGL
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static EGLSurface surface = EGL_NO_SURFACE;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns an initialized EGL display.  Tries the default display first,
+// then Mesa's surfaceless platform (which works with no X server at all).
+static EGLDisplay GetDisplay()
+{
+    EGLDisplay d = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (d != EGL_NO_DISPLAY && eglInitialize(d, NULL, NULL))
+    {
+        return d;
+    }
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+                "eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+    {
+        d = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                               EGL_DEFAULT_DISPLAY, NULL);
+        if (d != EGL_NO_DISPLAY && eglInitialize(d, NULL, NULL))
+        {
+            return d;
+        }
+    }
+#endif
+
+    return EGL_NO_DISPLAY;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool MakeHeadlessContext(const int width, const int height)
+{
+    display = GetDisplay();
+    if (display == EGL_NO_DISPLAY)
+    {
+        std::cerr << "[pixelsim]    Error: failed to open EGL display!"
+                  << std::endl;
+        return false;
+    }
+
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE};
+    EGLConfig config;
+    EGLint count;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &count) ||
+        count == 0)
+    {
+        std::cerr << "[pixelsim]    Error: no suitable EGL config!"
+                  << std::endl;
+        return false;
+    }
+
+    const EGLint surface_attribs[] = {
+        EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    surface = eglCreatePbufferSurface(display, config, surface_attribs);
+
+    // Match the context that main.cc asks GLFW for.
+    eglBindAPI(EGL_OPENGL_API);
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE};
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT,
+                               context_attribs);
+
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(display, surface, surface, context))
+    {
+        std::cerr << "[pixelsim]    Error: failed to create EGL context!"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void DestroyHeadlessContext()
+{
+    if (display == EGL_NO_DISPLAY)  return;
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (context != EGL_NO_CONTEXT)  eglDestroyContext(display, context);
+    if (surface != EGL_NO_SURFACE)  eglDestroySurface(display, surface);
+    eglTerminate(display);
+
+    display = EGL_NO_DISPLAY;
+    context = EGL_NO_CONTEXT;
+    surface = EGL_NO_SURFACE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+HeadlessProc GetHeadlessProcAddress(const char* name)
+{
+    return (HeadlessProc)eglGetProcAddress(name);
+}
+
+#else   // PIXELSIM_EGL
+
+bool MakeHeadlessContext(const int width, const int height)
+{
+    return false;
+}
+
+void DestroyHeadlessContext()
+{
+    // Nothing to do here
+}
+
+HeadlessProc GetHeadlessProcAddress(const char* name)
+{
+    return NULL;
+}
+
+#endif
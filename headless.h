@@ -0,0 +1,18 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// Creates an offscreen OpenGL 3.3 core context (with a default framebuffer
+// of the given size) and makes it current, without needing a display.
+// Returns false if no such context can be made (or if pixelsim was built
+// without EGL).
+bool MakeHeadlessContext(const int width, const int height);
+
+// Releases the context made by MakeHeadlessContext.
+void DestroyHeadlessContext();
+
+// Returns the address of an OpenGL function in the headless context
+// (or NULL if it's missing).
+typedef void (*HeadlessProc)();
+HeadlessProc GetHeadlessProcAddress(const char* name);
+
+#endif
@@ -0,0 +1,258 @@
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>  // memset
+#include <iostream>
+
+#include <png.h>
+
+#include "image.h"
+#include "constants.h"
+#include "trace.h"
+
+// Node types, with the same values as Ship::NodeType
+enum {EMPTY=0, SHIP=1};
+
+// State shared with libpng's callbacks while an image is decoded
+struct Reader
+{
+    const std::string* filename;
+    Image image;
+    std::string error;
+    int passes;     // 1, or 7 for interlaced images
+    bool done;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns the node type of an RGBA pixel.
+// Pure red nodes are thruster engines
+// Red with 1 bit of blue are leftward engines
+// Red with 2 bits of blue are rightward engines
+static uint8_t GetType(const uint8_t* const pixel)
+{
+    const uint8_t r = pixel[0];
+    const uint8_t g = pixel[1];
+    const uint8_t b = pixel[2];
+    const uint8_t a = pixel[3];
+
+    if      (r == SHIP_ENGINE_THRUST_R &&
+             g == SHIP_ENGINE_THRUST_G &&
+             b == SHIP_ENGINE_THRUST_B && a)    return SHIP_ENGINE_THRUST;
+    else if (r == SHIP_ENGINE_LEFT_R &&
+             g == SHIP_ENGINE_LEFT_G &&
+             b == SHIP_ENGINE_LEFT_B && a)      return SHIP_ENGINE_LEFT;
+    else if (r == SHIP_ENGINE_RIGHT_R &&
+             g == SHIP_ENGINE_RIGHT_G &&
+             b == SHIP_ENGINE_RIGHT_B && a)     return SHIP_ENGINE_RIGHT;
+    else if (a)                                 return SHIP;
+    else                                        return EMPTY;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Merges the node types of a decoded row into the corners around it.  A
+// corner touching pixels of different types becomes a plain SHIP node.
+static void Classify(Image* image, const size_t row)
+{
+    const size_t width = image->width;
+    const uint8_t* const pixels = &image->pixels[row*width*4];
+
+    // Rows are stored top first, but the grid's y axis points up
+    const size_t y = image->height - 1 - row;
+
+    for (size_t x=0; x < width; ++x)
+    {
+        const uint8_t type = GetType(&pixels[x*4]);
+        const size_t indices[] = {
+                y*(width+1) + x, (y+1)*(width+1) + x,
+                y*(width+1) + x + 1, (y+1)*(width+1) + x + 1};
+
+        for (size_t i : indices) {
+            uint8_t& f = image->filled[i];
+            if (f == EMPTY)                         f = type;
+            else if (type != EMPTY && f != type)    f = SHIP;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Errors jump back to Decode (which may be running on a worker thread),
+// so that the caller can decide what to do with them
+static void OnError(png_structp png, png_const_charp message)
+{
+    Reader* r = static_cast<Reader*>(png_get_error_ptr(png));
+    r->error = message;
+    png_longjmp(png, 1);
+}
+
+static void OnWarning(png_structp png, png_const_charp message)
+{
+    const Reader* r = static_cast<Reader*>(png_get_error_ptr(png));
+    std::cerr << "[pixelsim]    Warning: " << *r->filename
+              << ": " << message << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Called once the header is read: asks libpng to convert rows to 8-bit
+// RGBA, then allocates the image's buffers
+static void OnInfo(png_structp png, png_infop info)
+{
+    Reader* r = static_cast<Reader*>(png_get_progressive_ptr(png));
+
+    png_uint_32 width, height;
+    int depth, color;
+    png_get_IHDR(png, info, &width, &height, &depth, &color,
+                 NULL, NULL, NULL);
+
+    const bool trns = png_get_valid(png, info, PNG_INFO_tRNS);
+    if (color == PNG_COLOR_TYPE_PALETTE)    png_set_palette_to_rgb(png);
+    if (color == PNG_COLOR_TYPE_GRAY && depth < 8)
+    {
+        png_set_expand_gray_1_2_4_to_8(png);
+    }
+    if (trns)   png_set_tRNS_to_alpha(png);
+    if (depth == 16)    png_set_strip_16(png);
+    if (!(color & PNG_COLOR_MASK_COLOR))    png_set_gray_to_rgb(png);
+    if (!(color & PNG_COLOR_MASK_ALPHA) && !trns)
+    {
+        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+    }
+    r->passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    if (png_get_rowbytes(png, info) != width*4)
+    {
+        png_error(png, "can't convert image to 8-bit RGBA");
+    }
+
+    Image& image = r->image;
+    image.width = width;
+    image.height = height;
+    image.pixels = new uint8_t[width*height*4];
+    image.filled = new uint8_t[(width+1)*(height+1)];
+    memset(image.filled, 0, (width+1)*(height+1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Called with each decoded row (once per pass, for interlaced images)
+static void OnRow(png_structp png, png_bytep row, png_uint_32 y, int pass)
+{
+    // Interlaced images get a NULL row when a pass doesn't touch it
+    if (!row)   return;
+
+    Reader* r = static_cast<Reader*>(png_get_progressive_ptr(png));
+    Image& image = r->image;
+    png_progressive_combine_row(png, &image.pixels[y*image.width*4], row);
+
+    // Rows of interlaced images aren't finished until the last pass, so
+    // they're classified at the end instead
+    if (r->passes == 1)     Classify(&image, y);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void OnEnd(png_structp png, png_infop info)
+{
+    Reader* r = static_cast<Reader*>(png_get_progressive_ptr(png));
+    if (r->passes != 1)
+    {
+        for (size_t y=0; y < r->image.height; ++y)  Classify(&r->image, y);
+    }
+    r->done = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Feeds a file to libpng until the image is decoded, returning false if
+// libpng reports an error (which is left in r->error).  This is kept apart
+// from Image::Load so that nothing it changes lives across the setjmp.
+static bool Decode(FILE* input, Reader* r)
+{
+    png_structp png = png_create_read_struct(
+            PNG_LIBPNG_VER_STRING, r, OnError, OnWarning);
+    png_infop info = png_create_info_struct(png);
+    if (!png || !info)
+    {
+        png_destroy_read_struct(&png, &info, NULL);
+        r->error = "out of memory";
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_read_struct(&png, &info, NULL);
+        return false;
+    }
+    png_set_progressive_read_fn(png, r, OnInfo, OnRow, OnEnd);
+
+    png_byte chunk[1 << 16];
+    size_t count;
+    while (!r->done && (count = fread(chunk, 1, sizeof(chunk), input)))
+    {
+        png_process_data(png, info, chunk, count);
+    }
+    png_destroy_read_struct(&png, &info, NULL);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Image::Load(const std::string& filename, Image* image,
+                 std::string* error)
+{
+    TRACE_SCOPE("Image::Load");
+
+    FILE* input = fopen(filename.c_str(), "rb");
+    if (!input)
+    {
+        *error = "Can't open " + filename;
+        return false;
+    }
+
+    Reader r;
+    r.filename = &filename;
+    r.image.width = 0;
+    r.image.height = 0;
+    r.image.pixels = NULL;
+    r.image.filled = NULL;
+    r.passes = 1;
+    r.done = false;
+
+    const bool decoded = Decode(input, &r);
+    fclose(input);
+
+    if (!decoded)
+    {
+        *error = "Can't decode " + filename + ": " + r.error;
+    }
+    else if (!r.done)
+    {
+        *error = filename + " is truncated or isn't a PNG";
+    }
+    else
+    {
+        *image = r.image;
+        return true;
+    }
+
+    delete [] r.image.pixels;
+    delete [] r.image.filled;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Image Image::Load(const std::string& filename)
+{
+    Image image;
+    std::string error;
+    if (!Load(filename, &image, &error))
+    {
+        std::cerr << "[pixelsim]    Error: " << error << std::endl;
+        exit(-1);
+    }
+    return image;
+}
@@ -0,0 +1,33 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstdint>
+#include <string>
+
+// A ship's image, decoded from a PNG as 8-bit RGBA (top row first), along
+// with the node type that its pixels give each of the (width+1)*(height+1)
+// grid corners (see Ship::NodeType).
+//
+// Images are read with libpng's progressive reader: the file is fed to it
+// in chunks, and each row is converted to RGBA as it's decoded (palette,
+// gray, 16-bit and tRNS transparency are all expanded), copied straight
+// into pixels, and classified into node types before the next row arrives.
+// Images without alpha are fully opaque.
+struct Image
+{
+    // Decodes a PNG, exiting with an error if it can't be read.  The
+    // buffers are allocated with new[], and belong to the caller.
+    static Image Load(const std::string& filename);
+
+    // Decodes a PNG into image, or returns false and describes what went
+    // wrong in error (so that it's safe to call from worker threads).
+    static bool Load(const std::string& filename, Image* image,
+                     std::string* error);
+
+    size_t width;
+    size_t height;
+    uint8_t* pixels;
+    uint8_t* filled;
+};
+
+#endif
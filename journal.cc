@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "journal.h"
+
+// Version written to (and accepted from) the header line
+static const int JOURNAL_VERSION = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+
+JournalWriter::JournalWriter(const std::string& filename,
+                             const std::string& image,
+                             const std::string& settings)
+    : file(fopen(filename.c_str(), "w")), frames(0), engines(-1)
+{
+    if (!file)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot write journal to '"
+                  << filename << "'" << std::endl;
+        exit(-1);
+    }
+
+    fprintf(file, "pixelsim-journal %i\n", JOURNAL_VERSION);
+    fprintf(file, "image %s\n", image.c_str());
+    fprintf(file, "settings %s\n", settings.c_str());
+    fflush(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+JournalWriter::~JournalWriter()
+{
+    fprintf(file, "end %zu\n", frames);
+    fclose(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void JournalWriter::Record(const size_t frame, const uint8_t e)
+{
+    if (e != engines)
+    {
+        fprintf(file, "%zu %i\n", frame, e);
+        fflush(file);
+        engines = e;
+    }
+    frames = frame + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+JournalReader::JournalReader(const std::string& filename)
+    : frames(0)
+{
+    std::ifstream in(filename);
+    if (!in)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot open journal '"
+                  << filename << "'" << std::endl;
+        exit(-1);
+    }
+
+    auto fail = [&](const std::string& line)
+    {
+        std::cerr << "[pixelsim]    Error: Invalid line in journal '"
+                  << filename << "': '" << line << "'" << std::endl;
+        exit(-1);
+    };
+
+    std::string line;
+    std::getline(in, line);
+    int version = 0;
+    if (sscanf(line.c_str(), "pixelsim-journal %i", &version) != 1)
+    {
+        fail(line);
+    }
+    else if (version != JOURNAL_VERSION)
+    {
+        std::cerr << "[pixelsim]    Error: Unsupported journal version "
+                  << version << std::endl;
+        exit(-1);
+    }
+
+    bool ended = false;
+    while (std::getline(in, line))
+    {
+        if (line.empty())   continue;
+
+        std::stringstream ss(line);
+        std::string key;
+        ss >> key;
+
+        if (key == "image" || key == "settings")
+        {
+            std::string value;
+            std::getline(ss, value);
+            value.erase(0, value.find_first_not_of(' '));
+            (key == "image" ? image : settings) = value;
+        }
+        else if (key == "end")
+        {
+            if (!(ss >> frames))    fail(line);
+            ended = true;
+        }
+        else
+        {
+            Change c;
+            int e;
+            c.frame = std::strtoull(key.c_str(), NULL, 10);
+            if (key.find_first_not_of("0123456789") != std::string::npos ||
+                !(ss >> e) || e < 0 || e > 7 ||
+                (!changes.empty() && c.frame <= changes.back().frame))
+            {
+                fail(line);
+            }
+            c.engines = e;
+            changes.push_back(c);
+        }
+    }
+
+    if (!ended)
+    {
+        frames = changes.empty() ? 0 : changes.back().frame + 1;
+        std::cerr << "[pixelsim]    Journal '" << filename << "' has no end; "
+                  << "replaying " << frames << " frames" << std::endl;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint8_t JournalReader::GetEngines(const size_t frame) const
+{
+    // Find the last change at or before this frame
+    auto c = std::upper_bound(changes.begin(), changes.end(), frame,
+            [](const size_t f, const Change& c) { return f < c.frame; });
+    return c == changes.begin() ? 0 : (c - 1)->engines;
+}
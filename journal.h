@@ -0,0 +1,76 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Journals of engine inputs, for replaying a run exactly.
+//
+// A journal is a text file:
+//
+//      pixelsim-journal 1
+//      image ship.png
+//      settings rk4 steps=50 stiffness=1
+//      0 0
+//      212 1
+//      260 0
+//      end 600
+//
+// After the header, each "frame mask" line gives the engine flags (as a sum
+// of FLEET_*_BIT values) used from that frame on, and the final line gives
+// the number of frames that were run.  The image and settings are only
+// recorded so that a replay can warn if they don't match.
+
+class JournalWriter
+{
+public:
+    // Opens the journal and writes its header.  Exits if the file can't be
+    // written.
+    JournalWriter(const std::string& filename, const std::string& image,
+                  const std::string& settings);
+
+    // Writes the number of frames recorded, then closes the journal.
+    ~JournalWriter();
+
+    // Records the engine flags used to step a frame.  Frames must be
+    // recorded in order; only changes are written (and flushed, so that
+    // the journal survives a crash).
+    void Record(const size_t frame, const uint8_t engines);
+
+private:
+    FILE* file;
+    size_t frames;      // number of frames recorded so far
+    int engines;        // last flags written, or -1 if there are none
+};
+
+class JournalReader
+{
+public:
+    // Reads a journal, exiting if it can't be read or is malformed.  A
+    // journal without an end line (from a run that crashed) ends after
+    // its last change.
+    JournalReader(const std::string& filename);
+
+    // Returns the engine flags to use when stepping the given frame
+    uint8_t GetEngines(const size_t frame) const;
+
+    size_t GetFrames() const { return frames; }
+    const std::string& GetImage() const { return image; }
+    const std::string& GetSettings() const { return settings; }
+
+private:
+    struct Change
+    {
+        size_t frame;
+        uint8_t engines;
+    };
+    std::vector<Change> changes;    // in frame order
+
+    size_t frames;
+    std::string image;
+    std::string settings;
+};
+
+#endif
@@ -1,15 +1,24 @@
 #include <iostream>
+#include <cstring>
 #include <chrono>
 #include <thread>
 #include <sstream>
 #include <iomanip>
+#include <vector>
+#include <deque>
 
 #include <GLFW/glfw3.h>
 
-#include <png.h>
-
 #include "ship.h"
+#include "fleet.h"
 #include "shaders.h"
+#include "headless.h"
+#include "recorder.h"
+#include "simulation.h"
+#include "journal.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "trace.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -19,13 +28,367 @@ struct WindowSize
     int width, height;
 };
 
+// Command-line options
+struct Options
+{
+    Options() : window_size(640, 480), record(false), track(false),
+                scale(0.9), backend(Ship::GPU), fused(false), tolerance(0),
+                implicit(false), stiffness(1), half(false), sleep(0),
+                threaded(false),
+                headless(false), frames(0), fleet(0), collide(false),
+                trajectory_mode(Trajectory::SUMMARY),
+                trajectory_compression(Trajectory::RAW), stride(1) {}
+
+    std::string filename;
+    WindowSize window_size;
+    bool record;
+    std::string y4m;    // Y4M file or |command to record to, if not empty
+    bool track;
+    float scale;
+    Ship::Backend backend;
+    bool fused;
+    float tolerance;    // error tolerance for adaptive stepping, or 0
+    bool implicit;
+    float stiffness;    // scale applied to spring and damper constants
+    bool half;          // store GPU derivatives at half precision
+    float sleep;        // threshold for sleeping regions, or 0
+    bool threaded;      // simulate on a separate thread from drawing
+    bool headless;
+    size_t frames;
+    size_t fleet;   // number of ships in a fleet, or 0 for a single Ship
+    std::vector<std::string> fleet_images;  // images that ships cycle through
+    bool collide;   // turn on contacts between the fleet's ships
+    std::string trace;  // file to write a Chrome trace to, if not empty
+    std::string journal;    // file to record engine inputs to, if not empty
+    std::string replay;     // journal to replay, if not empty
+    std::string checkpoint; // file to save a checkpoint to, if not empty
+    std::string trajectory; // file to stream a trajectory to, if not empty
+    Trajectory::Mode trajectory_mode;
+    Trajectory::Compression trajectory_compression;
+    size_t stride;      // record every stride'th frame of the trajectory
+    std::string dump;   // trajectory to print as CSV, if not empty
+};
+
+// Returns true if a filename is a checkpoint to resume from (rather than
+// an image to start from)
+bool IsCheckpoint(const std::string& filename)
+{
+    return filename.size() >= 5 &&
+           filename.compare(filename.size() - 5, 5, ".ckpt") == 0;
+}
+
+// Describes the settings that affect the simulation's results, for
+// recording in journals
+std::string GetSettings(const Options& opts)
+{
+    std::stringstream ss;
+    ss << (opts.implicit ? "implicit" : opts.fused ? "fused" : "rk4")
+       << " steps=" << (opts.implicit ? 1 : opts.collide ? 100 : 50)
+       << " stiffness=" << opts.stiffness;
+    if (opts.tolerance) ss << " tolerance=" << opts.tolerance;
+    if (opts.half)      ss << " half";
+    if (opts.sleep)     ss << " sleep=" << opts.sleep;
+    if (opts.fleet)     ss << " fleet=" << opts.fleet;
+    for (const auto& name : opts.fleet_images)  ss << " +" << name;
+    if (opts.collide)   ss << " collide";
+    return ss.str();
+}
+
+// The simulation being run: either a single ship or a fleet of copies of it
+struct Scene
+{
+    Scene(const Options& opts, const bool graphics)
+        : ship(NULL), fleet(NULL), simulation(NULL), journal(NULL),
+          frame(0), engines(0), trajectory(NULL), readback(false)
+    {
+        if (opts.fleet)
+        {
+            fleet = new Fleet;
+            std::vector<std::string> images = {opts.filename};
+            images.insert(images.end(), opts.fleet_images.begin(),
+                          opts.fleet_images.end());
+            fleet->AddGrid(images, opts.fleet);
+            fleet->Pack();
+
+            // Walls are the fleet's starting bounds, grown by half of
+            // their size on every side
+            if (opts.collide)
+            {
+                float box[4];
+                fleet->GetBounds(box);
+                const float w = box[2] - box[0];
+                const float h = box[3] - box[1];
+                const float walls[4] = {box[0] - w/2, box[1] - h/2,
+                                        box[2] + w/2, box[3] + h/2};
+                fleet->SetCollisions(true);
+                fleet->SetWalls(walls);
+            }
+        }
+        else
+        {
+            if (IsCheckpoint(opts.filename))
+            {
+                Checkpoint checkpoint(opts.filename);
+                ship = new Ship(checkpoint, opts.backend, graphics);
+            }
+            else
+            {
+                ship = new Ship(opts.filename, opts.backend, graphics);
+            }
+            if (opts.fused)     ship->SetFused(true);
+            if (opts.tolerance) ship->SetTolerance(opts.tolerance);
+            if (opts.implicit)  ship->SetImplicit(true);
+            if (opts.stiffness != 1)    ship->SetStiffness(opts.stiffness);
+            if (opts.half)      ship->SetPrecision(Ship::HALF);
+            if (opts.sleep)     ship->SetSleeping(opts.sleep);
+        }
+
+        // Implicit steps are stable at any stiffness, so take one per frame.
+        // Ships pressed together by contacts are squashed into shapes
+        // that need shorter explicit steps.
+        steps = opts.implicit ? 1 : opts.collide ? 100 : 50;
+
+        if (!opts.journal.empty())
+        {
+            journal = new JournalWriter(opts.journal, opts.filename,
+                                        GetSettings(opts));
+        }
+
+        if (!opts.trajectory.empty())
+        {
+            trajectory = new TrajectoryWriter(
+                    opts.trajectory, ship->GetWidth(), ship->GetHeight(),
+                    ship->GetNodes(), opts.trajectory_mode,
+                    opts.trajectory_compression, opts.stride);
+            readback = opts.backend == Ship::GPU;
+            if (readback)   trajectory->SetTexelIndex(ship->GetTexelIndex());
+            else            state.resize((ship->GetWidth() + 1)*
+                                         (ship->GetHeight() + 1)*4);
+            Record();
+        }
+
+        if (opts.threaded)
+        {
+            simulation = new Simulation(ship, 1.0/60, steps, journal,
+                                        trajectory);
+        }
+    }
+
+    ~Scene()
+    {
+        delete simulation;
+        FinishReadbacks();
+        delete trajectory;
+        delete journal;
+        delete ship;
+        delete fleet;
+    }
+
+    // Sets engine flags (for every ship in a fleet)
+    void SetEngines(const bool thrust, const bool left, const bool right)
+    {
+        engines = (thrust ? FLEET_THRUST_BIT : 0) |
+                  (left   ? FLEET_LEFT_BIT   : 0) |
+                  (right  ? FLEET_RIGHT_BIT  : 0);
+
+        if (simulation)
+        {
+            simulation->SetEngines(thrust, left, right);
+        }
+        else if (fleet)
+        {
+            for (size_t i=0; i < fleet->size(); ++i)
+            {
+                fleet->SetEngines(i, thrust, left, right);
+            }
+        }
+        else
+        {
+            ship->thrustEnginesOn = thrust;
+            ship->leftEnginesOn = left;
+            ship->rightEnginesOn = right;
+        }
+    }
+
+    // Steps the simulation by one frame (unless it's running on its own
+    // thread, in which case this does nothing)
+    void Update()
+    {
+        if (simulation)     return;
+
+        if (journal)    journal->Record(frame, engines);
+        frame++;
+
+        if (fleet)  fleet->Update(1.0e0/60, steps);
+        else        ship->Update(1.0e0/60, steps);
+        Record();
+    }
+
+    // Adds the ship's state to the trajectory, if this frame is wanted.
+    // On the GPU, states are read back asynchronously and handed to the
+    // trajectory's writer thread once they arrive, so this only waits if
+    // every readback buffer is still in use.
+    void Record()
+    {
+        if (!trajectory)    return;
+        if (!readback)
+        {
+            if (!trajectory->Wants(frame))  return;
+            ship->GetState(&state[0]);
+            trajectory->Add(frame, &state[0]);
+            return;
+        }
+
+        if (trajectory->Wants(frame))
+        {
+            while (!ship->StartStateReadback(frame))    HandOff(true);
+        }
+        HandOff(false);
+    }
+
+    // Hands every finished readback to the trajectory writer, then unmaps
+    // the ones that it has copied.  If wait is true, waits for at least
+    // the oldest readback to be finished and copied.
+    void HandOff(const bool wait)
+    {
+        uint64_t f;
+        while (const float* texels = ship->MapState(wait && mapped.empty(),
+                                                    &f))
+        {
+            trajectory->AddTexels(f, texels);
+            mapped.push_back(f);
+        }
+        for (bool w=wait; !mapped.empty() &&
+                          trajectory->Copied(mapped.front(), w); w=false)
+        {
+            ship->ReleaseState();
+            mapped.pop_front();
+        }
+    }
+
+    // Waits for every readback to be read and copied by the trajectory
+    // writer (which needs the context that the readbacks are mapped from)
+    void FinishReadbacks()
+    {
+        if (!readback)  return;
+        uint64_t f;
+        while (const float* texels = ship->MapState(true, &f))
+        {
+            trajectory->AddTexels(f, texels);
+            mapped.push_back(f);
+        }
+        while (!mapped.empty())
+        {
+            trajectory->Copied(mapped.front(), true);
+            ship->ReleaseState();
+            mapped.pop_front();
+        }
+    }
+
+    void Draw(const int width, const int height,
+              const bool track, const float scale) const
+    {
+        if (simulation) simulation->Draw(width, height, track, scale);
+        else if (fleet) fleet->Draw(width, height, track, scale);
+        else        ship->Draw(width, height, track, scale);
+    }
+
+    // Returns the number of substeps taken by the last Update
+    int GetSteps(int* rejected=NULL) const
+    {
+        if (ship && !simulation)    return ship->GetSteps(rejected);
+        if (rejected)   *rejected = 0;
+        return steps;
+    }
+
+    // Stops the simulation thread, if there is one, so that nothing else
+    // steps the ship (or records trace events) from here on, and finishes
+    // any trajectory readbacks while the context is still around
+    void Stop()
+    {
+        FinishReadbacks();
+        if (!simulation)    return;
+        simulation->Stop();
+        frame = simulation->GetSteps();
+    }
+
+    // Saves a checkpoint of the ship, labelled with the number of frames
+    // run.  This stops the simulation thread, if there is one.
+    bool SaveCheckpoint(const std::string& filename)
+    {
+        Stop();
+        return ship->SaveCheckpoint(filename, frame);
+    }
+
+    // Blocks until GetPosition reflects the last Update
+    void WaitForPosition()
+    {
+        if (ship)       ship->WaitForPosition();
+        else if (fleet) fleet->WaitForPosition();
+    }
+
+    // Returns the ship's centroid and mean velocity (or the means
+    // of those values over a fleet)
+    void GetPosition(float c[2], float v[2]) const
+    {
+        if (simulation)
+        {
+            simulation->GetPosition(c, v);
+            return;
+        }
+        else if (ship)
+        {
+            ship->GetPosition(c, v);
+            return;
+        }
+
+        c[0] = c[1] = v[0] = v[1] = 0;
+        for (size_t i=0; i < fleet->size(); ++i)
+        {
+            float ci[2], vi[2];
+            fleet->GetPosition(i, ci, vi);
+            c[0] += ci[0] / fleet->size();
+            c[1] += ci[1] / fleet->size();
+            v[0] += vi[0] / fleet->size();
+            v[1] += vi[1] / fleet->size();
+        }
+    }
+
+    Ship* ship;
+    Fleet* fleet;
+    Simulation* simulation;     // thread running ship, if there is one
+    int steps;      // substeps per frame
+
+    // Journal of engine inputs (when not running on a simulation thread,
+    // which records its own), with the number of frames stepped so far and
+    // the engine flags for the next one
+    JournalWriter* journal;
+    size_t frame;
+    uint8_t engines;
+
+    // Trajectory being streamed (which a simulation thread adds to itself),
+    // and a buffer for reading the ship's state into.  On the GPU, states
+    // are read back asynchronously instead (if readback is true), and
+    // mapped holds the frames of those handed to the trajectory's writer
+    // but not yet unmapped.
+    TrajectoryWriter* trajectory;
+    std::vector<float> state;
+    bool readback;
+    std::deque<uint64_t> mapped;
+};
+
 struct State
 {
-    State(WindowSize* ws, Ship* s) :
-        window_size(ws), ship(s) {}
+    State(WindowSize* ws, Scene* s) :
+        window_size(ws), scene(s),
+        thrustEnginesOn(false), leftEnginesOn(false), rightEnginesOn(false) {}
 
     WindowSize* window_size;
-    Ship*       ship;
+    Scene*      scene;
+
+    bool thrustEnginesOn;
+    bool leftEnginesOn;
+    bool rightEnginesOn;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -40,91 +403,130 @@ void resize_callback(GLFWwindow* window, int width, int height)
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-    Ship* ship = static_cast<State*>(
-            glfwGetWindowUserPointer(window))->ship;
+    State* state = static_cast<State*>(glfwGetWindowUserPointer(window));
 
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GL_TRUE);
     if (key == GLFW_KEY_UP)
     {
-        if (action == GLFW_PRESS)           ship->thrustEnginesOn = true;
-        else if (action == GLFW_RELEASE)    ship->thrustEnginesOn = false;
+        if (action == GLFW_PRESS)           state->thrustEnginesOn = true;
+        else if (action == GLFW_RELEASE)    state->thrustEnginesOn = false;
     }
     else if (key == GLFW_KEY_LEFT)
     {
-        if (action == GLFW_PRESS)           ship->leftEnginesOn = true;
-        else if (action == GLFW_RELEASE)    ship->leftEnginesOn = false;
+        if (action == GLFW_PRESS)           state->leftEnginesOn = true;
+        else if (action == GLFW_RELEASE)    state->leftEnginesOn = false;
     }
     else if (key == GLFW_KEY_RIGHT)
     {
-        if (action == GLFW_PRESS)           ship->rightEnginesOn = true;
-        else if (action == GLFW_RELEASE)    ship->rightEnginesOn = false;
-    }
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-void SaveImage(const std::string& filename,
-               const size_t width, const size_t height)
-{
-    png_structp png_ptr = png_create_write_struct(
-            PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-
-    FILE* output = fopen(filename.c_str(), "wb");
-
-    png_set_IHDR(png_ptr, info_ptr, width, height,
-                 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-    GLubyte* pixels = new GLubyte[width*height*3];
-    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
-
-    GLubyte** rows = new GLubyte*[height];
-    for (size_t i=0; i < height; ++i)
-    {
-        rows[i] = &pixels[(height - i - 1)*width*3];
+        if (action == GLFW_PRESS)           state->rightEnginesOn = true;
+        else if (action == GLFW_RELEASE)    state->rightEnginesOn = false;
     }
 
-    png_init_io(png_ptr, output);
-    png_set_rows(png_ptr, info_ptr, rows);
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
-
-    fclose(output);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    delete [] rows;
-    delete [] pixels;
+    state->scene->SetEngines(state->thrustEnginesOn,
+                             state->leftEnginesOn,
+                             state->rightEnginesOn);
 }
 
-
 ////////////////////////////////////////////////////////////////////////////////
 
 void PrintUsage()
 {
-    std::cout << "Usage: pixelsim [...] filename.png\n\n"
+    std::cout << "Usage: pixelsim [...] filename.png\n"
+        << "       pixelsim --dump-trajectory f\n\n"
         << "Arguments:\n"
         << "    --size WxH    Render window size (default: 640x480)\n"
         << "    --scale f     Ship render scale  (default: 0.9)\n"
         << "    --record      Save frames as frames/FRAMENUMBER.png\n"
-        << "    --track       Center ship's centroid in the window\n";
+        << "    --record-y4m f\n"
+        << "                  Record frames as a YUV4MPEG2 stream to the file\n"
+        << "                  f, or if f is |command, to command's input\n"
+        << "    --track       Center ship's centroid in the window\n"
+        << "    --cpu         Simulate on the CPU instead of the GPU\n"
+        << "    --fused       Run each RK4 substep as one fused CPU job\n"
+        << "                  rather than as separate passes (implies --cpu)\n"
+        << "    --tolerance e Pick substeps adaptively, keeping each step's\n"
+        << "                  error below e node widths (implies --cpu).\n"
+        << "                  Steps are mostly limited by the springs'\n"
+        << "                  stiffness (stability), not by e, and each\n"
+        << "                  costs three RK4 steps\n"
+        << "    --implicit    Take one implicit step per frame, which stays\n"
+        << "                  stable for stiff springs (implies --cpu)\n"
+        << "    --stiffness s Scale the spring and damper constants by s\n"
+        << "                  (implies --cpu)\n"
+        << "    --sleep t     Let 16x16 regions sleep (moving rigidly) while\n"
+        << "                  they stay within t node widths of rigid motion\n"
+        << "                  (implies --cpu)\n"
+        << "    --half        Store the GPU's derivatives at half precision\n"
+        << "                  (the state stays full), cutting each\n"
+        << "                  substep's texture traffic by about 24% and\n"
+        << "                  texture memory by a third (not by half)\n"
+        << "    --threaded    Simulate on a separate thread at a fixed 60 Hz,\n"
+        << "                  independent of drawing (implies --cpu)\n"
+        << "    --fleet N     Simulate N copies of the ship together, in one\n"
+        << "                  set of GPU passes (the trajectory is the mean)\n"
+        << "    --fleet-images a.png,b.png,...\n"
+        << "                  Cycle the fleet's ships through these images as\n"
+        << "                  well (all of them are decoded in parallel)\n"
+        << "    --collide     Push the fleet's ships apart where they touch,\n"
+        << "                  and keep them inside walls around the fleet\n"
+        << "    --headless    Run without a window, as fast as possible,\n"
+        << "                  printing the trajectory as CSV at the end\n"
+        << "    --frames N    Number of frames to run (required if headless)\n"
+        << "    --checkpoint f\n"
+        << "                  Save a checkpoint to f at the end of the run,\n"
+        << "                  which can be resumed by passing it in place of\n"
+        << "                  the image (as f.ckpt)\n"
+        << "    --trajectory f\n"
+        << "                  Stream the centroid, mean velocity and spring\n"
+        << "                  strain of every frame to the binary file f\n"
+        << "    --trajectory-nodes f\n"
+        << "                  Stream every node's position and velocity on\n"
+        << "                  every frame to the binary file f\n"
+        << "    --stride N    Only stream every Nth frame of the trajectory\n"
+        << "    --quantize    Store node trajectories as compressed\n"
+        << "                  fixed-point deltas rather than floats\n"
+        << "    --dump-trajectory f\n"
+        << "                  Print the trajectory file f as CSV\n"
+        << "    --journal f   Record engine inputs to the journal f\n"
+        << "    --replay f    Replay the inputs from the journal f on the\n"
+        << "                  CPU, printing a checksum of the state on each\n"
+        << "                  frame\n"
+        << "                  (implies --headless and --cpu)\n"
+        << "    --trace f     Record trace markers and write them to f as\n"
+        << "                  Chrome trace JSON (for chrome://tracing)\n";
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void GetArgs(int argc, char** argv,
-             std::string* filename, WindowSize* window_size,
-             bool* record, bool* track, float* scale)
+void GetArgs(int argc, char** argv, Options* opts)
 {
+    std::string* const filename = &opts->filename;
+    WindowSize* const window_size = &opts->window_size;
+
     if (argc < 2)
     {
         PrintUsage();
         exit(-1);
     }
 
+    // Dumping a trajectory doesn't take an image or any other options
+    if (!strcmp(argv[1], "--dump-trajectory"))
+    {
+        if (argc != 3)
+        {
+            PrintUsage();
+            exit(-1);
+        }
+        opts->dump = argv[2];
+        return;
+    }
+
     // The last argument is the target filename.
     *filename = argv[--argc];
-    // Verify that it at least ends in ".png"
-    if (filename->rfind(".png") != filename->length() - 4)
+    // Verify that it at least ends in ".png" (or is a checkpoint)
+    if (filename->rfind(".png") != filename->length() - 4 &&
+        !IsCheckpoint(*filename))
     {
         std::cerr << "[pixelsim]    Error: Invalid image name '"
                   << *filename << "'" << std::endl;
@@ -184,8 +586,8 @@ void GetArgs(int argc, char** argv,
                           << std::endl;
                 exit(-1);
             }
-            *scale = std::atof(argv[a]);
-            if (*scale == 0)
+            opts->scale = std::atof(argv[a]);
+            if (opts->scale == 0)
             {
                 std::cerr << "[pixelsim]    Error: Invalid scale specification '"
                           << argv[a] << "'" << std::endl;
@@ -194,11 +596,232 @@ void GetArgs(int argc, char** argv,
         }
         else if (!strcmp(argv[a], "--record"))
         {
-            *record = true;
+            opts->record = true;
+        }
+        else if (!strcmp(argv[a], "--record-y4m"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No recording target provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->record = true;
+            opts->y4m = argv[a];
         }
         else if (!strcmp(argv[a], "--track"))
         {
-            *track = true;
+            opts->track = true;
+        }
+        else if (!strcmp(argv[a], "--cpu"))
+        {
+            opts->backend = Ship::CPU;
+        }
+        else if (!strcmp(argv[a], "--fused"))
+        {
+            opts->backend = Ship::CPU;
+            opts->fused = true;
+        }
+        else if (!strcmp(argv[a], "--tolerance"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No tolerance provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->backend = Ship::CPU;
+            opts->tolerance = std::atof(argv[a]);
+            if (opts->tolerance <= 0)
+            {
+                std::cerr << "[pixelsim]    Error: Invalid tolerance '"
+                          << argv[a] << "'" << std::endl;
+                exit(-1);
+            }
+        }
+        else if (!strcmp(argv[a], "--implicit"))
+        {
+            opts->backend = Ship::CPU;
+            opts->implicit = true;
+        }
+        else if (!strcmp(argv[a], "--stiffness"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No stiffness provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->backend = Ship::CPU;
+            opts->stiffness = std::atof(argv[a]);
+            if (opts->stiffness <= 0)
+            {
+                std::cerr << "[pixelsim]    Error: Invalid stiffness '"
+                          << argv[a] << "'" << std::endl;
+                exit(-1);
+            }
+        }
+        else if (!strcmp(argv[a], "--sleep"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No sleep threshold provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->backend = Ship::CPU;
+            opts->sleep = std::atof(argv[a]);
+            if (opts->sleep <= 0)
+            {
+                std::cerr << "[pixelsim]    Error: Invalid sleep threshold '"
+                          << argv[a] << "'" << std::endl;
+                exit(-1);
+            }
+        }
+        else if (!strcmp(argv[a], "--half"))
+        {
+            opts->half = true;
+        }
+        else if (!strcmp(argv[a], "--threaded"))
+        {
+            opts->backend = Ship::CPU;
+            opts->threaded = true;
+        }
+        else if (!strcmp(argv[a], "--fleet"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No fleet size provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->fleet = std::atoi(argv[a]);
+            if (opts->fleet == 0)
+            {
+                std::cerr << "[pixelsim]    Error: Invalid fleet size '"
+                          << argv[a] << "'" << std::endl;
+                exit(-1);
+            }
+        }
+        else if (!strcmp(argv[a], "--fleet-images"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No fleet images provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            std::stringstream list(argv[a]);
+            std::string name;
+            while (std::getline(list, name, ','))
+            {
+                if (!name.empty())  opts->fleet_images.push_back(name);
+            }
+        }
+        else if (!strcmp(argv[a], "--collide"))
+        {
+            opts->collide = true;
+        }
+        else if (!strcmp(argv[a], "--trace"))
+        {
+#ifdef PIXELSIM_TRACE
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No trace file provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->trace = argv[a];
+#else
+            std::cerr << "[pixelsim]    Error: --trace needs a build with "
+                      << "PIXELSIM_TRACE enabled" << std::endl;
+            exit(-1);
+#endif
+        }
+        else if (!strcmp(argv[a], "--checkpoint"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No checkpoint file provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->checkpoint = argv[a];
+        }
+        else if (!strcmp(argv[a], "--trajectory") ||
+                 !strcmp(argv[a], "--trajectory-nodes"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No trajectory file provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->trajectory = argv[a];
+            opts->trajectory_mode = strcmp(argv[a - 1], "--trajectory")
+                ? Trajectory::NODES : Trajectory::SUMMARY;
+        }
+        else if (!strcmp(argv[a], "--stride"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No stride provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->stride = std::atoi(argv[a]);
+            if (opts->stride == 0)
+            {
+                std::cerr << "[pixelsim]    Error: Invalid stride '"
+                          << argv[a] << "'" << std::endl;
+                exit(-1);
+            }
+        }
+        else if (!strcmp(argv[a], "--quantize"))
+        {
+            opts->trajectory_compression = Trajectory::QUANTIZED;
+        }
+        else if (!strcmp(argv[a], "--journal"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No journal file provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->journal = argv[a];
+        }
+        else if (!strcmp(argv[a], "--replay"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No journal file provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->replay = argv[a];
+            opts->headless = true;
+            opts->backend = Ship::CPU;
+        }
+        else if (!strcmp(argv[a], "--headless"))
+        {
+            opts->headless = true;
+        }
+        else if (!strcmp(argv[a], "--frames"))
+        {
+            if (++a >= argc)
+            {
+                std::cerr << "[pixelsim]    Error: No frame count provided!"
+                          << std::endl;
+                exit(-1);
+            }
+            opts->frames = std::atoi(argv[a]);
+            if (opts->frames == 0)
+            {
+                std::cerr << "[pixelsim]    Error: Invalid frame count '"
+                          << argv[a] << "'" << std::endl;
+                exit(-1);
+            }
         }
         else
         {
@@ -207,19 +830,332 @@ void GetArgs(int argc, char** argv,
             exit(-1);
         }
     }
+
+    if (opts->headless && opts->frames == 0 && opts->replay.empty())
+    {
+        std::cerr << "[pixelsim]    Error: --headless requires --frames"
+                  << std::endl;
+        exit(-1);
+    }
+
+    if (opts->threaded && opts->headless)
+    {
+        std::cerr << "[pixelsim]    Error: --threaded can't be combined "
+                  << "with --headless" << std::endl;
+        exit(-1);
+    }
+
+    if (opts->fleet && (!opts->checkpoint.empty() ||
+                        IsCheckpoint(opts->filename)))
+    {
+        std::cerr << "[pixelsim]    Error: --fleet can't be combined "
+                  << "with checkpoints" << std::endl;
+        exit(-1);
+    }
+
+    if (opts->fleet && !opts->trajectory.empty())
+    {
+        std::cerr << "[pixelsim]    Error: --fleet can't be combined "
+                  << "with --trajectory" << std::endl;
+        exit(-1);
+    }
+
+    if (!opts->fleet_images.empty() && !opts->fleet)
+    {
+        std::cerr << "[pixelsim]    Error: --fleet-images requires --fleet"
+                  << std::endl;
+        exit(-1);
+    }
+
+    if (opts->collide && !opts->fleet)
+    {
+        std::cerr << "[pixelsim]    Error: --collide requires --fleet"
+                  << std::endl;
+        exit(-1);
+    }
+
+    if (opts->fleet && opts->backend != Ship::GPU)
+    {
+        std::cerr << "[pixelsim]    Error: --fleet requires the GPU backend"
+                  << std::endl;
+        exit(-1);
+    }
+
+    if (opts->half && (opts->backend != Ship::GPU || opts->fleet))
+    {
+        std::cerr << "[pixelsim]    Error: --half requires the GPU backend "
+                  << "and a single ship" << std::endl;
+        exit(-1);
+    }
+
+    if (opts->sleep && (opts->implicit || opts->fused || opts->tolerance))
+    {
+        std::cerr << "[pixelsim]    Error: --sleep only works with the "
+                  << "default RK4 integrator" << std::endl;
+        exit(-1);
+    }
+
+    if (opts->implicit && (opts->fused || opts->tolerance))
+    {
+        std::cerr << "[pixelsim]    Error: --implicit can't be combined "
+                  << "with --fused or --tolerance" << std::endl;
+        exit(-1);
+    }
+
+    // Adaptive steps always use the multipass RK4 integrator
+    if (opts->fused && opts->tolerance)
+    {
+        std::cerr << "[pixelsim]    Error: --fused can't be combined "
+                  << "with --tolerance" << std::endl;
+        exit(-1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns a recorder for the frames requested by --record or --record-y4m,
+// or NULL if they aren't being recorded
+Recorder* MakeRecorder(const Options& opts, const bool drop)
+{
+    if (!opts.record)           return NULL;
+    else if (opts.y4m.empty())  return new Recorder(Recorder::PNG, "frames",
+                                                    drop);
+    else                        return new Recorder(Recorder::Y4M, opts.y4m,
+                                                    drop);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs the simulation without a window or any frame pacing, then prints
+// the trajectory (centroid and mean velocity per frame) as CSV.  When
+// replaying a journal, also prints a checksum of the state on each frame.
+int RunHeadless(Options opts)
+{
+    JournalReader* replay = NULL;
+    if (!opts.replay.empty())
+    {
+        replay = new JournalReader(opts.replay);
+        if (!opts.frames)   opts.frames = replay->GetFrames();
+        if (!opts.frames)
+        {
+            std::cerr << "[pixelsim]    Error: Journal '" << opts.replay
+                      << "' has no frames" << std::endl;
+            return -1;
+        }
+
+        if (replay->GetImage() != opts.filename)
+        {
+            std::cerr << "[pixelsim]    Journal was recorded with '"
+                      << replay->GetImage() << "', not '" << opts.filename
+                      << "'" << std::endl;
+        }
+        if (replay->GetSettings() != GetSettings(opts))
+        {
+            std::cerr << "[pixelsim]    Journal was recorded with settings '"
+                      << replay->GetSettings() << "', not '"
+                      << GetSettings(opts) << "'" << std::endl;
+        }
+    }
+
+    // An offscreen context is only needed to run shaders or render frames;
+    // if we can't make one, fall back to the CPU solver.
+    const bool graphics = opts.backend == Ship::GPU || opts.record;
+    if (graphics && !MakeHeadlessContext(opts.window_size.width,
+                                         opts.window_size.height))
+    {
+        if (opts.record || opts.fleet)
+        {
+            std::cerr << "[pixelsim]    Error: --" << (opts.record ? "record"
+                                                                  : "fleet")
+                      << " needs an offscreen OpenGL context" << std::endl;
+            return -1;
+        }
+        std::cerr << "[pixelsim]    No offscreen context; "
+                  << "falling back to the CPU solver" << std::endl;
+        opts.backend = Ship::CPU;
+    }
+
+    const bool has_context = opts.backend == Ship::GPU || opts.record;
+    if (has_context)    Trace::InitGL(GetHeadlessProcAddress);
+    {
+        Scene scene(opts, has_context);
+        if (has_context)    Shaders::init();
+
+        std::vector<float> trajectory;
+        trajectory.reserve(opts.frames * 4);
+
+        // Substeps taken on each frame, and the number rejected overall
+        std::vector<int> steps;
+        size_t rejected = 0;
+
+        // Sum over frames of the fraction of nodes that were awake
+        double awake = 0;
+
+        std::vector<uint64_t> checksums;
+
+        // There's no frame rate to keep up with, so every frame is recorded
+        Recorder* const recorder = MakeRecorder(opts, false);
+
+        const auto t0 = std::chrono::steady_clock::now();
+        for (size_t frame=0; frame < opts.frames; ++frame)
+        {
+            TRACE_SCOPE("frame");
+            if (replay)
+            {
+                const uint8_t e = replay->GetEngines(frame);
+                scene.SetEngines(e & FLEET_THRUST_BIT, e & FLEET_LEFT_BIT,
+                                 e & FLEET_RIGHT_BIT);
+            }
+            scene.Update();
+            if (replay)     checksums.push_back(scene.ship->GetChecksum());
+
+            // Trajectories should line up with frames, so wait for each
+            // frame's position rather than taking the latest available.
+            float c[2], v[2];
+            scene.WaitForPosition();
+            scene.GetPosition(c, v);
+            trajectory.insert(trajectory.end(), {c[0], c[1], v[0], v[1]});
+
+            int r;
+            steps.push_back(scene.GetSteps(&r));
+            rejected += r;
+            if (opts.sleep)     awake += scene.ship->GetAwakeFraction();
+
+            if (recorder && frame)
+            {
+                glClearColor(0.933f, 0.933f, 0.933f, 1.0f);
+                glClear(GL_COLOR_BUFFER_BIT);
+                scene.Draw(opts.window_size.width, opts.window_size.height,
+                           opts.track, opts.scale);
+                recorder->Capture(frame, opts.window_size.width,
+                                  opts.window_size.height);
+            }
+        }
+        delete recorder;
+
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - t0;
+
+        if (!opts.checkpoint.empty())   scene.SaveCheckpoint(opts.checkpoint);
+
+        std::cerr << "[pixelsim]    Simulated " << opts.frames / 60.0
+                  << " s in " << elapsed.count() << " s" << std::endl;
+
+        size_t total = 0;
+        for (auto s : steps)    total += s;
+        std::cerr << "[pixelsim]    Took " << total << " substeps ("
+                  << double(total) / opts.frames << " per frame";
+        if (rejected)
+        {
+            std::cerr << ", " << 3*rejected << " of them in rejected steps";
+        }
+        std::cerr << ")" << std::endl;
+        if (opts.sleep)
+        {
+            std::cerr << "[pixelsim]    Simulated " << 100 * awake / opts.frames
+                      << "% of nodes (the rest were asleep)" << std::endl;
+        }
+
+        std::cout << "frame,time,x,y,dx,dy,steps"
+                  << (replay ? ",checksum\n" : "\n");
+        for (size_t frame=0; frame < opts.frames; ++frame)
+        {
+            std::cout << frame << ',' << (frame + 1) / 60.0;
+            for (int i=0; i < 4; ++i)
+            {
+                std::cout << ',' << trajectory[frame*4 + i];
+            }
+            std::cout << ',' << steps[frame];
+            if (replay)
+            {
+                std::cout << ',' << std::hex << std::setw(16)
+                          << std::setfill('0') << checksums[frame]
+                          << std::dec << std::setfill(' ');
+            }
+            std::cout << '\n';
+        }
+        std::cout.flush();
+    }
+
+    delete replay;
+    if (has_context)    DestroyHeadlessContext();
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Prints every frame of a trajectory file as CSV: one row per frame for
+// summaries, or one row per node per frame (with the node's grid index)
+// for node trajectories.
+int DumpTrajectory(const std::string& filename)
+{
+    TrajectoryReader reader(filename);
+    const bool nodes = reader.GetMode() == Trajectory::NODES;
+    const std::vector<uint32_t>& index = reader.GetNodeIndex();
+
+    std::cerr << "[pixelsim]    " << reader.size() << " frames of "
+              << (nodes ? "nodes" : "summaries") << " on a "
+              << reader.GetWidth() << "x" << reader.GetHeight()
+              << " ship, stored as "
+              << (reader.GetCompression() == Trajectory::RAW ? "floats"
+                                                             : "deltas")
+              << " (stride " << reader.GetStride() << ")" << std::endl;
+
+    if (nodes)  std::cout << "frame,node,x,y,dx,dy\n";
+    else        std::cout << "frame,x,y,dx,dy,strain_mean,strain_max\n";
+
+    std::vector<float> values;
+    uint64_t frame;
+    for (size_t i=0; reader.Read(i, &values, &frame); ++i)
+    {
+        if (nodes)
+        {
+            for (size_t n=0; n < index.size(); ++n)
+            {
+                std::cout << frame << ',' << index[n];
+                for (int p=0; p < 4; ++p)
+                {
+                    std::cout << ',' << values[n*4 + p];
+                }
+                std::cout << '\n';
+            }
+        }
+        else
+        {
+            std::cout << frame;
+            for (auto v : values)   std::cout << ',' << v;
+            std::cout << '\n';
+        }
+    }
+    std::cout.flush();
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char** argv)
 {
-    WindowSize window_size(640, 480);
+    Options opts;
+    GetArgs(argc, argv, &opts);
 
-    bool record = false;
-    bool track  = false;
-    float scale = 0.9;
-    std::string filename;
-    GetArgs(argc, argv, &filename, &window_size, &record, &track, &scale);
+    if (!opts.dump.empty())     return DumpTrajectory(opts.dump);
+
+    if (!opts.trace.empty())
+    {
+        Trace::Start();
+        Trace::NameThread("main");
+    }
+
+    if (opts.headless)
+    {
+        const int result = RunHeadless(opts);
+        if (!opts.trace.empty())    Trace::Write(opts.trace);
+        return result;
+    }
+
+    WindowSize& window_size = opts.window_size;
+    const bool track = opts.track;
+    const float scale = opts.scale;
 
     // Initialize the library
     if (!glfwInit())    return -1;
@@ -243,14 +1179,15 @@ int main(int argc, char** argv)
 
     // Make the window's context current
     glfwMakeContextCurrent(window);
+    Trace::InitGL(glfwGetProcAddress);
 
-    // Initialize the ship!
-    Ship ship(filename);
+    // Initialize the ship (or fleet)!
+    Scene scene(opts, true);
     Shaders::init();
 
-    // Store pointers to window and ship objects.  They will be
+    // Store pointers to window and scene objects.  They will be
     // modified by resize and key-press callbacks, respectively.
-    State state(&window_size, &ship);
+    State state(&window_size, &scene);
 
     // Use a callback to update glViewport when the window is resized, by
     // saving a pointer to a WindowSize struct in the window's user pointer
@@ -263,49 +1200,76 @@ int main(int argc, char** argv)
     // retina displays, rather than only filling 1/4 of the window)
     glfwGetFramebufferSize(window, &window_size.width, &window_size.height);
 
+    // Frames are dropped (rather than slowing down the simulation) if the
+    // encoders fall behind
+    Recorder* const recorder = MakeRecorder(opts, true);
+
     // Loop until the user closes the window
     size_t frame=0;
     while (!glfwWindowShouldClose(window))
     {
+        TRACE_SCOPE("frame");
+
         // Store the start time of this update loop
         const auto t0 = std::chrono::high_resolution_clock::now();
 
         // Update the ship
-        ship.Update(1.0e0/60, 50);
+        scene.Update();
 
         // Draw the scene
         glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
         glClearColor(0.933f, 0.933f, 0.933f, 1.0f);
 
         glClear(GL_COLOR_BUFFER_BIT);
-        ship.Draw(window_size.width, window_size.height, track, scale);
+        scene.Draw(window_size.width, window_size.height, track, scale);
+
+        // Start reading back the frame before the buffers are swapped (after
+        // which the back buffer's contents are undefined)
+        if (recorder && frame)
+        {
+            recorder->Capture(frame, window_size.width, window_size.height);
+        }
 
         // Swap front and back buffers
-        glfwSwapBuffers(window);
+        {
+            TRACE_GL_SCOPE("glfwSwapBuffers");
+            glfwSwapBuffers(window);
+        }
 
         // Poll for and process events
-        glfwPollEvents();
+        {
+            TRACE_SCOPE("glfwPollEvents");
+            glfwPollEvents();
+        }
 
         // Sleep to maintain a framerate of 60 FPS
-        std::this_thread::sleep_for(
-                std::chrono::microseconds(std::micro::den / 61) -
-                (std::chrono::high_resolution_clock::now() - t0));
+        {
+            TRACE_SCOPE("sleep");
+            std::this_thread::sleep_for(
+                    std::chrono::microseconds(std::micro::den / 61) -
+                    (std::chrono::high_resolution_clock::now() - t0));
+        }
 
-        // Print the FPS (for debugging)
+        // Print the FPS (for debugging), and the number of substeps
+        // when they're picked adaptively
         std::cout << std::chrono::seconds(1) /
-                     (std::chrono::high_resolution_clock::now() - t0)
-                  << std::endl;
+                     (std::chrono::high_resolution_clock::now() - t0);
+        if (opts.tolerance)     std::cout << " (" << scene.GetSteps()
+                                          << " steps)";
+        std::cout << std::endl;
 
-        if (record && frame)
-        {
-            std::stringstream ss;
-            ss << std::setw(3) << std::setfill('0') << frame;
-            SaveImage("frames/" + ss.str() + ".png",
-                      window_size.width, window_size.height);
-        }
         frame++;
     }
 
+    // Finish writing frames while the context is still around, and stop
+    // the simulation thread before reading the results it was writing
+    // (the ship's state and the trace's events)
+    delete recorder;
+    scene.Stop();
+    if (!opts.checkpoint.empty())   scene.SaveCheckpoint(opts.checkpoint);
+
+    if (!opts.trace.empty())    Trace::Write(opts.trace);
+
     glfwTerminate();
     return 0;
 }
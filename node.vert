@@ -0,0 +1,21 @@
+#version 330
+
+layout(location=0) in vec2 vertex_position;
+layout(location=1) in uvec2 node;    // node type and neighbor link bitmask
+
+uniform int thrustEnginesOn;
+uniform int leftEnginesOn;
+uniform int rightEnginesOn;
+
+flat out uint links;
+flat out uint firing;
+
+// Expects to get points at texel centers, in normalized device coordinates
+void main()
+{
+    links = node.y;
+    firing = uint((node.x == uint(SHIP_ENGINE_THRUST) && thrustEnginesOn != 0) ||
+                  (node.x == uint(SHIP_ENGINE_RIGHT) &&  rightEnginesOn != 0) ||
+                  (node.x == uint(SHIP_ENGINE_LEFT) &&   leftEnginesOn != 0));
+    gl_Position = vec4(vertex_position, 0.0f, 1.0f);
+}
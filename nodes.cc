@@ -0,0 +1,61 @@
+#include "nodes.h"
+
+const int Nodes::offsets[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1},
+                                  {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+
+#define SQRT2   1.41421356f
+#define SQRT1_2 0.70710678f
+
+const float Nodes::lengths[8] = {SQRT2, 1, SQRT2, 1, 1, SQRT2, 1, SQRT2};
+
+const float Nodes::directions[8][2] = {
+        {-SQRT1_2, -SQRT1_2}, {-1, 0}, {-SQRT1_2, SQRT1_2}, {0, -1},
+        {0, 1}, {SQRT1_2, -SQRT1_2}, {1, 0}, {SQRT1_2, SQRT1_2}};
+
+////////////////////////////////////////////////////////////////////////////////
+
+Nodes::Nodes(const size_t width, const size_t height, const uint8_t* filled)
+{
+    // Map from grid index to live index (or -1 for empty nodes)
+    std::vector<int32_t> live((width+1)*(height+1), -1);
+
+    for (size_t y0=0; y0 <= height; y0 += BLOCK_SIZE) {
+        for (size_t x0=0; x0 <= width; x0 += BLOCK_SIZE) {
+            for (size_t y=y0; y <= height && y < y0 + BLOCK_SIZE; ++y) {
+                for (size_t x=x0; x <= width && x < x0 + BLOCK_SIZE; ++x) {
+                    const size_t i = x + y*(width+1);
+                    if (filled[i])
+                    {
+                        live[i] = index.size();
+                        index.push_back(i);
+                        types.push_back(filled[i]);
+                    }
+                }
+            }
+        }
+    }
+
+    neighbors.resize(index.size() * 8, -1);
+    links.resize(index.size(), 0);
+    for (size_t n=0; n < index.size(); ++n)
+    {
+        const size_t x = index[n] % (width+1);
+        const size_t y = index[n] / (width+1);
+
+        for (int d=0; d < 8; ++d)
+        {
+            const size_t nx = x + offsets[d][0];
+            const size_t ny = y + offsets[d][1];
+
+            // Unsigned wraparound takes care of the lower bounds.
+            if (nx <= width && ny <= height)
+            {
+                neighbors[n*8 + d] = live[nx + ny*(width+1)];
+            }
+            if (neighbors[n*8 + d] != -1)
+            {
+                links[n] |= 1 << d;
+            }
+        }
+    }
+}
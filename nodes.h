@@ -0,0 +1,47 @@
+#ifndef NODES_H
+#define NODES_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Compacted list of the filled nodes in a (width+1)*(height+1) node grid,
+// plus a table of each node's neighbors.  Built once when a ship is loaded,
+// so that kernels can iterate over live nodes instead of the whole grid.
+class Nodes
+{
+public:
+    Nodes(const size_t width, const size_t height, const uint8_t* filled);
+
+    // Number of live nodes
+    size_t size() const { return index.size(); }
+
+    // The grid is split into square blocks of this many nodes per side,
+    // numbered in row-major order.  Live nodes are listed block by block
+    // (and in row-major order within each block), so every block is a
+    // contiguous run of the list that a thread can step on its own.  Grids
+    // at most one block wide are simply in row-major order.
+    enum {BLOCK_SIZE=512};
+
+    // Grid offsets (dx, dy) of the eight neighbors, in table order,
+    // with the rest length and unit rest direction of each link.
+    static const int offsets[8][2];
+    static const float lengths[8];
+    static const float directions[8][2];
+
+    // Grid index (x + y*(width+1)) of each live node, in block order.
+    std::vector<uint32_t> index;
+
+    // Node types (from the filled grid) of each live node.
+    std::vector<uint8_t> types;
+
+    // 8 entries per live node: the live index of the neighbor at each
+    // offset, or -1 if that neighbor is empty or outside the grid.
+    std::vector<int32_t> neighbors;
+
+    // Bitmask per live node, with bit d set if there's a spring linking
+    // the node to its neighbor at offsets[d].
+    std::vector<uint8_t> links;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#include "pool.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+ThreadPool::ThreadPool(size_t threads)
+    : job(NULL), job_count(0), generation(0), busy(0), stopping(false)
+{
+    if (threads == 0)   threads = std::thread::hardware_concurrency();
+    if (threads == 0)   threads = 1;
+
+    for (size_t i=1; i < threads; ++i)
+    {
+        workers.push_back(std::thread(&ThreadPool::Work, this, i));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+
+    for (auto& w : workers)     w.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadPool::Run(const size_t count,
+                     const std::function<void(size_t, size_t)>& f)
+{
+    // Don't bother waking the workers for tiny jobs.
+    if (workers.empty() || count < 2 * size())
+    {
+        f(0, count);
+        return;
+    }
+
+    Dispatch(count, f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadPool::RunThreads(const std::function<void(size_t, size_t)>& f)
+{
+    const size_t n = size();
+    if (workers.empty())
+    {
+        f(0, n);
+        return;
+    }
+
+    Dispatch(n, [&](size_t begin, size_t end){ f(begin, n); });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadPool::Dispatch(const size_t count,
+                          const std::function<void(size_t, size_t)>& f)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &f;
+        job_count = count;
+        busy = workers.size();
+        generation++;
+    }
+    start.notify_all();
+
+    f(0, count / size());
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]{ return busy == 0; });
+    job = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadPool::Work(const size_t index)
+{
+    size_t seen = 0;
+    while (true)
+    {
+        const std::function<void(size_t, size_t)>* f;
+        size_t count;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&]{ return stopping || generation != seen; });
+            if (stopping)   return;
+
+            seen = generation;
+            f = job;
+            count = job_count;
+        }
+
+        (*f)(count * index / size(), count * (index + 1) / size());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy--;
+        }
+        done.notify_one();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Barrier::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    const size_t g = generation;
+
+    if (++waiting == count)
+    {
+        waiting = 0;
+        generation++;
+        cv.notify_all();
+    }
+    else
+    {
+        cv.wait(lock, [&]{ return generation != g; });
+    }
+}
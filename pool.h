@@ -0,0 +1,71 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // Creates a pool with the given number of threads (including the
+    // calling thread).  If threads is zero, uses the hardware concurrency.
+    ThreadPool(size_t threads=0);
+    ~ThreadPool();
+
+    // Splits the range [0, count) into contiguous chunks and calls
+    // f(begin, end) on each chunk in parallel.  Blocks until every
+    // chunk is finished; the calling thread handles the first chunk.
+    void Run(const size_t count,
+             const std::function<void(size_t, size_t)>& f);
+
+    // Calls f(index, size()) once on every thread in the pool at the same
+    // time (so f may synchronize with a Barrier of size() threads).
+    void RunThreads(const std::function<void(size_t, size_t)>& f);
+
+    size_t size() const { return workers.size() + 1; }
+
+private:
+    // Posts a job to every worker and runs the first chunk on this thread.
+    void Dispatch(const size_t count,
+                  const std::function<void(size_t, size_t)>& f);
+
+    void Work(const size_t index);
+
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+
+    // Current job (valid while busy is nonzero)
+    const std::function<void(size_t, size_t)>* job;
+    size_t job_count;
+
+    // Incremented every time a job is posted, so that workers
+    // can tell a new job from a spurious wakeup.
+    size_t generation;
+    size_t busy;
+    bool stopping;
+};
+
+// Blocks threads until a fixed number of them have arrived, then releases
+// them all together.  Can be reused for any number of rounds.
+class Barrier
+{
+public:
+    Barrier(const size_t count) : count(count), waiting(0), generation(0) {}
+    void Wait();
+
+private:
+    const size_t count;
+    size_t waiting;
+    size_t generation;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+#endif
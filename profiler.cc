@@ -0,0 +1,118 @@
+#include <iostream>
+
+#define GLFW_INCLUDE_GLCOREARB
+#include <GLFW/glfw3.h>
+
+#include "profiler.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+Profiler::Profiler(const bool gpu)
+    : gpu(gpu), current(STAGE_COUNT), querying(false)
+{
+    for (auto& t : totals)  t = {0, 0, 0};
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Profiler::~Profiler()
+{
+    for (auto q : pending)  glDeleteQueries(1, &q.query);
+    if (!spare.empty())     glDeleteQueries(spare.size(), &spare[0]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const char* Profiler::GetName(const Stage stage)
+{
+    switch (stage)
+    {
+        case DERIVATIVES:   return "derivatives";
+        case EULER:         return "euler";
+        case RK4_SUM:       return "rk4sum";
+        case FIND_POSITION: return "find_position";
+        case DRAW:          return "draw";
+        default:            return "unknown";
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Profiler::Begin(const Stage stage, const bool query)
+{
+    if (current != STAGE_COUNT)
+    {
+        std::cerr << "[pixelsim]    Error: Profiler stages can't be nested"
+                  << std::endl;
+        exit(-1);
+    }
+
+    current = stage;
+    querying = gpu && query;
+
+    if (querying)
+    {
+        GLuint q;
+        if (spare.empty())
+        {
+            glGenQueries(1, &q);
+        }
+        else
+        {
+            q = spare.back();
+            spare.pop_back();
+        }
+        glBeginQuery(GL_TIME_ELAPSED, q);
+        pending.push_back({q, stage});
+    }
+
+    start = std::chrono::steady_clock::now();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Profiler::End()
+{
+    // Stop the CPU timer first, so that it doesn't include ending the query
+    const auto end = std::chrono::steady_clock::now();
+    if (querying)   glEndQuery(GL_TIME_ELAPSED);
+
+    Totals& t = totals[current];
+    t.calls++;
+    t.cpu_ms += std::chrono::duration<double, std::milli>(end - start).count();
+
+    current = STAGE_COUNT;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Profiler::Collect(const bool wait)
+{
+    // Queries finish in the order they were issued, so stop at the first
+    // one that isn't ready (unless we're waiting for all of them).
+    while (!pending.empty())
+    {
+        const Query q = pending.front();
+        if (!wait)
+        {
+            GLint ready;
+            glGetQueryObjectiv(q.query, GL_QUERY_RESULT_AVAILABLE, &ready);
+            if (!ready)     break;
+        }
+
+        GLuint64 ns;
+        glGetQueryObjectui64v(q.query, GL_QUERY_RESULT, &ns);
+        totals[q.stage].gpu_ms += ns / 1.0e6;
+
+        spare.push_back(q.query);
+        pending.pop_front();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Profiler::Reset()
+{
+    Collect(true);
+    for (auto& t : totals)  t = {0, 0, 0};
+}
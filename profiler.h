@@ -0,0 +1,72 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <GLFW/glfw3.h>
+
+#include <chrono>
+#include <deque>
+#include <vector>
+
+// Accumulates the time spent in each stage of a simulation step, measured
+// on the CPU with a steady clock and (optionally) on the GPU with
+// GL_TIME_ELAPSED queries.  Ships and solvers only time their stages when
+// a profiler is attached to them (see Ship::SetProfiler).
+class Profiler
+{
+public:
+    enum Stage {DERIVATIVES, EULER, RK4_SUM, FIND_POSITION, DRAW,
+                STAGE_COUNT};
+
+    struct Totals
+    {
+        size_t calls;
+        double cpu_ms;
+        double gpu_ms;  // only includes stages timed with a query
+    };
+
+    // If gpu is true, stages that issue OpenGL commands are also timed
+    // with GPU queries, which needs an OpenGL context.
+    explicit Profiler(const bool gpu);
+    ~Profiler();
+
+    // Starts and stops timing a stage (stages can't be nested).  If query
+    // is false, the stage doesn't run on the GPU, so only CPU time is
+    // measured.
+    void Begin(const Stage stage, const bool query=true);
+    void End();
+
+    // Adds finished GPU queries to the totals.  If wait is true, blocks
+    // until every query is finished.
+    void Collect(const bool wait);
+
+    // Clears the totals (after waiting for any pending queries)
+    void Reset();
+
+    const Totals& GetTotals(const Stage stage) const
+    { return totals[stage]; }
+
+    // Returns a stage's name, in snake_case (for use as a JSON key)
+    static const char* GetName(const Stage stage);
+
+private:
+    const bool gpu;
+
+    // Stage being timed, or STAGE_COUNT if none
+    Stage current;
+    bool querying;
+    std::chrono::steady_clock::time_point start;
+
+    // Queries that have been issued but not yet read back (in order), and
+    // finished queries that can be reused
+    struct Query
+    {
+        GLuint query;
+        Stage stage;
+    };
+    std::deque<Query> pending;
+    std::vector<GLuint> spare;
+
+    Totals totals[STAGE_COUNT];
+};
+
+#endif
@@ -0,0 +1,9 @@
+#version 330
+
+// Covers the whole viewport with a single triangle (drawn with 3 vertices
+// and no vertex attributes)
+void main()
+{
+    gl_Position = vec4(float(gl_VertexID & 1) * 4.0f - 1.0f,
+                       float(gl_VertexID >> 1) * 4.0f - 1.0f, 0.0f, 1.0f);
+}
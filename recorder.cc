@@ -0,0 +1,347 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+#include <png.h>
+
+#define GLFW_INCLUDE_GLCOREARB
+#include <GLFW/glfw3.h>
+
+#include "recorder.h"
+#include "trace.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+Recorder::Recorder(const Format format, const std::string& target,
+                   const bool drop, const size_t threads)
+    : format(format), target(target), drop(drop), next(0), pending(0),
+      queued(0), busy(0), done(false), stream(NULL), pipe(false),
+      next_write(0), stream_width(0), stream_height(0), skipped(0),
+      captured(0), dropped(0), late(0)
+{
+    for (auto& s : slots)
+    {
+        glGenBuffers(1, &s.pbo);
+        s.allocated = 0;
+        s.fence = 0;
+    }
+
+    if (format == Y4M)
+    {
+        pipe = !target.empty() && target[0] == '|';
+        stream = pipe ? popen(target.c_str() + 1, "w")
+                      : fopen(target.c_str(), "wb");
+        if (!stream)
+        {
+            std::cerr << "[pixelsim]    Error: Cannot open '" << target
+                      << "' for recording" << std::endl;
+            exit(-1);
+        }
+    }
+
+    size_t count = threads;
+    if (count == 0)
+    {
+        count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        count = std::max(count, size_t(1));
+    }
+
+    // Enough buffers for every encoder to be busy with one frame while
+    // another finished readback is waiting for each of them.
+    frames.resize(count * 2);
+    for (auto& f : frames)  free_frames.push_back(&f);
+
+    for (size_t i=0; i < count; ++i)
+    {
+        encoders.push_back(std::thread([=]()
+        {
+            Trace::NameThread("encoder " + std::to_string(i));
+            Run();
+        }));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Recorder::~Recorder()
+{
+    Finish();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    queue_ready.notify_all();
+    for (auto& t : encoders)    t.join();
+
+    for (auto& s : slots)   glDeleteBuffers(1, &s.pbo);
+
+    if (stream)
+    {
+        if (pipe)   pclose(stream);
+        else        fclose(stream);
+    }
+
+    std::cerr << "[pixelsim]    Recorded " << captured - dropped - skipped
+              << " frames (" << dropped + skipped << " dropped, " << late
+              << " late)" << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Recorder::Capture(const size_t frame, const int width, const int height)
+{
+    TRACE_GL_SCOPE("Recorder::Capture");
+
+    // Hand off any finished readbacks, and if every slot is still in
+    // flight, wait for the oldest one (so this frame is late).
+    Poll(false);
+    if (pending == RING)
+    {
+        late++;
+        while (pending == RING)     Poll(true);
+    }
+
+    Slot& s = slots[next];
+    s.number = frame;
+    s.width = width;
+    s.height = height;
+
+    const size_t bytes = width * height * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+    if (bytes > s.allocated)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+        s.allocated = bytes;
+    }
+
+    // Read RGBA rather than RGB, so that rows stay 4-byte aligned
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    next = (next + 1) % RING;
+    pending++;
+    captured++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Recorder::Finish()
+{
+    while (pending)     Poll(true);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    frame_freed.wait(lock, [&]{ return queue.empty() && busy == 0; });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Recorder::Poll(const bool wait)
+{
+    while (pending)
+    {
+        Slot& s = slots[(next + RING - pending) % RING];
+
+        if (!wait)
+        {
+            // Stop at the first readback that isn't finished (since
+            // they finish in order)
+            if (glClientWaitSync(s.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            {
+                break;
+            }
+        }
+        else
+        {
+            glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                             GL_TIMEOUT_IGNORED);
+        }
+        glDeleteSync(s.fence);
+        s.fence = 0;
+        pending--;
+
+        Frame* f = Acquire();
+        if (!f)
+        {
+            dropped++;
+            if (wait)   break;
+            continue;
+        }
+
+        f->number = s.number;
+        f->width = s.width;
+        f->height = s.height;
+        f->pixels.resize(s.width * s.height * 4);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+        const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                f->pixels.size(), GL_MAP_READ_BIT);
+        std::copy((const uint8_t*)data,
+                  (const uint8_t*)data + f->pixels.size(), f->pixels.begin());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        f->sequence = queued++;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(f);
+        }
+        queue_ready.notify_one();
+
+        if (wait)   break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Recorder::Frame* Recorder::Acquire()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!drop)
+    {
+        frame_freed.wait(lock, [&]{ return !free_frames.empty(); });
+    }
+    else if (free_frames.empty())
+    {
+        return NULL;
+    }
+
+    Frame* f = free_frames.back();
+    free_frames.pop_back();
+    return f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Recorder::Run()
+{
+    // Scratch space, reused between frames
+    std::vector<uint8_t*> rows;
+    std::vector<uint8_t> yuv;
+
+    while (true)
+    {
+        Frame* f;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_ready.wait(lock, [&]{ return done || !queue.empty(); });
+            if (queue.empty())  return;
+
+            f = queue.front();
+            queue.pop_front();
+            busy++;
+        }
+
+        if (format == PNG)  WritePNG(*f, rows);
+        else                WriteY4M(*f, yuv);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_frames.push_back(f);
+            busy--;
+        }
+        frame_freed.notify_all();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Recorder::WritePNG(const Frame& f, std::vector<uint8_t*>& rows) const
+{
+    TRACE_SCOPE("Recorder::WritePNG");
+
+    std::stringstream ss;
+    ss << target << "/" << std::setw(3) << std::setfill('0') << f.number
+       << ".png";
+
+    FILE* output = fopen(ss.str().c_str(), "wb");
+    if (!output)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot write '" << ss.str()
+                  << "'" << std::endl;
+        return;
+    }
+
+    png_structp png_ptr = png_create_write_struct(
+            PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+
+    png_set_IHDR(png_ptr, info_ptr, f.width, f.height,
+                 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+    // Favor encoding speed over file size
+    png_set_compression_level(png_ptr, 1);
+
+    // OpenGL returns the bottom row first
+    rows.resize(f.height);
+    for (int i=0; i < f.height; ++i)
+    {
+        rows[i] = const_cast<uint8_t*>(
+                &f.pixels[(f.height - i - 1)*f.width*4]);
+    }
+
+    png_init_io(png_ptr, output);
+    png_set_rows(png_ptr, info_ptr, &rows[0]);
+    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_STRIP_FILLER_AFTER, NULL);
+
+    fclose(output);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Recorder::WriteY4M(const Frame& f, std::vector<uint8_t>& yuv)
+{
+    {
+        TRACE_SCOPE("Recorder::ConvertY4M");
+
+        // Convert to planar 4:4:4 YCbCr (BT.601, limited range), flipping
+        // so that the top row comes first.
+        const size_t n = f.width * f.height;
+        yuv.resize(n * 3);
+        for (int y=0; y < f.height; ++y)
+        {
+            const uint8_t* p = &f.pixels[(f.height - y - 1)*f.width*4];
+            for (int x=0; x < f.width; ++x, p += 4)
+            {
+                const float r = p[0], g = p[1], b = p[2];
+                const size_t i = y*f.width + x;
+                yuv[i]       = 16  + ( 65.738f*r + 129.057f*g +  25.064f*b) / 256;
+                yuv[n + i]   = 128 + (-37.945f*r -  74.494f*g + 112.439f*b) / 256;
+                yuv[2*n + i] = 128 + (112.439f*r -  94.154f*g -  18.285f*b) / 256;
+            }
+        }
+    }
+
+    // Wait until it's this frame's turn to be written
+    std::unique_lock<std::mutex> lock(stream_mutex);
+    written.wait(lock, [&]{ return next_write == f.sequence; });
+
+    TRACE_SCOPE("Recorder::WriteY4M");
+    if (!stream_width)
+    {
+        stream_width = f.width;
+        stream_height = f.height;
+        fprintf(stream, "YUV4MPEG2 W%i H%i F60:1 Ip A1:1 C444\n",
+                stream_width, stream_height);
+    }
+
+    // The stream's size is fixed by its header, so frames of any other
+    // size (e.g. after the window is resized) are skipped.
+    if (f.width == stream_width && f.height == stream_height)
+    {
+        fputs("FRAME\n", stream);
+        fwrite(&yuv[0], 1, yuv.size(), stream);
+    }
+    else
+    {
+        skipped++;
+    }
+
+    next_write++;
+    written.notify_all();
+}
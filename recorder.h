@@ -0,0 +1,130 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <GLFW/glfw3.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records rendered frames without stalling the render loop.
+//
+// Capture starts an asynchronous readback of the framebuffer into a ring
+// of pixel buffer objects.  Once a readback has finished (usually a frame
+// or two later), its pixels are copied into a reusable buffer and handed
+// to a pool of encoder threads, which write them out as PNGs or as a
+// YUV4MPEG2 stream (which can be piped to an external encoder).
+class Recorder
+{
+public:
+    // PNG writes target/NNN.png for each frame.  Y4M writes a single
+    // stream to the file target, or if target starts with '|', to the
+    // standard input of the command that follows it.
+    enum Format {PNG, Y4M};
+
+    // If drop is true, frames are dropped when every buffer is waiting to
+    // be encoded (rather than blocking until one is free).  If threads is
+    // zero, uses one fewer encoder thread than the hardware concurrency.
+    Recorder(const Format format, const std::string& target,
+             const bool drop, const size_t threads=0);
+
+    // Finishes writing every captured frame, then reports how many were
+    // dropped or late.  Needs the OpenGL context that frames were
+    // captured from.
+    ~Recorder();
+
+    // Starts reading back the current framebuffer (of the given size).
+    void Capture(const size_t frame, const int width, const int height);
+
+    // Blocks until every captured frame has been written.
+    void Finish();
+
+private:
+    struct Frame
+    {
+        size_t number;      // as passed to Capture
+        size_t sequence;    // order in which frames reach the encoders
+        int width;
+        int height;
+        std::vector<uint8_t> pixels;    // RGBA, bottom row first
+    };
+
+    // A readback in progress
+    struct Slot
+    {
+        GLuint pbo;
+        size_t allocated;   // size of pbo's data store, in bytes
+        GLsync fence;
+        size_t number;
+        int width;
+        int height;
+    };
+
+    // Hands finished readbacks to the encoders.  If wait is true, first
+    // blocks until the oldest pending readback has finished.
+    void Poll(const bool wait);
+
+    // Returns a free frame buffer, or NULL if there isn't one and frames
+    // should be dropped.
+    Frame* Acquire();
+
+    // Encoder thread loop
+    void Run();
+
+    void WritePNG(const Frame& f, std::vector<uint8_t*>& rows) const;
+    void WriteY4M(const Frame& f, std::vector<uint8_t>& yuv);
+
+    const Format format;
+    const std::string target;
+    const bool drop;
+
+    // Ring of readbacks; slots[next] is the next one to start, and the
+    // pending slots before it are still in flight.
+    static const size_t RING = 3;
+    Slot slots[RING];
+    size_t next;
+    size_t pending;
+
+    // Number of frames handed to the encoders so far
+    size_t queued;
+
+    // Frame buffers, and the encoder threads that they're handed to.
+    // Everything below is shared with the encoder threads, so is guarded
+    // by mutex.
+    std::vector<Frame> frames;
+    std::vector<Frame*> free_frames;
+    std::deque<Frame*> queue;
+    size_t busy;    // frames being encoded
+    bool done;
+
+    std::mutex mutex;
+    std::condition_variable queue_ready;    // queue isn't empty, or done
+    std::condition_variable frame_freed;    // a frame has been encoded
+
+    std::vector<std::thread> encoders;
+
+    // The Y4M stream, and the sequence number of the next frame to write
+    // to it (frames are encoded in parallel, but written in order).
+    // These are guarded by stream_mutex, so that writing doesn't block
+    // the render thread's use of mutex.
+    FILE* stream;
+    bool pipe;
+    size_t next_write;
+    int stream_width;   // size given in the stream's header (or 0 if it
+    int stream_height;  // hasn't been written yet)
+    size_t skipped;     // frames that didn't match the stream's size
+    std::mutex stream_mutex;
+    std::condition_variable written;
+
+    // Statistics, reported by the destructor
+    size_t captured;
+    size_t dropped;
+    size_t late;    // frames whose capture had to wait for a readback
+};
+
+#endif
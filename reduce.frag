@@ -0,0 +1,32 @@
+#version 330
+
+// Texture to be summed, and its size in texels
+uniform sampler2D source;
+uniform ivec2 source_size;
+
+// Size of the blocks (halos included) of a split state texture, whose halo
+// texels are skipped, or 0 if the source isn't split
+uniform int block;
+
+out vec4 fragColor;
+
+// Sums a 2x2 block of the source texture into one texel, treating texels
+// past the edge of the source as zero.
+void main()
+{
+    ivec2 coord = ivec2(gl_FragCoord.xy) * 2;
+
+    vec4 sum = vec4(0.0f);
+    for (int i=0; i < 4; ++i)
+    {
+        ivec2 c = coord + ivec2(i & 1, i >> 1);
+        ivec2 b = c % max(block, 1);
+        bool halo = block != 0 && (any(equal(b, ivec2(0))) ||
+                                   any(equal(b, ivec2(block - 1))));
+        if (all(lessThan(c, source_size)) && !halo)
+        {
+            sum += texelFetch(source, c, 0);
+        }
+    }
+    fragColor = sum;
+}
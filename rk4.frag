@@ -8,16 +8,23 @@ uniform sampler2D k3;
 uniform sampler2D k4;
 
 uniform float dt;
-uniform ivec2 size;
 
 out vec4 fragColor;
 
+#ifdef HALO
+// Halo texels are recomputed from the node they copy (see halo.vert)
+flat in ivec2 source;
+#endif
+
 void main()
 {
-    vec2 tex_coord = vec2(gl_FragCoord.x / float(size.x + 1),
-                          gl_FragCoord.y / float(size.y + 1));
+#ifdef HALO
+    ivec2 coord = source;
+#else
+    ivec2 coord = ivec2(gl_FragCoord.xy);
+#endif
 
-    fragColor = texture(y, tex_coord) + dt/6.0f *
-        (texture(k1, tex_coord) + 2*texture(k2, tex_coord) +
-         2*texture(k3, tex_coord) + texture(k4, tex_coord));
+    fragColor = texelFetch(y, coord, 0) + dt/6.0f *
+        (texelFetch(k1, coord, 0) + 2*texelFetch(k2, coord, 0) +
+         2*texelFetch(k3, coord, 0) + texelFetch(k4, coord, 0));
 }
@@ -1,39 +1,256 @@
 #include <iostream>
-#include <fstream>
+#include <vector>
 
 #include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/stat.h>
+#include <unistd.h>  // getpid
 
 #include "shaders.h"
+#include "constants.h"
+#include "trace.h"
 
 std::string Shaders::constants;
+std::string Shaders::cache_dir;
+std::string Shaders::driver;
+
+Shaders::ShipProgram Shaders::ship;
+Shaders::ShipProgram Shaders::ship_mesh;
+Shaders::DerivativesProgram Shaders::derivatives;
+Shaders::DerivativesProgram Shaders::derivatives_half;
+Shaders::EulerProgram Shaders::euler;
+Shaders::RK4Program Shaders::rk4sum;
+Shaders::EulerProgram Shaders::euler_halo;
+Shaders::RK4Program Shaders::rk4sum_halo;
+Shaders::ReduceProgram Shaders::reduce;
+Shaders::FleetProgram Shaders::fleet;
+Shaders::FleetDerivativesProgram Shaders::fleet_derivatives;
+Shaders::FleetDerivativesProgram Shaders::fleet_contacts;
+Shaders::FleetHashProgram Shaders::fleet_hash;
+
+////////////////////////////////////////////////////////////////////////////////
 
-GLuint Shaders::ship = 0;
-GLuint Shaders::derivatives = 0;
-GLuint Shaders::euler = 0;
-GLuint Shaders::RK4sum = 0;
+// Creates a directory, returning true if it now exists
+static bool MakeDirectory(const std::string& dir)
+{
+    return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void Shaders::init()
 {
-    // Load "constants.h" as a string.  We'll paste this string
+    TRACE_GL_SCOPE("Shaders::init");
+
+    // Get "constants.h" as a string.  We'll paste this string
     // into all of the shaders (to #define a bunch of macros).
-    std::ifstream c("constants.h");
-    std::string line;
-    std::string program;
-    while (getline(c, line))    constants += line + '\n';
-
-    ship        = CreateProgram(CompileShader("ship.vert"),
-                                CompileShader("ship.frag"));
-    derivatives = CreateProgram(CompileShader("texture.vert"),
-                                CompileShader("derivatives.frag"));
-    euler       = CreateProgram(CompileShader("texture.vert"),
-                                CompileShader("euler.frag"));
-    RK4sum      = CreateProgram(CompileShader("texture.vert"),
-                                CompileShader("rk4.frag"));
+    constants = GetSource("constants.h");
+
+    // Programs are cached in $XDG_CACHE_HOME/pixelsim (or ~/.cache/pixelsim)
+    // if the driver can save them.  A driver update changes its version
+    // string, so it won't be handed binaries from the old one.
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (formats > 0 && ((xdg && *xdg) || home))
+    {
+        std::string dir = (xdg && *xdg) ? xdg
+                                        : std::string(home) + "/.cache";
+        if (!MakeDirectory(dir) || !MakeDirectory(dir + "/pixelsim"))
+        {
+            std::cerr << "[pixelsim]    Can't create shader cache in "
+                      << dir << "; compiling shaders every run" << std::endl;
+        }
+        else
+        {
+            cache_dir = dir + "/pixelsim";
+        }
+    }
+    for (auto name : {GL_VENDOR, GL_RENDERER, GL_VERSION})
+    {
+        const GLubyte* str = glGetString(name);
+        driver += std::string(str ? (const char*)str : "") + '\n';
+    }
+
+    // The ship program is also built with MESH defined, for drawing a
+    // ship's level-of-detail meshes (see Ship::MakeMeshes).
+    for (int mesh=0; mesh < 2; ++mesh)
+    {
+        const GLuint p = LoadProgram("ship.vert", "ship.frag",
+                                     mesh ? "#define MESH\n" : "");
+        ShipProgram& s = mesh ? ship_mesh : ship;
+        s.program = p;
+        s.window_size     = glGetUniformLocation(p, "window_size");
+        s.ship_size       = glGetUniformLocation(p, "ship_size");
+        s.offset          = glGetUniformLocation(p, "offset");
+        s.scale           = glGetUniformLocation(p, "scale");
+        s.pos             = glGetUniformLocation(p, "pos");
+        s.prev            = glGetUniformLocation(p, "prev");
+        s.alpha           = glGetUniformLocation(p, "alpha");
+        s.block           = glGetUniformLocation(p, "block");
+        s.blocks_x        = glGetUniformLocation(p, "blocks_x");
+        s.atlas_columns   = glGetUniformLocation(p, "atlas_columns");
+        s.palette         = glGetUniformLocation(p, "palette");
+        s.origin          = glGetUniformLocation(p, "origin");
+        s.palette_base    = glGetUniformLocation(p, "palette_base");
+        s.thrustEnginesOn = glGetUniformLocation(p, "thrustEnginesOn");
+        s.leftEnginesOn   = glGetUniformLocation(p, "leftEnginesOn");
+        s.rightEnginesOn  = glGetUniformLocation(p, "rightEnginesOn");
+    }
+
+    // The derivatives program is also built with HALF defined, for ships
+    // whose derivative textures are stored at half precision.
+    for (int half=0; half < 2; ++half)
+    {
+        const GLuint p = LoadProgram("node.vert", "derivatives.frag",
+                                     half ? "#define HALF\n" : "");
+        DerivativesProgram& d = half ? derivatives_half : derivatives;
+        d.program = p;
+        d.state           = glGetUniformLocation(p, "state");
+        d.thrustEnginesOn = glGetUniformLocation(p, "thrustEnginesOn");
+        d.leftEnginesOn   = glGetUniformLocation(p, "leftEnginesOn");
+        d.rightEnginesOn  = glGetUniformLocation(p, "rightEnginesOn");
+        SetConstants(p);
+    }
+
+    {
+        const GLuint p = LoadProgram("fleet.vert", "fleet.frag");
+        fleet.program = p;
+        fleet.state   = glGetUniformLocation(p, "state");
+        fleet.engines = glGetUniformLocation(p, "engines");
+        fleet.center  = glGetUniformLocation(p, "center");
+        fleet.scale   = glGetUniformLocation(p, "scale");
+    }
+
+    // The fleet's derivatives program is also built with CONTACTS defined,
+    // for fleets with collisions turned on.
+    for (int contacts=0; contacts < 2; ++contacts)
+    {
+        const GLuint p = LoadProgram("fleet_node.vert", "derivatives.frag",
+                                     contacts ? "#define CONTACTS\n" : "");
+        FleetDerivativesProgram& d =
+            contacts ? fleet_contacts : fleet_derivatives;
+        d.program  = p;
+        d.state    = glGetUniformLocation(p, "state");
+        d.engines  = glGetUniformLocation(p, "engines");
+        d.table    = glGetUniformLocation(p, "table");
+        d.layers   = glGetUniformLocation(p, "layers");
+        d.hashed   = glGetUniformLocation(p, "hashed");
+        d.walls    = glGetUniformLocation(p, "walls");
+        SetConstants(p);
+    }
+
+    {
+        const GLuint p = LoadProgram("hash.vert", "hash.frag");
+        fleet_hash.program = p;
+        fleet_hash.state      = glGetUniformLocation(p, "state");
+        fleet_hash.table_size = glGetUniformLocation(p, "table_size");
+        fleet_hash.layer      = glGetUniformLocation(p, "layer");
+        fleet_hash.previous   = glGetUniformLocation(p, "previous");
+    }
+
+    // The Euler and RK4 sum programs are also built with HALO defined,
+    // for the halo texels of split state textures (see Ship::MakeLayout).
+    for (int halo=0; halo < 2; ++halo)
+    {
+        const std::string defines = halo ? "#define HALO\n" : "";
+        const std::string vert = halo ? "halo.vert" : "texture.vert";
+
+        {
+            const GLuint p = LoadProgram(vert, "euler.frag", defines);
+            EulerProgram& e = halo ? euler_halo : euler;
+            e.program = p;
+            e.state = glGetUniformLocation(p, "state");
+            e.accel = glGetUniformLocation(p, "accel");
+            e.dt    = glGetUniformLocation(p, "dt");
+        }
+
+        {
+            const GLuint p = LoadProgram(vert, "rk4.frag", defines);
+            RK4Program& r = halo ? rk4sum_halo : rk4sum;
+            r.program = p;
+            r.y  = glGetUniformLocation(p, "y");
+            r.k1 = glGetUniformLocation(p, "k1");
+            r.k2 = glGetUniformLocation(p, "k2");
+            r.k3 = glGetUniformLocation(p, "k3");
+            r.k4 = glGetUniformLocation(p, "k4");
+            r.dt = glGetUniformLocation(p, "dt");
+        }
+    }
+
+    {
+        const GLuint p = LoadProgram("quad.vert", "reduce.frag");
+        reduce.program = p;
+        reduce.source      = glGetUniformLocation(p, "source");
+        reduce.source_size = glGetUniformLocation(p, "source_size");
+        reduce.block       = glGetUniformLocation(p, "block");
+    }
+
+    glUseProgram(0);
+}
+
+void Shaders::SetConstants(const GLuint p)
+{
+    // The physical constants never change, so they're only set once.
+    glUseProgram(p);
+    glUniform1f(glGetUniformLocation(p, "k"), SHIP_SPRING_K);
+    glUniform1f(glGetUniformLocation(p, "c"), SHIP_SPRING_C);
+    glUniform1f(glGetUniformLocation(p, "m"), SHIP_NODE_MASS);
+    glUniform1f(glGetUniformLocation(p, "I"), SHIP_NODE_INERTIA);
+}
+
+std::string Shaders::GetSource(const std::string& filename)
+{
+    for (const Source* s=sources; s->filename; ++s)
+    {
+        if (filename == s->filename)    return s->text;
+    }
+
+    std::cerr << "[pixelsim]    Error: No shader source named "
+              << filename << " (was it added after the last CMake run?)"
+              << std::endl;
+    exit(-1);
+}
+
+std::string Shaders::Preprocess(const std::string& filename,
+                                const std::string& defines)
+{
+    const std::string source = GetSource(filename);
+
+    // Keep the first line (the #version directive), then add all of the
+    // constants defined in constants.h, then the rest of the shader
+    const size_t eol = source.find('\n');
+    return source.substr(0, eol) + '\n' + constants + defines +
+           source.substr(eol + 1);
+}
+
+GLuint Shaders::LoadProgram(const std::string& vert, const std::string& frag,
+                            const std::string& defines)
+{
+    const std::string vert_text = Preprocess(vert, defines);
+    const std::string frag_text = Preprocess(frag, defines);
+
+    std::string path;
+    if (!cache_dir.empty())
+    {
+        path = CachePath(vert_text, frag_text);
+        const GLuint program = LoadCachedProgram(path);
+        if (program)    return program;
+    }
+
+    const GLuint program = CreateProgram(CompileShader(vert, vert_text),
+                                         CompileShader(frag, frag_text));
+    if (!path.empty())  SaveCachedProgram(program, path);
+    return program;
 }
 
-GLuint Shaders::CompileShader(const std::string& filename)
+GLuint Shaders::CompileShader(const std::string& filename,
+                              const std::string& text)
 {
     const std::string extension = filename.substr(filename.find_last_of("."));
     assert(extension == ".vert" || extension == ".frag");
@@ -41,19 +258,7 @@ GLuint Shaders::CompileShader(const std::string& filename)
     GLenum type = extension == ".vert" ? GL_VERTEX_SHADER : GL_FRAGMENT_SHADER;
     GLuint shader = glCreateShader(type);
 
-    std::ifstream t(filename.c_str());
-    std::string line;
-    std::string program;
-
-    // Get the first line (the #version directive)
-    getline(t, program);
-    // Then add all of the constants defined in constants.h
-    program += '\n' + constants;
-
-    // Finally read the rest of the shader in
-    while (getline(t, line))    program += line + '\n';
-
-    const char* txt = program.c_str();
+    const char* txt = text.c_str();
     glShaderSource(shader, 1, &txt, NULL);
     glCompileShader(shader);
 
@@ -81,6 +286,11 @@ GLuint Shaders::CreateProgram(const GLuint vert, const GLuint frag)
     GLuint program = glCreateProgram();
     glAttachShader(program, vert);
     glAttachShader(program, frag);
+    if (!cache_dir.empty())
+    {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
+    }
     glLinkProgram(program);
 
     GLint status;
@@ -97,5 +307,105 @@ GLuint Shaders::CreateProgram(const GLuint vert, const GLuint frag)
         delete [] strInfoLog;
     }
 
+    // The program keeps its own copy of the compiled code
+    glDetachShader(program, vert);
+    glDetachShader(program, frag);
+    glDeleteShader(vert);
+    glDeleteShader(frag);
+
+    return program;
+}
+
+std::string Shaders::CachePath(const std::string& vert_text,
+                               const std::string& frag_text)
+{
+    // 64-bit FNV-1a, over the driver and both sources (with separators,
+    // so that text can't move from one to the next without changing it)
+    uint64_t hash = 14695981039346656037ULL;
+    const std::string* texts[] = {&driver, &vert_text, &frag_text};
+    for (const std::string* s : texts)
+    {
+        for (const char c : *s)
+        {
+            hash = (hash ^ (uint8_t)c) * 1099511628211ULL;
+        }
+        hash *= 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash);
+    return cache_dir + name;
+}
+
+GLuint Shaders::LoadCachedProgram(const std::string& path)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)     return 0;
+
+    // Each file is the binary's format, then the binary itself
+    GLenum format = 0;
+    std::vector<char> binary;
+    bool ok = fread(&format, sizeof(format), 1, f) == 1;
+    if (ok)
+    {
+        fseek(f, 0, SEEK_END);
+        const long size = ftell(f) - (long)sizeof(format);
+        fseek(f, sizeof(format), SEEK_SET);
+
+        ok = size > 0;
+        if (ok)
+        {
+            binary.resize(size);
+            ok = fread(&binary[0], 1, size, f) == binary.size();
+        }
+    }
+    fclose(f);
+    if (!ok)    return 0;
+
+    const GLuint program = glCreateProgram();
+    glProgramBinary(program, format, &binary[0], binary.size());
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        // The file will be replaced when the program is compiled again.
+        // Clear the error from an unknown format, so it isn't blamed on
+        // whatever checks for errors next.
+        glDeleteProgram(program);
+        while (glGetError() != GL_NO_ERROR);
+        return 0;
+    }
+
     return program;
 }
+
+void Shaders::SaveCachedProgram(const GLuint program, const std::string& path)
+{
+    GLint status, length = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (status == GL_FALSE || length <= 0)  return;
+
+    GLenum format;
+    std::vector<char> binary(length);
+    glGetProgramBinary(program, length, &length, &format, &binary[0]);
+
+    // Write to a temporary file (named for this process, so that runs
+    // starting at the same time don't write to the same one) and then
+    // rename it, so that another run never sees half a file
+    const std::string tmp = path + "." + std::to_string(getpid()) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f)     return;
+
+    const bool ok = fwrite(&format, sizeof(format), 1, f) == 1 &&
+                    fwrite(&binary[0], 1, length, f) == (size_t)length;
+    if (fclose(f) == 0 && ok)
+    {
+        rename(tmp.c_str(), path.c_str());
+    }
+    else
+    {
+        remove(tmp.c_str());
+    }
+}
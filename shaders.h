@@ -10,15 +10,126 @@ class Shaders
 public:
     static void init();
 
-    static GLuint ship;
-    static GLuint derivatives;
-    static GLuint euler;
-    static GLuint RK4sum;
+    // Each program is stored with its uniform locations, which are looked
+    // up once (when the program is linked) rather than on every pass.
+    struct ShipProgram
+    {
+        GLuint program;
+        GLint window_size, ship_size, offset, scale, pos, prev, alpha;
+        GLint block, blocks_x, atlas_columns;
+        GLint palette, origin, palette_base;
+        GLint thrustEnginesOn, leftEnginesOn, rightEnginesOn;
+    };
+
+    struct DerivativesProgram
+    {
+        GLuint program;
+        GLint state;
+        GLint thrustEnginesOn, leftEnginesOn, rightEnginesOn;
+    };
+
+    struct ReduceProgram
+    {
+        GLuint program;
+        GLint source, source_size, block;
+    };
+
+    // Fleet versions of the programs above: engine flags are looked up
+    // per ship (in a buffer texture) instead of being set as uniforms.
+    struct FleetProgram
+    {
+        GLuint program;
+        GLint state, engines, center, scale;
+    };
+
+    // Also used for the version with contact forces, which adds the
+    // spatial hash, the state it was built from and the walls (whose
+    // locations are -1 otherwise).
+    struct FleetDerivativesProgram
+    {
+        GLuint program;
+        GLint state, engines, table, layers, hashed, walls;
+    };
+
+    struct FleetHashProgram
+    {
+        GLuint program;
+        GLint state, table_size, layer, previous;
+    };
+
+    struct EulerProgram
+    {
+        GLuint program;
+        GLint state, accel, dt;
+    };
+
+    struct RK4Program
+    {
+        GLuint program;
+        GLint y, k1, k2, k3, k4, dt;
+    };
+
+    static ShipProgram ship;
+    static ShipProgram ship_mesh;
+    static DerivativesProgram derivatives;
+    static DerivativesProgram derivatives_half;
+    static EulerProgram euler;
+    static RK4Program rk4sum;
+    static EulerProgram euler_halo;
+    static RK4Program rk4sum_halo;
+    static ReduceProgram reduce;
+    static FleetProgram fleet;
+    static FleetDerivativesProgram fleet_derivatives;
+    static FleetDerivativesProgram fleet_contacts;
+    static FleetHashProgram fleet_hash;
 private:
+    // Shader sources (and constants.h), embedded in the executable at
+    // build time by embed_shaders.cmake.  The last entry's filename is NULL.
+    struct Source
+    {
+        const char* filename;
+        const char* text;
+    };
+    static const Source sources[];
+
     static std::string constants;
 
-    static GLuint CompileShader(const std::string& filename);
+    // Directory that linked programs are cached in (or empty, if the
+    // driver can't save program binaries), and the driver's identity,
+    // which is part of every cache key
+    static std::string cache_dir;
+    static std::string driver;
+
+    // Sets the physical constants used by derivatives.frag
+    static void SetConstants(const GLuint program);
+
+    // Returns an embedded source, exiting if there isn't one by that name
+    static std::string GetSource(const std::string& filename);
+
+    // Returns a shader's source, with constants.h and then any extra
+    // defines pasted in after its #version line
+    static std::string Preprocess(const std::string& filename,
+                                  const std::string& defines);
+
+    // Returns a linked program, loaded from the cache if the same driver
+    // has already linked the same sources, or compiled (and cached)
+    // otherwise.  The defines are added to both shaders.
+    static GLuint LoadProgram(const std::string& vert,
+                              const std::string& frag,
+                              const std::string& defines="");
+
+    static GLuint CompileShader(const std::string& filename,
+                                const std::string& text);
     static GLuint CreateProgram(const GLuint vert, const GLuint frag);
+
+    // Program binary cache files, named by a hash of the driver and the
+    // preprocessed sources.  LoadCachedProgram returns 0 if the file is
+    // missing or the driver rejects it.
+    static std::string CachePath(const std::string& vert_text,
+                                 const std::string& frag_text);
+    static GLuint LoadCachedProgram(const std::string& path);
+    static void SaveCachedProgram(const GLuint program,
+                                  const std::string& path);
 };
 
 #endif
@@ -1,28 +1,122 @@
 #include <cstdint>
-#include <cstring>  // memset
+#include <cstring>  // memset, memcpy
 #include <cmath>
 
 #include <iostream>
 #include <vector>
-
-#include <png.h>
+#include <algorithm>
+#include <map>
 
 #define GLFW_INCLUDE_GLCOREARB
 #include <GLFW/glfw3.h>
 
 #include "ship.h"
 #include "shaders.h"
+#include "constants.h"
+#include "solver.h"
+#include "nodes.h"
+#include "checkpoint.h"
+#include "image.h"
+#include "profiler.h"
+#include "trace.h"
+
+// Texture units used by the simulation passes: state_tex[i] is bound to
+// unit STATE_UNIT + i and derivative_tex[i] to DERIVATIVE_UNIT + i.
+// The reduction in FindPosition and the palette used by Draw have their
+// own units.
+enum {STATE_UNIT=0, DERIVATIVE_UNIT=2, REDUCE_UNIT=6, PALETTE_UNIT=7};
 
 ////////////////////////////////////////////////////////////////////////////////
 
-Ship::Ship(const std::string& imagename)
-    : thrustEnginesOn(false), leftEnginesOn(false), rightEnginesOn(false)
+Ship::Ship(const std::string& imagename, const Backend backend,
+           const bool graphics)
+    : Ship(Image::Load(imagename), backend, graphics)
 {
-    LoadImage(imagename);
-    MakeTextures();
-    MakeBuffers();
-    MakeFramebuffer();
-    MakeVertexArray();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Ship::Ship(const Image& image, const Backend backend, const bool graphics)
+    : thrustEnginesOn(false), leftEnginesOn(false), rightEnginesOn(false),
+      backend(backend), graphics(graphics), solver(NULL), profiler(NULL),
+      precision(FULL), tick(false), blend(1),
+      steps_taken(0),
+      position_next(0), position_pending(0),
+      state_pbo(), state_next(0), state_pending(0), state_mapped(0)
+{
+    // The image's pixels are classified into node types as they're decoded
+    width = image.width;
+    height = image.height;
+    data = image.pixels;
+    filled = image.filled;
+
+    Build();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Ship::Ship(const Checkpoint& checkpoint, const Backend backend,
+           const bool graphics)
+    : backend(backend), graphics(graphics), solver(NULL), profiler(NULL),
+      precision(FULL), tick(false), blend(1),
+      steps_taken(0),
+      position_next(0), position_pending(0),
+      state_pbo(), state_next(0), state_pending(0), state_mapped(0)
+{
+    width = checkpoint.GetWidth();
+    height = checkpoint.GetHeight();
+
+    data = new uint8_t[width*height*4];
+    memcpy(data, checkpoint.GetPixels(), width*height*4);
+    filled = new GLubyte[(width+1)*(height+1)];
+    memcpy(filled, checkpoint.GetFilled(), (width+1)*(height+1));
+
+    Build();
+
+    // The state goes straight from the mapped file into the solver or
+    // the current state texture
+    if (solver)     solver->SetState(checkpoint.GetState());
+    if (graphics)   Upload(checkpoint.GetState(), tick);
+
+    checkpoint.GetPosition(centroid, velocity);
+
+    const uint8_t engines = checkpoint.GetEngines();
+    thrustEnginesOn = engines & FLEET_THRUST_BIT;
+    leftEnginesOn = engines & FLEET_LEFT_BIT;
+    rightEnginesOn = engines & FLEET_RIGHT_BIT;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::Build()
+{
+    MakeNodes();
+
+    if (graphics)
+    {
+        MakeLayout();
+        MakeTextures();
+        MakeBuffers();
+        MakeFramebuffer();
+        MakeVertexArray();
+        MakeMeshes();
+        MakeReduction();
+    }
+
+    if (backend == CPU)
+    {
+#ifdef PIXELSIM_AVX2
+        // The solver (and only the solver) is built with AVX2
+        if (!__builtin_cpu_supports("avx2"))
+        {
+            std::cerr << "[pixelsim]    Error: This CPU doesn't support "
+                      << "AVX2; rebuild with -DPIXELSIM_AVX2=OFF to use "
+                      << "the CPU solver" << std::endl;
+            exit(-1);
+        }
+#endif
+        solver = new Solver(width, height, *nodes);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -31,152 +125,559 @@ Ship::~Ship()
 {
     delete [] data;
     delete [] filled;
+    delete nodes;
+    delete solver;
 
-    glDeleteBuffers(1, &vertex_buf);
-    glDeleteBuffers(1, &color_buf);
-    glDeleteBuffers(1, &rect_buf);
+    if (!graphics)  return;
+
+    glDeleteBuffers(1, &pixel_buf);
+    glDeleteBuffers(1, &palette_buf);
+    glDeleteTextures(1, &palette_tex);
+    glDeleteBuffers(1, &node_buf);
+    glDeleteBuffers(1, &link_buf);
+    glDeleteBuffers(1, &halo_buf);
 
     GLuint* textures[] = {
-        &filled_tex, &state_tex[0], &state_tex[1],
-        &derivative_tex[0], &derivative_tex[2],
+        &state_tex[0], &state_tex[1],
+        &derivative_tex[0], &derivative_tex[1],
         &derivative_tex[2], &derivative_tex[3]
     };
 
     for (auto t : textures)     glDeleteTextures(1, t);
 
-    glDeleteFramebuffers(1, &fbo);
-    glDeleteVertexArrays(1, &vao);
+    glDeleteFramebuffers(2, state_fbo);
+    glDeleteFramebuffers(4, derivative_fbo);
+    glDeleteVertexArrays(1, &node_vao);
+    glDeleteVertexArrays(1, &halo_vao);
+    glDeleteVertexArrays(1, &draw_vao);
+    glDeleteVertexArrays(1, &quad_vao);
+
+    glDeleteBuffers(1, &lod_buf);
+    glDeleteBuffers(1, &lod_palette_buf);
+    glDeleteTextures(1, &lod_palette_tex);
+
+    glDeleteTextures(sum_tex.size(), &sum_tex[0]);
+    glDeleteFramebuffers(sum_fbo.size(), &sum_fbo[0]);
+
+    for (size_t i=0; i < position_pending; ++i)
+    {
+        glDeleteSync(position_fence[(position_next + i + POSITION_READBACKS -
+                                     position_pending) % POSITION_READBACKS]);
+    }
+    glDeleteBuffers(POSITION_READBACKS, position_pbo);
+
+    while (state_mapped)    ReleaseState();
+    for (size_t i=0; i < state_pending; ++i)
+    {
+        glDeleteSync(state_fence[(state_next + i + STATE_READBACKS -
+                                  state_pending) % STATE_READBACKS]);
+    }
+    glDeleteBuffers(STATE_READBACKS, state_pbo);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void Ship::GetDerivatives(const int source, const int out)
 {
-    const GLuint program = Shaders::derivatives;
-    glUseProgram(program);
+    TRACE_GL_SCOPE("Ship::GetDerivatives");
+    if (profiler)   profiler->Begin(Profiler::DERIVATIVES);
 
-    // Load boolean occupancy texture
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, filled_tex);
-    glUniform1i(glGetUniformLocation(program, "filled"), 0);
-
-    // Load RGB32F position and velocity textures
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, state_tex[source]);
-    glUniform1i(glGetUniformLocation(program, "state"), 1);
+    const Shaders::DerivativesProgram& program =
+        precision == HALF ? Shaders::derivatives_half : Shaders::derivatives;
+    glUseProgram(program.program);
 
-    // Load various uniform values
-    glUniform2i(glGetUniformLocation(program, "ship_size"), width, height);
+    // Load RGB32F position and velocity textures.  Neighbor links come
+    // from the per-node attributes in link_buf (see node_vao).
+    glUniform1i(program.state, STATE_UNIT + source);
 
-    glUniform1f(glGetUniformLocation(program, "k"), 10000.0f);
-    glUniform1f(glGetUniformLocation(program, "c"), 1000.0f);
-    glUniform1f(glGetUniformLocation(program, "m"), 1.0f);
-    glUniform1f(glGetUniformLocation(program, "I"), 1.0f);
+    const int firing =
+        FiringEngines(thrustEnginesOn, leftEnginesOn, rightEnginesOn);
+    glUniform1i(program.thrustEnginesOn, (firing & FLEET_THRUST_BIT) != 0);
+    glUniform1i(program.leftEnginesOn, (firing & FLEET_LEFT_BIT) != 0);
+    glUniform1i(program.rightEnginesOn, (firing & FLEET_RIGHT_BIT) != 0);
 
-    glUniform1i(glGetUniformLocation(program, "thrustEnginesOn"),
-            thrustEnginesOn);
-    glUniform1i(glGetUniformLocation(program, "leftEnginesOn"),
-            leftEnginesOn || (thrustEnginesOn&& !rightEnginesOn));
-    glUniform1i(glGetUniformLocation(program, "rightEnginesOn"),
-            rightEnginesOn || (thrustEnginesOn && !leftEnginesOn));
+    RenderToFBO(derivative_fbo[out]);
 
-    RenderToFBO(program, derivative_tex[out]);
+    if (profiler)   profiler->End();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void Ship::ApplyDerivatives(const float dt, const int source)
 {
-    const GLuint program = Shaders::euler;
-    glUseProgram(program);
+    TRACE_GL_SCOPE("Ship::ApplyDerivatives");
+    if (profiler)   profiler->Begin(Profiler::EULER);
 
-    // Bind old velocity texture
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, state_tex[tick]);
-    glUniform1i(glGetUniformLocation(program, "state"), 0);
+    // Split textures also recompute their halo texels from the nodes they
+    // copy, which is how the new state is exchanged between blocks.
+    for (int halo=0; halo < (halo_count ? 2 : 1); ++halo)
+    {
+        const Shaders::EulerProgram& program =
+            halo ? Shaders::euler_halo : Shaders::euler;
+        glUseProgram(program.program);
 
-    // Bind acceleration texture
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, derivative_tex[source]);
-    glUniform1i(glGetUniformLocation(program, "accel"), 1);
+        // Use the old state and acceleration textures
+        glUniform1i(program.state, STATE_UNIT + tick);
+        glUniform1i(program.accel, DERIVATIVE_UNIT + source);
 
-    // Set time-step value
-    glUniform1f(glGetUniformLocation(program, "dt"), dt);
+        // Set time-step value
+        glUniform1f(program.dt, dt);
 
-    // Set the texture size
-    glUniform2i(glGetUniformLocation(program, "size"), width, height);
+        RenderToFBO(state_fbo[!tick], halo);
+    }
 
-    RenderToFBO(program, state_tex[!tick]);
+    if (profiler)   profiler->End();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void Ship::FindPosition()
 {
-    float state[(width+1)*(height+1)*4];
-    glBindTexture(GL_TEXTURE_2D, state_tex[tick]);
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &state);
+    TRACE_GL_SCOPE("Ship::FindPosition");
 
-    centroid[0] = 0;
-    centroid[1] = 0;
-    velocity[0] = 0;
-    velocity[1] = 0;
-    size_t count = 0;
+    const Shaders::ReduceProgram& program = Shaders::reduce;
+    glUseProgram(program.program);
+    glBindVertexArray(quad_vao);
 
-    for (size_t j=0; j <= height; ++j)
+    // Repeatedly sum 2x2 blocks, starting from the current state (whose
+    // empty nodes are zero, so the sums only include live nodes).  Halo
+    // texels hold copies of nodes, so they're left out of the first sum.
+    glActiveTexture(GL_TEXTURE0 + REDUCE_UNIT);
+    glUniform1i(program.source, REDUCE_UNIT);
+
+    size_t w = texture_width;
+    size_t h = texture_height;
+    for (size_t i=0; i < sum_tex.size(); ++i)
     {
-        for (size_t i=0; i <= width; ++i)
+        glBindTexture(GL_TEXTURE_2D, i ? sum_tex[i - 1] : state_tex[tick]);
+        glUniform2i(program.source_size, w, h);
+        glUniform1i(program.block, (i || !block_size) ? 0 : block_size + 2);
+
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        glBindFramebuffer(GL_FRAMEBUFFER, sum_fbo[i]);
+        glViewport(0, 0, w, h);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // If every buffer is still in flight, wait for the oldest one
+    // (which is a few frames old, so should be finished by now).
+    if (position_pending == POSITION_READBACKS)
+    {
+        ReadPosition(true);
+    }
+
+    // Start reading back the final sum (which will be copied into
+    // centroid and velocity by ReadPosition, once it's finished).
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, position_pbo[position_next]);
+    glReadPixels(0, 0, 1, 1, GL_RGBA, GL_FLOAT, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    position_fence[position_next] =
+        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    position_next = (position_next + 1) % POSITION_READBACKS;
+    position_pending++;
+
+    ReadPosition(false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::ReadPosition(const bool wait)
+{
+    TRACE_GL_SCOPE("Ship::ReadPosition");
+
+    while (position_pending)
+    {
+        const size_t i = (position_next + POSITION_READBACKS -
+                          position_pending) % POSITION_READBACKS;
+
+        const GLenum status = glClientWaitSync(
+                position_fence[i], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                wait ? GL_TIMEOUT_IGNORED : 0);
+        if (status != GL_ALREADY_SIGNALED &&
+            status != GL_CONDITION_SATISFIED)
         {
-            if (filled[i + j*(width+1)])
-            {
-                centroid[0] += state[4*(i + j*(width+1))];
-                centroid[1] += state[4*(i + j*(width+1)) + 1];
-                velocity[0] += state[4*(i + j*(width+1)) + 2];
-                velocity[1] += state[4*(i + j*(width+1)) + 3];
-                count++;
-            }
+            break;
         }
+        glDeleteSync(position_fence[i]);
+        position_pending--;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, position_pbo[i]);
+        const GLfloat* const sum = static_cast<const GLfloat*>(
+                glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4*sizeof(GLfloat),
+                                 GL_MAP_READ_BIT));
+        const float count = nodes->size();
+        centroid[0] = sum[0] / count;
+        centroid[1] = sum[1] / count;
+        velocity[0] = sum[2] / count;
+        velocity[1] = sum[3] / count;
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
     }
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
-    centroid[0] /= float(count);
-    centroid[1] /= float(count);
-    velocity[0] /= float(count);
-    velocity[1] /= float(count);
+void Ship::WaitForPosition()
+{
+    if (backend == GPU)     ReadPosition(true);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void Ship::PrintTextureValues()
+void Ship::GetPosition(float c[2], float v[2]) const
 {
-    float tex[(width+1)*(height+1)*4];
+    c[0] = centroid[0];
+    c[1] = centroid[1];
+    v[0] = velocity[0];
+    v[1] = velocity[1];
+}
 
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::SetFused(const bool fused)
+{
+    if (!solver)
+    {
+        std::cerr << "[pixelsim]    Error: Fused RK4 requires the CPU backend"
+                  << std::endl;
+        exit(-1);
+    }
+    solver->SetIntegrator(fused ? Solver::RK4_FUSED : Solver::RK4);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::SetImplicit(const bool implicit)
+{
+    if (!solver)
+    {
+        std::cerr << "[pixelsim]    Error: Implicit stepping requires "
+                  << "the CPU backend" << std::endl;
+        exit(-1);
+    }
+    solver->SetIntegrator(implicit ? Solver::IMPLICIT : Solver::RK4);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::SetStiffness(const float scale)
+{
+    if (!solver)
+    {
+        std::cerr << "[pixelsim]    Error: Changing stiffness requires "
+                  << "the CPU backend" << std::endl;
+        exit(-1);
+    }
+    solver->SetStiffness(scale);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::SetPrecision(const Precision precision)
+{
+    if (solver)
+    {
+        std::cerr << "[pixelsim]    Error: Half precision requires "
+                  << "the GPU backend" << std::endl;
+        exit(-1);
+    }
+
+    this->precision = precision;
+
+    // Derivatives are recalculated from the state on every substep, so
+    // their textures can be reallocated (and zeroed) at any time.
+    const std::vector<GLfloat> zeros(texture_width*texture_height*4, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (auto t : derivative_tex)
+    {
+        glBindTexture(GL_TEXTURE_2D, t);
+        glTexImage2D(GL_TEXTURE_2D, 0,
+                     precision == HALF ? GL_RGBA16F : GL_RGBA32F,
+                     texture_width, texture_height, 0, GL_RGBA, GL_FLOAT,
+                     &zeros[0]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+size_t Ship::GetSubstepBytes(const Precision p) const
+{
+    const size_t state = 4*sizeof(GLfloat);
+    const size_t derivative = p == HALF ? 4*sizeof(GLhalf) : state;
+
+    // Four derivative passes over the nodes, each reading the state and
+    // writing a derivative; then three Euler passes and the RK4 sum over
+    // the nodes and halos, each reading the state and one (or four)
+    // derivatives, and writing the state.
+    const size_t n = nodes->size();
+    const size_t m = n + halo_count;
+    return 4*n*(state + derivative) + 3*m*(2*state + derivative) +
+           m*(2*state + 4*derivative);
+}
+
+size_t Ship::GetTextureBytes(const Precision p) const
+{
+    const size_t state = 4*sizeof(GLfloat);
+    const size_t derivative = p == HALF ? 4*sizeof(GLhalf) : state;
+
+    // Two state textures and four derivative textures
+    return texture_width*texture_height*(2*state + 4*derivative);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::SetTolerance(const float tolerance)
+{
+    if (!solver)
+    {
+        std::cerr << "[pixelsim]    Error: Adaptive stepping requires "
+                  << "the CPU backend" << std::endl;
+        exit(-1);
+    }
+    solver->SetTolerance(tolerance);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::SetSleeping(const float threshold)
+{
+    if (!solver)
+    {
+        std::cerr << "[pixelsim]    Error: Sleeping regions require "
+                  << "the CPU backend" << std::endl;
+        exit(-1);
+    }
+    solver->SetSleeping(threshold);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+float Ship::GetAwakeFraction() const
+{
+    return solver ? solver->GetAwakeFraction() : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int Ship::GetSteps(int* rejected) const
+{
+    if (rejected)   *rejected = solver ? solver->GetRejectedSteps() : 0;
+    return solver ? solver->GetSteps() : steps_taken;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::SetProfiler(Profiler* p)
+{
+    profiler = p;
+    if (solver)     solver->SetProfiler(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t Ship::GetChecksum() const
+{
+    if (!solver)
+    {
+        std::cerr << "[pixelsim]    Error: Checksums require the CPU backend"
+                  << std::endl;
+        exit(-1);
+    }
+    return solver->GetChecksum();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Ship::SaveCheckpoint(const std::string& filename, const uint64_t frame)
+{
+    TRACE_GL_SCOPE("Ship::SaveCheckpoint");
+
+    std::vector<GLfloat> state((width+1)*(height+1)*4);
+    GetState(&state[0]);
+    if (solver)     solver->FindPosition(centroid, velocity);
+    else            ReadPosition(true);
+
+    const uint8_t engines = (thrustEnginesOn ? FLEET_THRUST_BIT : 0) |
+                            (leftEnginesOn   ? FLEET_LEFT_BIT   : 0) |
+                            (rightEnginesOn  ? FLEET_RIGHT_BIT  : 0);
+    return Checkpoint::Write(filename, width, height, data, filled,
+                             &state[0], centroid, velocity, engines, frame);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::GetState(float* rgba) const
+{
+    TRACE_GL_SCOPE("Ship::GetState");
+
+    if (solver)
+    {
+        solver->GetState(rgba);
+
+        // Match the GPU's layout, where empty nodes are zero
+        for (size_t i=0; i < (width+1)*(height+1); ++i)
+        {
+            if (!filled[i])     std::fill(&rgba[i*4], &rgba[i*4 + 4], 0);
+        }
+    }
+    else
+    {
+        ReadTexture(state_tex[tick], rgba);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Ship::StartStateReadback(const uint64_t frame)
+{
+    TRACE_GL_SCOPE("Ship::StartStateReadback");
+
+    if (state_pending + state_mapped == STATE_READBACKS)    return false;
+
+    if (!state_pbo[0])
+    {
+        glGenBuffers(STATE_READBACKS, state_pbo);
+        for (auto pbo : state_pbo)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER,
+                         texture_width*texture_height*4*sizeof(GLfloat),
+                         NULL, GL_STREAM_READ);
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, state_pbo[state_next]);
     glBindTexture(GL_TEXTURE_2D, state_tex[tick]);
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &tex);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    state_fence[state_next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    state_frame[state_next] = frame;
+    state_next = (state_next + 1) % STATE_READBACKS;
+    state_pending++;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const float* Ship::MapState(const bool wait, uint64_t* frame)
+{
+    TRACE_GL_SCOPE("Ship::MapState");
+
+    if (!state_pending)     return NULL;
+
+    const size_t i = (state_next + STATE_READBACKS - state_pending) %
+                     STATE_READBACKS;
+    const GLenum status = glClientWaitSync(
+            state_fence[i], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+            wait ? GL_TIMEOUT_IGNORED : 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+    {
+        return NULL;
+    }
+    glDeleteSync(state_fence[i]);
+    state_pending--;
+    state_mapped++;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, state_pbo[i]);
+    const float* texels = static_cast<const float*>(
+            glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                             texture_width*texture_height*4*sizeof(GLfloat),
+                             GL_MAP_READ_BIT));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    *frame = state_frame[i];
+    return texels;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::ReleaseState()
+{
+    const size_t i = (state_next + 2*STATE_READBACKS - state_pending -
+                      state_mapped) % STATE_READBACKS;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, state_pbo[i]);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    state_mapped--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+std::vector<uint32_t> Ship::GetTexelIndex() const
+{
+    std::vector<uint32_t> texels(nodes->size());
+    for (size_t n=0; n < nodes->size(); ++n)
+    {
+        size_t tx, ty;
+        GetTexel(nodes->index[n], &tx, &ty);
+        texels[n] = tx + ty*texture_width;
+    }
+    return texels;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::ReadTexture(const GLuint tex, float* rgba) const
+{
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    if (!block_size)
+    {
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, rgba);
+        return;
+    }
+
+    std::vector<GLfloat> texels(texture_width*texture_height*4);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &texels[0]);
+    FromTextureLayout(&texels[0], rgba);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+size_t Ship::GetNodeCount() const
+{
+    return nodes->size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::PrintTextureValues()
+{
+    const size_t count = (width+1)*(height+1)*4;
+    std::vector<float> tex(count);
+
+    ReadTexture(state_tex[tick], &tex[0]);
     std::cout << "State:\n";
-    for (int i=0; i < (width+1)*(height+1)*4; i += 4)
+    for (size_t i=0; i < count; i += 4)
     {
         std::cout << tex[i] << ',' << tex[i+1]  << "    ";
     }
     std::cout << std::endl;
 
     std::cout << "Velocities:\n";
-    for (int i=0; i < (width+1)*(height+1)*4; i += 4)
+    for (size_t i=0; i < count; i += 4)
     {
         std::cout << tex[i+2] << ',' << tex[i+3]  << "    ";
     }
     std::cout << std::endl;
 
+    BindTextures();
     GetDerivatives(tick, 0);
-    glBindTexture(GL_TEXTURE_2D, derivative_tex[0]);
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &tex);
+    ReadTexture(derivative_tex[0], &tex[0]);
     std::cout << "Derived velocities:\n";
-    for (int i=0; i < (width+1)*(height+1)*4; i += 4)
+    for (size_t i=0; i < count; i += 4)
     {
         std::cout << tex[i] << ',' << tex[i+1]  << "    ";
     }
     std::cout << std::endl;
     std::cout << "Accelerations:\n";
-    for (int i=0; i < (width+1)*(height+1)*4; i += 4)
+    for (size_t i=0; i < count; i += 4)
     {
         std::cout << tex[i+2] << ',' << tex[i+3]  << "    ";
     }
@@ -188,9 +689,34 @@ void Ship::PrintTextureValues()
 
 void Ship::Update(const float dt, const int steps)
 {
+    TRACE_GL_SCOPE("Ship::Update");
+
     //PrintTextureValues();
 
+    if (backend == CPU)
+    {
+        const int firing =
+            FiringEngines(thrustEnginesOn, leftEnginesOn, rightEnginesOn);
+        solver->Update(dt, steps, firing & FLEET_THRUST_BIT,
+                       firing & FLEET_LEFT_BIT, firing & FLEET_RIGHT_BIT);
+        if (profiler)   profiler->Begin(Profiler::FIND_POSITION, false);
+        solver->FindPosition(centroid, velocity);
+        if (profiler)   profiler->End();
+
+        if (!graphics)  return;
+
+        // Upload the new state so that Draw can use it.
+        std::vector<GLfloat> state((width+1)*(height+1)*4);
+        solver->GetState(&state[0]);
+        Upload(&state[0], tick);
+        return;
+    }
+
+    // Every pass reads from these units, so bind them once up front.
+    BindTextures();
+
     const float dt_ = dt / steps;
+    steps_taken = steps;
     for (int i=0; i < steps; ++i) {
         GetDerivatives(tick, 0);    // k1 = f(y)
 
@@ -208,44 +734,39 @@ void Ship::Update(const float dt, const int steps)
     }
 
     // Update centroid and velocity arrays.
+    if (profiler)   profiler->Begin(Profiler::FIND_POSITION);
     FindPosition();
+    if (profiler)   profiler->End();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void Ship::GetNextState(const float dt)
 {
-    const GLuint program = Shaders::RK4sum;
-    glUseProgram(program);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, state_tex[tick]);
-    glUniform1i(glGetUniformLocation(program, "y"), 0);
+    TRACE_GL_SCOPE("Ship::GetNextState");
+    if (profiler)   profiler->Begin(Profiler::RK4_SUM);
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, derivative_tex[0]);
-    glUniform1i(glGetUniformLocation(program, "k1"), 1);
-
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, derivative_tex[1]);
-    glUniform1i(glGetUniformLocation(program, "k2"), 2);
-
-    glActiveTexture(GL_TEXTURE3);
-    glBindTexture(GL_TEXTURE_2D, derivative_tex[2]);
-    glUniform1i(glGetUniformLocation(program, "k3"), 3);
-
-    glActiveTexture(GL_TEXTURE4);
-    glBindTexture(GL_TEXTURE_2D, derivative_tex[3]);
-    glUniform1i(glGetUniformLocation(program, "k4"), 4);
+    // As in ApplyDerivatives, halo texels are recomputed too
+    for (int halo=0; halo < (halo_count ? 2 : 1); ++halo)
+    {
+        const Shaders::RK4Program& program =
+            halo ? Shaders::rk4sum_halo : Shaders::rk4sum;
+        glUseProgram(program.program);
 
-    glUniform1f(glGetUniformLocation(program, "dt"), dt);
+        glUniform1i(program.y, STATE_UNIT + tick);
+        glUniform1i(program.k1, DERIVATIVE_UNIT + 0);
+        glUniform1i(program.k2, DERIVATIVE_UNIT + 1);
+        glUniform1i(program.k3, DERIVATIVE_UNIT + 2);
+        glUniform1i(program.k4, DERIVATIVE_UNIT + 3);
 
-    // Set the texture size
-    glUniform2i(glGetUniformLocation(program, "size"), width, height);
+        glUniform1f(program.dt, dt);
 
-    RenderToFBO(program, state_tex[!tick]);
+        RenderToFBO(state_fbo[!tick], halo);
+    }
 
     tick = !tick;
+
+    if (profiler)   profiler->End();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -253,70 +774,100 @@ void Ship::GetNextState(const float dt)
 void Ship::Draw(const int window_width, const int window_height,
                 const bool track, const float scale) const
 {
-    glViewport(0, 0, window_width, window_height);
+    TRACE_GL_SCOPE("Ship::Draw");
+    if (profiler)   profiler->Begin(Profiler::DRAW);
 
-    const GLuint program = Shaders::ship;
-    glUseProgram(program);
-
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buf);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, color_buf);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_UNSIGNED_BYTE, GL_TRUE, 3*sizeof(GLbyte), 0);
+    glViewport(0, 0, window_width, window_height);
 
-    glUniform2i(glGetUniformLocation(program, "window_size"),
-                window_width, window_height);
-    glUniform2i(glGetUniformLocation(program, "ship_size"),
-                width, height);
+    // Find how many screen pixels each ship pixel covers (fitting the
+    // ship to the window as ship.vert does), then pick the coarsest mesh
+    // whose merged runs still fit in one screen pixel.
+    const float pixel =
+        (width*window_height) / (height*window_width) >= 1
+            ? scale*window_width/width : scale*window_height/height;
+    size_t lod = 0;
+    while (lod < lods.size() && pixel*(2 << lod) <= 1)  lod++;
+
+    const Shaders::ShipProgram& program =
+        lod ? Shaders::ship_mesh : Shaders::ship;
+    glUseProgram(program.program);
+
+    glUniform2i(program.window_size, window_width, window_height);
+    glUniform2i(program.ship_size, width, height);
+    glUniform1i(program.block, block_size);
+    glUniform1i(program.blocks_x, blocks_x);
+    glUniform1i(program.atlas_columns, atlas_columns);
 
     if (track)
     {
-        glUniform2f(glGetUniformLocation(program, "offset"),
-                    centroid[0], centroid[1]);
+        glUniform2f(program.offset, centroid[0], centroid[1]);
     }
     else
     {
-        glUniform2f(glGetUniformLocation(program, "offset"),
-                    width/2.0f, height/2.0f);
+        glUniform2f(program.offset, width/2.0f, height/2.0f);
     }
 
-    glUniform1f(glGetUniformLocation(program, "scale"), scale);
+    glUniform1f(program.scale, scale);
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, state_tex[tick]);
-    glUniform1i(glGetUniformLocation(program, "pos"), 0);
+    glUniform1i(program.pos, 0);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, state_tex[!tick]);
+    glUniform1i(program.prev, 1);
+    glUniform1f(program.alpha, blend);
+    glActiveTexture(GL_TEXTURE0);
+
+    const int firing =
+        FiringEngines(thrustEnginesOn, leftEnginesOn, rightEnginesOn);
+    glUniform1i(program.thrustEnginesOn, (firing & FLEET_THRUST_BIT) != 0);
+    glUniform1i(program.leftEnginesOn, (firing & FLEET_LEFT_BIT) != 0);
+    glUniform1i(program.rightEnginesOn, (firing & FLEET_RIGHT_BIT) != 0);
 
-    glUniform1i(glGetUniformLocation(program, "thrustEnginesOn"),
-            thrustEnginesOn);
-    glUniform1i(glGetUniformLocation(program, "leftEnginesOn"),
-            leftEnginesOn || (thrustEnginesOn && !rightEnginesOn));
-    glUniform1i(glGetUniformLocation(program, "rightEnginesOn"),
-            rightEnginesOn || (thrustEnginesOn && !leftEnginesOn));
+    glBindVertexArray(draw_vao);
 
-    glDrawArrays(GL_TRIANGLES, 0, pixel_count*2*3);
+    glActiveTexture(GL_TEXTURE0 + PALETTE_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, lod ? lod_palette_tex : palette_tex);
+    glUniform1i(program.palette, PALETTE_UNIT);
+    glActiveTexture(GL_TEXTURE0);
+
+    // Each batch's records are read from its own offset into pixel_buf
+    // (or lod_buf, for a level-of-detail mesh)
+    glBindBuffer(GL_ARRAY_BUFFER, lod ? lod_buf : pixel_buf);
+    for (const auto& b : lod ? lods[lod - 1] : pixel_batches)
+    {
+        glUniform2i(program.origin, b.origin[0], b.origin[1]);
+        glUniform1i(program.palette_base, b.palette);
+        glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, sizeof(GLuint),
+                               (void*)(b.first*sizeof(GLuint)));
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, b.count);
+    }
+
+    if (profiler)   profiler->End();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void Ship::RenderToFBO(const GLuint program, const GLuint tex)
+void Ship::RenderToFBO(const GLuint fbo, const bool halos)
 {
-    // Bind the desired texture to the framebuffer
+    // Bind the framebuffer for the desired texture
     glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                           GL_TEXTURE_2D, tex, 0);
-
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glViewport(0, 0, width+1, height+1);
-
-    // Load triangles that draw a flat rectangle from -1, -1, to 1, 1
-    glBindBuffer(GL_ARRAY_BUFFER, rect_buf);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
+    glViewport(0, 0, texture_width, texture_height);
 
-    // Draw the full rectangle into the FBO
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    // Draw one point per live node, at the center of its texel.  Empty
+    // nodes are never shaded (and are never read by any pass), so there's
+    // no need to clear the texture first.
+    if (halos)
+    {
+        glBindVertexArray(halo_vao);
+        glDrawArrays(GL_POINTS, 0, halo_count);
+    }
+    else
+    {
+        glBindVertexArray(node_vao);
+        glDrawArrays(GL_POINTS, 0, nodes->size());
+    }
 
     // Switch back to the default framebuffer.
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -324,191 +875,331 @@ void Ship::RenderToFBO(const GLuint program, const GLuint tex)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-// Minimal function to load a .png image.
-// Assumes that the file exists and does minimal error checking.
-void Ship::LoadImage(const std::string& imagename)
+void Ship::BindTextures() const
 {
-    png_structp png_ptr = png_create_read_struct(
-            PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-
-    FILE* input = fopen(imagename.c_str(), "rb");
-    png_init_io(png_ptr, input);
-    png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
-    fclose(input);
-
-    if (png_get_color_type(png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB_ALPHA)
+    for (int i=0; i < 2; ++i)
     {
-        std::cerr << "[pixelsim]    Error: Image must have alpha channel."
-                  << std::endl;
-        exit(-1);
+        glActiveTexture(GL_TEXTURE0 + STATE_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D, state_tex[i]);
     }
-    else if (png_get_bit_depth(png_ptr, info_ptr) != 8)
+    for (int i=0; i < 4; ++i)
     {
-        std::cerr << "[pixelsim]    Error: Image must have 8-bit depth."
-                  << std::endl;
-        exit(-1);
+        glActiveTexture(GL_TEXTURE0 + DERIVATIVE_UNIT + i);
+        glBindTexture(GL_TEXTURE_2D, derivative_tex[i]);
     }
+    glActiveTexture(GL_TEXTURE0);
+}
 
-    width = png_get_image_width(png_ptr, info_ptr);
-    height = png_get_image_height(png_ptr, info_ptr);
+////////////////////////////////////////////////////////////////////////////////
 
-    data = new uint8_t[width*height*4];
-    png_bytep* rows = png_get_rows(png_ptr, info_ptr);
-    for (size_t j=0; j < height; ++j) {
-        memmove(&data[j*width*4], rows[j], width*4);
+void Ship::Upload(const float* state, const int i)
+{
+    TRACE_GL_SCOPE("Ship::Upload");
+
+    if (block_size)
+    {
+        staging.resize(texture_width*texture_height*4);
+        ToTextureLayout(state, &staging[0]);
+        state = &staging[0];
     }
 
-    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, state_tex[i]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texture_width, texture_height,
+                    GL_RGBA, GL_FLOAT, state);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void Ship::MakeBuffers()
+void Ship::GetTexel(const size_t i, size_t* tx, size_t* ty) const
 {
-    std::vector<GLfloat> vertices;
-    std::vector<GLbyte>  colors;
+    const size_t x = i % (width+1);
+    const size_t y = i / (width+1);
+    if (!block_size)
+    {
+        *tx = x;
+        *ty = y;
+        return;
+    }
 
-    for (size_t y=0; y < height; ++y) {
-        for (size_t x=0; x < width; ++x) {
-            if (data[y*width*4 + x*4 + 3]) {
-                // First triangle
-                vertices.push_back(x);
-                vertices.push_back(height-y-1);
+    const size_t bx = x / block_size;
+    const size_t by = y / block_size;
+    const size_t n = bx + by*blocks_x;
+    *tx = x - bx*block_size + 1 + (n % atlas_columns)*(block_size + 2);
+    *ty = y - by*block_size + 1 + (n / atlas_columns)*(block_size + 2);
+}
 
-                vertices.push_back(x+1);
-                vertices.push_back(height-y-1);
+////////////////////////////////////////////////////////////////////////////////
 
-                vertices.push_back(x+1);
-                vertices.push_back(height-y);
+bool Ship::GetNode(const size_t tx, const size_t ty, size_t* i) const
+{
+    const size_t side = block_size + 2;
+    const size_t n = tx / side + (ty / side)*atlas_columns;
+    if (n >= blocks_x*blocks_y)     return false;
 
-                // Second triangle
-                vertices.push_back(x+1);
-                vertices.push_back(height-y);
+    // Unsigned wraparound takes care of the lower bounds.
+    const size_t x = (n % blocks_x)*block_size + tx % side - 1;
+    const size_t y = (n / blocks_x)*block_size + ty % side - 1;
+    if (x > width || y > height)    return false;
 
-                vertices.push_back(x);
-                vertices.push_back(height-y);
+    *i = x + y*(width+1);
+    return true;
+}
 
-                vertices.push_back(x);
-                vertices.push_back(height-y-1);
+////////////////////////////////////////////////////////////////////////////////
 
-                // Every vertex gets a color from the image
-                for (int v=0; v < 6; ++v) {
-                    colors.push_back(data[y*width*4 + x*4]);
-                    colors.push_back(data[y*width*4 + x*4 + 1]);
-                    colors.push_back(data[y*width*4 + x*4 + 2]);
+void Ship::ToTextureLayout(const float* grid, float* texels) const
+{
+    for (size_t ty=0; ty < texture_height; ++ty) {
+        for (size_t tx=0; tx < texture_width; ++tx) {
+            float* const t = &texels[(tx + ty*texture_width)*4];
+            size_t i;
+            if (GetNode(tx, ty, &i))    memcpy(t, &grid[i*4], 4*sizeof(float));
+            else                        std::fill(t, t + 4, 0);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::FromTextureLayout(const float* texels, float* grid) const
+{
+    for (size_t i=0; i < (width+1)*(height+1); ++i)
+    {
+        size_t tx, ty;
+        GetTexel(i, &tx, &ty);
+        memcpy(&grid[i*4], &texels[(tx + ty*texture_width)*4],
+               4*sizeof(float));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Ship::MakeBuffers()
+{
+    // Pack every filled pixel into a record (see ship.vert), tile by tile,
+    // starting a new batch for each tile and whenever the current batch's
+    // palette is full.  Rows are visited top first, in the image's order.
+    std::vector<GLuint> records;
+    std::vector<GLubyte> palette;
+    std::map<uint32_t, GLuint> colors;  // indices in the batch's palette
+
+    for (size_t ty=0; ty < height; ty += PIXEL_TILE) {
+        for (size_t tx=0; tx < width; tx += PIXEL_TILE) {
+            auto start = [&]()
+            {
+                pixel_batches.push_back({records.size(), 0,
+                                         {GLint(tx), GLint(ty)},
+                                         GLint(palette.size() / 4)});
+                colors.clear();
+            };
+            start();
+
+            const size_t x_end = std::min<size_t>(tx + PIXEL_TILE, width);
+            const size_t y_end = std::min<size_t>(ty + PIXEL_TILE, height);
+            for (size_t y=y_end; y-- > ty;) {
+                for (size_t x=tx; x < x_end; ++x) {
+                    const uint8_t* const pixel =
+                        &data[4*(width*(height-1-y) + x)];
+                    if (!pixel[3])  continue;
+
+                    const uint32_t rgb = pixel[0] | (pixel[1] << 8) |
+                                         (pixel[2] << 16);
+                    auto c = colors.find(rgb);
+                    if (c == colors.end())
+                    {
+                        if (colors.size() == PIXEL_PALETTE)     start();
+                        c = colors.insert({rgb, colors.size()}).first;
+                        palette.insert(palette.end(),
+                                       {pixel[0], pixel[1], pixel[2], 255});
+                    }
+
+                    records.push_back((x - tx) | ((y - ty) << 12) |
+                                      (c->second << 24));
+                    pixel_batches.back().count++;
                 }
             }
+
+            if (!pixel_batches.back().count)    pixel_batches.pop_back();
         }
     }
 
     // Save the total number of filled pixels
-    pixel_count = vertices.size() / 12;
+    pixel_count = records.size();
+
+    glGenBuffers(1, &pixel_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, pixel_buf);
+    glBufferData(GL_ARRAY_BUFFER, records.size()*sizeof(records[0]),
+                 records.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &palette_buf);
+    glBindBuffer(GL_TEXTURE_BUFFER, palette_buf);
+    glBufferData(GL_TEXTURE_BUFFER, palette.size(), palette.data(),
+                 GL_STATIC_DRAW);
+    glGenTextures(1, &palette_tex);
+    glBindTexture(GL_TEXTURE_BUFFER, palette_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, palette_buf);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+    // Make a list of points at the texel centers of live nodes (in
+    // normalized device coordinates), used for texture FBO rendering
+    std::vector<GLfloat> points;
+    for (auto i : nodes->index)
+    {
+        size_t tx, ty;
+        GetTexel(i, &tx, &ty);
+        points.push_back((tx + 0.5f) / texture_width * 2 - 1);
+        points.push_back((ty + 0.5f) / texture_height * 2 - 1);
+    }
+    glGenBuffers(1, &node_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, node_buf);
+    glBufferData(GL_ARRAY_BUFFER, points.size()*sizeof(points[0]),
+                 &points[0], GL_STATIC_DRAW);
+
+    // In split textures, make a point at every halo texel that copies a
+    // live node, along with the texel of the node that it copies.
+    if (block_size)
+    {
+        struct Halo
+        {
+            GLfloat point[2];
+            GLint source[2];
+        };
+        std::vector<Halo> halos;
+
+        const size_t side = block_size + 2;
+        for (size_t ty=0; ty < texture_height; ++ty) {
+            for (size_t tx=0; tx < texture_width; ++tx) {
+                const bool edge = tx % side == 0 || tx % side == side - 1 ||
+                                  ty % side == 0 || ty % side == side - 1;
+                size_t i;
+                if (!edge || !GetNode(tx, ty, &i) || !filled[i])  continue;
+
+                size_t sx, sy;
+                GetTexel(i, &sx, &sy);
+                halos.push_back({{(tx + 0.5f) / texture_width * 2 - 1,
+                                  (ty + 0.5f) / texture_height * 2 - 1},
+                                 {GLint(sx), GLint(sy)}});
+            }
+        }
+        halo_count = halos.size();
 
-    // Allocate space for the vertices, colors, and position data
-    glGenBuffers(1, &vertex_buf);
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buf);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(vertices[0]),
-                 &vertices[0], GL_STATIC_DRAW);
+        glGenBuffers(1, &halo_buf);
+        glBindBuffer(GL_ARRAY_BUFFER, halo_buf);
+        glBufferData(GL_ARRAY_BUFFER, halos.size()*sizeof(Halo),
+                     halos.data(), GL_STATIC_DRAW);
+    }
+
+    // Store each live node's type and spring links, so that the derivative
+    // pass doesn't have to rediscover its neighbors on every evaluation.
+    std::vector<GLubyte> links;
+    for (size_t n=0; n < nodes->size(); ++n)
+    {
+        links.push_back(nodes->types[n]);
+        links.push_back(nodes->links[n]);
+    }
+    glGenBuffers(1, &link_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, link_buf);
+    glBufferData(GL_ARRAY_BUFFER, links.size()*sizeof(links[0]),
+                 &links[0], GL_STATIC_DRAW);
 
-    glGenBuffers(1, &color_buf);
-    glBindBuffer(GL_ARRAY_BUFFER, color_buf);
-    glBufferData(GL_ARRAY_BUFFER, colors.size()*sizeof(colors[0]),
-                 &colors[0], GL_STATIC_DRAW);
+}
 
+////////////////////////////////////////////////////////////////////////////////
 
-    // Make a screen-filling flat pane used for texture FBO rendering
-    GLfloat rect[12] = {
-            -1, -1,
-             1, -1,
-             1,  1,
-            -1, -1,
-             1,  1,
-            -1,  1};
-    glGenBuffers(1, &rect_buf);
-    glBindBuffer(GL_ARRAY_BUFFER, rect_buf);
-    glBufferData(GL_ARRAY_BUFFER, 12*sizeof(rect[0]),
-                 &rect[0], GL_STATIC_DRAW);
+void Ship::MakeNodes()
+{
+    // Build the compacted list of live nodes and their neighbors
+    nodes = new Nodes(width, height, filled);
 
+    // Start with the centroid of the ship at rest, until the first
+    // Update (or readback) replaces it.
+    centroid[0] = centroid[1] = 0;
+    for (auto i : nodes->index)
+    {
+        centroid[0] += i % (width+1);
+        centroid[1] += i / (width+1);
+    }
+    centroid[0] /= nodes->size();
+    centroid[1] /= nodes->size();
+    velocity[0] = velocity[1] = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void Ship::MakeTextures()
+void Ship::MakeLayout()
 {
-    {   // Load a byte-map recording occupancy
-        // Bytes are byte-aligned, so set unpack alignment to 1
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        filled = new GLubyte[(width+1)*(height+1)];
-        memset(filled, 0, sizeof(GLubyte)*(width+1)*(height+1));
-
-        for (size_t y=0; y < height; ++y) {
-            for (size_t x=0; x < width; ++x) {
-                // Get the pixel's address in the data array:
-                uint8_t* const pixel = &data[4*(width*(height-1-y) + x)];
-                const uint8_t r = pixel[0];
-                const uint8_t g = pixel[1];
-                const uint8_t b = pixel[2];
-                const uint8_t a = pixel[3];
-
-                // Pure red nodes are thruster engines
-                // Red with 1 bit of blue are leftward engines
-                // Red with 2 bits of blue are rightward engines
-                GLubyte type;
-                if      (r == SHIP_ENGINE_THRUST_R &&
-                         g == SHIP_ENGINE_THRUST_G &&
-                         b == SHIP_ENGINE_THRUST_B && a)        type = THRUST;
-                else if (r == SHIP_ENGINE_LEFT_R &&
-                         g == SHIP_ENGINE_LEFT_G &&
-                         b == SHIP_ENGINE_LEFT_B && a)          type = LEFT;
-                else if (r == SHIP_ENGINE_RIGHT_R &&
-                         g == SHIP_ENGINE_RIGHT_G &&
-                         b == SHIP_ENGINE_RIGHT_B && a)         type = RIGHT;
-                else if (a)                                     type = SHIP;
-                else                                            type = EMPTY;
-
-                const size_t indices[] = {
-                        y*(width+1) + x, (y+1)*(width+1) + x,
-                        y*(width+1) + x + 1, (y+1)*(width+1) + x + 1};
-
-
-                for (size_t i : indices) {
-                    if (filled[i] == EMPTY)
-                    {
-                        filled[i] = type;
-                    }
-                    else if (type != EMPTY && filled[i] != type)
-                    {
-                        filled[i] = SHIP;
-                    }
-                }
-            }
-        }
-
-        glGenTextures(1, &filled_tex);
-        glBindTexture(GL_TEXTURE_2D, filled_tex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width+1, height+1,
-                     0, GL_RED, GL_UNSIGNED_BYTE, filled);
-        SetTextureDefaults();
+    halo_buf = 0;
+    halo_vao = 0;
+    halo_count = 0;
+
+    // Passes render to the whole texture, so it must fit in a viewport too
+    GLint max_texture;
+    GLint max_viewport[2];
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture);
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, max_viewport);
+    const size_t limit = std::min(max_texture,
+                                  std::min(max_viewport[0], max_viewport[1]));
+
+    if (width + 1 <= limit && height + 1 <= limit)
+    {
+        block_size = 0;
+        blocks_x = blocks_y = atlas_columns = 1;
+        texture_width = width + 1;
+        texture_height = height + 1;
+        return;
     }
 
+    // Otherwise, split the grid into blocks (with halos), packing as many
+    // blocks into each row of the textures as will fit
+    block_size = Nodes::BLOCK_SIZE;
+    blocks_x = width / block_size + 1;
+    blocks_y = height / block_size + 1;
+
+    const size_t blocks = blocks_x * blocks_y;
+    const size_t side = block_size + 2;
+    atlas_columns = std::min(blocks, limit / side);
+    texture_width = atlas_columns * side;
+    texture_height = (blocks + atlas_columns - 1) / atlas_columns * side;
 
+    if (texture_height > limit)
+    {
+        std::cerr << "[pixelsim]    Error: Ship is too large for the GPU "
+                  << "backend (" << blocks << " blocks of " << side << "x"
+                  << side << " texels don't fit in " << limit << "x" << limit
+                  << ")" << std::endl;
+        exit(-1);
+    }
+}
+
+void Ship::MakeTextures()
+{
     {   // Make a texture that stores position and velocity, and initialize
         // it with each pixel centered in the proper position with velocity 0.
+        // Empty nodes are never read by any pass, so they're set to zero
+        // (which lets FindPosition sum the whole texture).
 
         // Floats are 4-byte-aligned.
         glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-        GLfloat* const pos = new GLfloat[(width+1)*(height+1)*4];
+        std::vector<GLfloat> pos((width+1)*(height+1)*4);
         size_t i=0;
         for (size_t y=0; y <= height; ++y) {
             for (size_t x=0; x <= width; ++x) {
-                pos[i++] = x;
-                pos[i++] = y;
+                const bool live = filled[y*(width+1) + x];
+                pos[i++] = live ? x : 0;
+                pos[i++] = live ? y : 0;
                 pos[i++] = 0;
                 pos[i++] = 0;
             }
         }
 
+        if (block_size)
+        {
+            std::vector<GLfloat> texels(texture_width*texture_height*4);
+            ToTextureLayout(&pos[0], &texels[0]);
+            pos.swap(texels);
+        }
+
         GLuint* textures[] = {&state_tex[0], &state_tex[1],
                               &derivative_tex[0], &derivative_tex[1],
                               &derivative_tex[2], &derivative_tex[3]};
@@ -516,23 +1207,216 @@ void Ship::MakeTextures()
         {
             glGenTextures(1, t);
             glBindTexture(GL_TEXTURE_2D, *t);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width+1, height+1,
-                    0, GL_RGBA, GL_FLOAT, pos);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F,
+                    texture_width, texture_height,
+                    0, GL_RGBA, GL_FLOAT, &pos[0]);
             SetTextureDefaults();
         }
-        delete [] pos;
     }
 }
 
 void Ship::MakeFramebuffer()
 {
-    glGenFramebuffers(1, &fbo);
+    // Make one framebuffer per target texture, so that passes only
+    // have to bind a framebuffer (rather than re-attaching textures).
+    glGenFramebuffers(2, state_fbo);
+    glGenFramebuffers(4, derivative_fbo);
+
+    for (int i=0; i < 6; ++i)
+    {
+        const GLuint fbo = i < 2 ? state_fbo[i] : derivative_fbo[i - 2];
+        const GLuint tex = i < 2 ? state_tex[i] : derivative_tex[i - 2];
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, tex, 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void Ship::MakeVertexArray()
 {
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao); // we'll use this VAO all the time
+    // Vertex array for simulation passes: one point per live node
+    glGenVertexArrays(1, &node_vao);
+    glBindVertexArray(node_vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, node_buf);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
+
+    // Each node also gets its type and neighbor links (used by node.vert)
+    glBindBuffer(GL_ARRAY_BUFFER, link_buf);
+    glEnableVertexAttribArray(1);
+    glVertexAttribIPointer(1, 2, GL_UNSIGNED_BYTE, 2*sizeof(GLubyte), 0);
+
+    // Vertex array for recomputing halo texels: one point per halo texel,
+    // with the texel that it copies (used by halo.vert)
+    if (halo_buf)
+    {
+        glGenVertexArrays(1, &halo_vao);
+        glBindVertexArray(halo_vao);
+
+        const GLsizei stride = 2*sizeof(GLfloat) + 2*sizeof(GLint);
+        glBindBuffer(GL_ARRAY_BUFFER, halo_buf);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, 0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribIPointer(1, 2, GL_INT, stride,
+                               (void*)(2*sizeof(GLfloat)));
+    }
+
+    // Vertex array for drawing: one instance per filled pixel (whose
+    // record pointer Draw moves to each batch in turn)
+    glGenVertexArrays(1, &draw_vao);
+    glBindVertexArray(draw_vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, pixel_buf);
+    glEnableVertexAttribArray(0);
+    glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, sizeof(GLuint), 0);
+    glVertexAttribDivisor(0, 1);
+}
+
+void Ship::MakeMeshes()
+{
+    // Each level doubles the longest run that can be merged into a quad,
+    // until that stops saving at least a quarter of the quads.  Merged
+    // quads are only positioned by the nodes at their corners, so runs are
+    // kept short enough to bend with the ship.  Quads are packed into
+    // records as pixels are (see MakeBuffers), but by LOD_TILE tiles, and
+    // runs are cut at the edges of their tile.
+    std::vector<GLuint> records;
+    std::vector<GLubyte> palette;
+    std::map<uint32_t, GLuint> colors;  // indices in the batch's palette
+
+    size_t quads = pixel_count;
+    for (size_t run=2; run <= LOD_MAX_RUN; run *= 2)
+    {
+        const size_t first = records.size();
+        const size_t palette_size = palette.size();
+        std::vector<PixelBatch> batches;
+
+        for (size_t ty=0; ty < height; ty += LOD_TILE) {
+            for (size_t tx=0; tx < width; tx += LOD_TILE) {
+                auto start = [&]()
+                {
+                    batches.push_back({records.size(), 0,
+                                       {GLint(tx), GLint(ty)},
+                                       GLint(palette.size() / 4)});
+                    colors.clear();
+                };
+                start();
+
+                const size_t x_end = std::min<size_t>(tx + LOD_TILE, width);
+                const size_t y_end = std::min<size_t>(ty + LOD_TILE, height);
+                for (size_t y=ty; y < y_end; ++y)
+                {
+                    const uint8_t* const row = &data[4*width*(height-1-y)];
+
+                    size_t x = tx;
+                    while (x < x_end)
+                    {
+                        const uint8_t* const pixel = &row[4*x];
+                        if (!pixel[3])
+                        {
+                            x++;
+                            continue;
+                        }
+
+                        size_t end = x + 1;
+                        while (end < x_end && end - x < run &&
+                               row[4*end + 3] &&
+                               !memcmp(&row[4*end], pixel, 3))
+                        {
+                            end++;
+                        }
+
+                        const uint32_t rgb = pixel[0] | (pixel[1] << 8) |
+                                             (pixel[2] << 16);
+                        auto c = colors.find(rgb);
+                        if (c == colors.end())
+                        {
+                            if (colors.size() == PIXEL_PALETTE)     start();
+                            c = colors.insert({rgb, colors.size()}).first;
+                            palette.insert(palette.end(),
+                                           {pixel[0], pixel[1], pixel[2],
+                                            255});
+                        }
+
+                        records.push_back((x - tx) | ((y - ty) << 9) |
+                                          ((end - x - 1) << 18) |
+                                          (c->second << 24));
+                        batches.back().count++;
+                        x = end;
+                    }
+                }
+
+                if (!batches.back().count)  batches.pop_back();
+            }
+        }
+
+        const size_t count = records.size() - first;
+        if (count > quads*3/4)
+        {
+            records.resize(first);
+            palette.resize(palette_size);
+            break;
+        }
+        quads = count;
+        lods.push_back(batches);
+    }
+
+    glGenBuffers(1, &lod_buf);
+    glBindBuffer(GL_ARRAY_BUFFER, lod_buf);
+    glBufferData(GL_ARRAY_BUFFER, records.size()*sizeof(records[0]),
+                 records.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &lod_palette_buf);
+    glBindBuffer(GL_TEXTURE_BUFFER, lod_palette_buf);
+    glBufferData(GL_TEXTURE_BUFFER, palette.size(), palette.data(),
+                 GL_STATIC_DRAW);
+    glGenTextures(1, &lod_palette_tex);
+    glBindTexture(GL_TEXTURE_BUFFER, lod_palette_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA8, lod_palette_buf);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+void Ship::MakeReduction()
+{
+    // Make a chain of textures, halving in size down to 1x1
+    size_t w = texture_width;
+    size_t h = texture_height;
+    while (w > 1 || h > 1)
+    {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+
+        GLuint tex;
+        glGenTextures(1, &tex);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h,
+                     0, GL_RGBA, GL_FLOAT, NULL);
+        SetTextureDefaults();
+        sum_tex.push_back(tex);
+
+        GLuint fbo;
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, tex, 0);
+        sum_fbo.push_back(fbo);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenVertexArrays(1, &quad_vao);
+
+    // Make the ring of buffers that sums are read back into
+    glGenBuffers(POSITION_READBACKS, position_pbo);
+    for (auto pbo : position_pbo)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 4*sizeof(GLfloat), NULL,
+                     GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 }
 
 void Ship::SetTextureDefaults() const
@@ -4,13 +4,46 @@
 #include <GLFW/glfw3.h>
 
 #include <string>
+#include <vector>
 
 #include "constants.h"
 
+class Solver;
+class Nodes;
+class Profiler;
+class Checkpoint;
+struct Image;
+
 class Ship
 {
 public:
-    Ship(const std::string& imagename);
+    // GPU runs the simulation in GLSL shaders; CPU runs it with a
+    // multithreaded SIMD solver and uploads the state for drawing.
+    enum Backend {GPU, CPU};
+
+    // Storage format of the GPU backend's derivative textures: FULL is
+    // RGBA32F, and HALF is RGBA16F, which halves the derivatives' share of
+    // each substep's texture traffic (see GetSubstepBytes), at some cost
+    // in accuracy.  The state textures stay RGBA32F either way.  Half-precision derivatives are clamped to +/-65504, so
+    // accelerations saturate once a spring is stretched by more than about
+    // 6.5 node widths (at the default stiffness).
+    enum Precision {FULL, HALF};
+
+    // If graphics is false, no OpenGL calls are made (so no context is
+    // needed) and the ship cannot be drawn; it can only be updated with
+    // the CPU backend.
+    Ship(const std::string& imagename, const Backend backend=GPU,
+         const bool graphics=true);
+
+    // Builds a ship from an image that's already been decoded, taking
+    // ownership of its buffers.
+    Ship(const Image& image, const Backend backend=GPU,
+         const bool graphics=true);
+
+    // Rebuilds a ship from a checkpoint, resuming from its saved state
+    // and engine flags.  The checkpoint can be destroyed afterwards.
+    Ship(const Checkpoint& checkpoint, const Backend backend=GPU,
+         const bool graphics=true);
     ~Ship();
 
     bool thrustEnginesOn;
@@ -21,17 +54,128 @@ public:
     void Draw(const int window_width, const int window_height,
               const bool track, const float scale) const;
 
+    // Returns the centroid and mean velocity of the ship.  On the GPU
+    // backend these are read back asynchronously, so they usually lag a
+    // frame or two behind the last Update (rather than stalling it).
+    void GetPosition(float centroid[2], float velocity[2]) const;
+
+    // Blocks until GetPosition reflects the last Update.
+    void WaitForPosition();
+
+    // Selects the CPU solver's fused RK4 kernel (one job per substep)
+    // instead of the multipass one.  Only valid for the CPU backend.
+    void SetFused(const bool fused);
+
+    // Selects the CPU solver's implicit integrator, which stays stable
+    // with one step per frame.  Only valid for the CPU backend.
+    void SetImplicit(const bool implicit);
+
+    // Scales the spring and damper constants.  Only valid for the CPU
+    // backend (the shaders use the defaults from constants.h).
+    void SetStiffness(const float scale);
+
+    // Selects the format of the derivative textures (see Precision).  Only
+    // valid for the GPU backend.
+    void SetPrecision(const Precision precision);
+
+    // Turns on adaptive stepping (see Solver::SetTolerance), or turns it
+    // off if tolerance is zero.  Only valid for the CPU backend.
+    void SetTolerance(const float tolerance);
+
+    // Lets still regions of the ship sleep (see Solver::SetSleeping), or
+    // wakes them all if threshold is zero.  Only valid for the CPU backend.
+    void SetSleeping(const float threshold);
+
+    // Returns the bytes of state and derivative texels that one GPU RK4
+    // substep reads and writes with derivatives of the given precision,
+    // counting each pass's own texel once per texture (and neighbors'
+    // texels as cache hits), and the bytes of the state and derivative
+    // textures themselves.  Only the derivatives are stored at half
+    // precision, so HALF saves about a quarter of the traffic and a third
+    // of the memory, not half.  Only valid for the GPU backend.
+    size_t GetSubstepBytes(const Precision p) const;
+    size_t GetTextureBytes(const Precision p) const;
+
+    // Returns the fraction of nodes simulated by the last Update (the
+    // rest moved rigidly with sleeping regions)
+    float GetAwakeFraction() const;
+
+    // Returns the number of substeps taken by the last Update, and
+    // optionally the number of adaptive steps that were rejected.
+    int GetSteps(int* rejected=NULL) const;
+
+    // Times each stage of Update and Draw with the given profiler (or
+    // stops timing them, if it's NULL).  With the CPU backend, only the
+    // multipass RK4 integrator's stages are timed separately.
+    void SetProfiler(Profiler* p);
+
+    // Saves the ship's image, nodes, state and engine flags as a checkpoint
+    // (see Checkpoint), labelled with the given frame number.  The state
+    // is fetched with a single readback (or copy, on the CPU backend).
+    // Returns false if the checkpoint can't be written.
+    bool SaveCheckpoint(const std::string& filename, const uint64_t frame=0);
+
+    // Copies the ship's state (RGBA32F position and velocity per node, in
+    // state_tex's layout, with empty nodes zeroed) into rgba, which must
+    // hold (width+1)*(height+1)*4 floats.  On the GPU backend this is a
+    // synchronous readback.
+    void GetState(float* rgba) const;
+
+    // Asynchronous state readbacks, so that the GPU backend's state can be
+    // streamed without stalling.  StartStateReadback copies the state into
+    // the next buffer of a ring of pixel-buffer objects, labelled with a
+    // frame number; it returns false (starting nothing) if every buffer is
+    // still pending or mapped.  MapState maps the oldest readback that
+    // isn't mapped yet, returning its texels (RGBA32F, in the textures'
+    // layout; see GetTexelIndex) and frame, or NULL if there isn't one or
+    // (unless wait is true) the GPU hasn't finished it.  Its texels stay
+    // valid until the matching ReleaseState, which unmaps the oldest
+    // mapped readback.  Only valid for the GPU backend.
+    bool StartStateReadback(const uint64_t frame);
+    const float* MapState(const bool wait, uint64_t* frame);
+    void ReleaseState();
+
+    // Returns the texel (x + y*texture width) holding each live node, in
+    // Nodes order, for reading the texels returned by MapState.
+    std::vector<uint32_t> GetTexelIndex() const;
+
+    // The ship's compacted list of live nodes
+    const Nodes& GetNodes() const { return *nodes; }
+
+    // Returns a hash of the solver's state (see Solver::GetChecksum).
+    // Only valid for the CPU backend.
+    uint64_t GetChecksum() const;
+
+    // Size of the ship's image, and its number of live nodes
+    size_t GetWidth() const { return width; }
+    size_t GetHeight() const { return height; }
+    size_t GetNodeCount() const;
+
 private:
+    // Fleet loads ships for their image and nodes, then simulates
+    // them in its own shared textures.
+    friend class Fleet;
+
+    // Simulation steps the solver on its own thread, and uploads its
+    // snapshots into state_tex for drawing.
+    friend class Simulation;
+
     enum NodeType {EMPTY=0, SHIP=1,
                    THRUST=SHIP_ENGINE_THRUST,
                    LEFT  =SHIP_ENGINE_LEFT,
                    RIGHT =SHIP_ENGINE_RIGHT};
 
     void MakeBuffers();
-    void LoadImage(const std::string& imagename);
+    void MakeNodes();
+    void MakeLayout();
     void MakeTextures();
     void MakeFramebuffer();
     void MakeVertexArray();
+    void MakeMeshes();
+    void MakeReduction();
+
+    // Builds the node list, OpenGL objects and solver from data and filled
+    void Build();
 
     // Set reasonable OpenGL defaults for a texture.
     void SetTextureDefaults() const;
@@ -47,19 +191,56 @@ private:
     // Uses RK4 to get the new state, then flips tick.
     void GetNextState(const float dt);
 
-    // Extract centroid and velocity from state_tex[tick]
+    // Sums the positions and velocities in state_tex[tick] on the GPU,
+    // then starts an asynchronous readback of the sums (into the next
+    // buffer of position_pbo).
     void FindPosition();
 
-    // Helper function draw a flat quad to a FBO.
-    void RenderToFBO(const GLuint program, const GLuint tex);
+    // Copies any finished readbacks into centroid and velocity.  If wait
+    // is true, blocks until every pending readback is finished.
+    void ReadPosition(const bool wait);
+
+    // Helper function to run the current program over every live node
+    // (or, if halos is true, every halo texel), writing to the given
+    // framebuffer.
+    void RenderToFBO(const GLuint fbo, const bool halos=false);
+
+    // Binds the state and derivative textures to their texture units.
+    void BindTextures() const;
+
+    // Uploads an RGBA state (as from Solver::GetState) into state_tex[i].
+    void Upload(const float* state, const int i);
+
+    // Reads a state or derivative texture into rgba, in the grid's layout
+    // (which must hold (width+1)*(height+1)*4 floats).
+    void ReadTexture(const GLuint tex, float* rgba) const;
+
+    // Returns the texel holding the node at grid index i
+    void GetTexel(const size_t i, size_t* tx, size_t* ty) const;
+
+    // Finds the grid index of the node held by a texel (whether as a
+    // block's own node or in its halo), returning false if the texel
+    // doesn't hold one.
+    bool GetNode(const size_t tx, const size_t ty, size_t* i) const;
+
+    // Copies an RGBA state from the grid's layout into the textures'
+    // layout (filling in halos), or back again.
+    void ToTextureLayout(const float* grid, float* texels) const;
+    void FromTextureLayout(const float* texels, float* grid) const;
 
     // Debug: print out texture values.
     void PrintTextureValues();
 
+    const Backend backend;
+    const bool graphics;
+    Solver* solver;
+    Profiler* profiler;
+
     size_t width;
     size_t height;
     uint8_t* data;
     GLubyte* filled;
+    Nodes* nodes;   // compacted list of filled nodes
 
     float centroid[2];
     float velocity[2];
@@ -67,24 +248,107 @@ private:
     // Number of filled pixels
     size_t pixel_count;
 
+    // Filled pixels are drawn as instanced quads, from one 4-byte record
+    // each (see ship.vert).  Records only have room for 12-bit coordinates
+    // and 8-bit palette indices, so they're split into batches, each with
+    // its own PIXEL_TILE square of the grid and its own palette slice.
+    enum {PIXEL_TILE=4096, PIXEL_PALETTE=256};
+    struct PixelBatch
+    {
+        size_t first;       // index of the batch's first record
+        size_t count;
+        GLint origin[2];    // grid coordinate of its tile's corner
+        GLint palette;      // index of its first palette entry
+    };
+    std::vector<PixelBatch> pixel_batches;
+
+    // Level-of-detail meshes, which Draw switches to when the ship is
+    // zoomed out far enough that its pixels are smaller than the screen's.
+    // lods[k] draws same-colored runs of up to 2^(k+1) pixels along each
+    // row as single quads (see MakeMeshes).  Quads are drawn like pixels,
+    // from 4-byte records that also hold their run lengths, which leaves
+    // room for 9-bit coordinates, so their batches cover LOD_TILE squares.
+    enum {LOD_MAX_RUN=64, LOD_TILE=512};
+    std::vector<std::vector<PixelBatch>> lods;
+    GLuint lod_buf;         // packed record of each quad, level by level
+    GLuint lod_palette_buf; // RGBA colors, indexed by the quad records
+    GLuint lod_palette_tex; // buffer texture over lod_palette_buf
+
     // Buffers
-    GLuint vertex_buf;
-    GLuint color_buf;
-    GLuint rect_buf;
+    GLuint pixel_buf;   // packed record of each filled pixel
+    GLuint palette_buf; // RGBA colors, indexed by the pixel records
+    GLuint node_buf;    // points at the texel of each live node
+    GLuint link_buf;    // type and neighbor bitmask of each live node
+    GLuint halo_buf;    // points at each halo texel, and the texel it copies
+    size_t halo_count;
 
-    // Textures
-    GLuint filled_tex;  // boolean storing occupancy
+    // Layout of the state and derivative textures (chosen by MakeLayout).
+    // Node (x, y) is normally stored at texel (x, y), but grids larger than
+    // the GPU's textures or viewports are split into Nodes::BLOCK_SIZE
+    // blocks, which are laid out in rows of atlas_columns.  Each block has
+    // a one-texel halo copying the edges of its neighbors, so every pass
+    // can read a node's neighbors from its own block.
+    size_t block_size;      // nodes per block side, or 0 if not split
+    size_t blocks_x;        // blocks across the grid
+    size_t blocks_y;        // blocks down the grid
+    size_t atlas_columns;   // blocks across the textures
+    size_t texture_width;
+    size_t texture_height;
+
+    // Upload's buffer for converting states to a split layout
+    std::vector<GLfloat> staging;
 
+    // Textures
+    GLuint palette_tex; // buffer texture over palette_buf
     GLuint state_tex[2];   // position & velocity of each pixel
     GLuint derivative_tex[4]; // derivatives of position and velocity (for RK4)
+    Precision precision;    // format of derivative_tex
 
     bool tick;
 
-    // Frame-buffer object
-    GLuint fbo;
+    // Draw blends positions from state_tex[!tick] towards state_tex[tick]
+    // by this much (so at 1, only the current state is drawn)
+    float blend;
+
+    // Number of substeps taken by the last GPU Update
+    int steps_taken;
+
+    // Frame-buffer objects, one per target texture
+    GLuint state_fbo[2];
+    GLuint derivative_fbo[4];
+
+    // Vertex array objects for simulation passes (over nodes and over
+    // halo texels) and for drawing, plus an empty one for full-screen
+    // passes (which use quad.vert).
+    GLuint node_vao;
+    GLuint halo_vao;
+    GLuint draw_vao;
+    GLuint quad_vao;
+
+    // Reduction chain used by FindPosition: each texture holds the sums
+    // of 2x2 blocks of the one before (starting from state_tex), down to
+    // a single texel.
+    std::vector<GLuint> sum_tex;
+    std::vector<GLuint> sum_fbo;
+
+    // Ring of pixel-buffer objects that the final sums are read into,
+    // with a fence for each readback that hasn't yet been consumed.
+    enum {POSITION_READBACKS=3};
+    GLuint position_pbo[POSITION_READBACKS];
+    GLsync position_fence[POSITION_READBACKS];
+    size_t position_next;       // index of the next buffer to read into
+    size_t position_pending;    // number of readbacks in flight
 
-    // Vertex array object
-    GLuint vao;
+    // Ring of pixel-buffer objects that states are read back into (made
+    // by the first StartStateReadback), holding from oldest to newest the
+    // readbacks that are mapped and those that are still in flight
+    enum {STATE_READBACKS=3};
+    GLuint state_pbo[STATE_READBACKS];
+    GLsync state_fence[STATE_READBACKS];
+    uint64_t state_frame[STATE_READBACKS];
+    size_t state_next;      // index of the next buffer to read into
+    size_t state_pending;   // number of readbacks in flight
+    size_t state_mapped;    // number of readbacks mapped
 };
 
 #endif
@@ -1,10 +1,22 @@
 #version 330
 
-layout(location=0) in vec2 vertex_position;
-layout(location=1) in vec3 color_in;
+// One instance per filled pixel, drawn as a 4-vertex triangle strip.  Each
+// pixel is a packed record (see Ship::MakeBuffers): its grid coordinate
+// relative to its batch's origin in the low 12 + 12 bits, and the index of
+// its color in the batch's slice of the palette in the high 8 bits.
+#ifdef MESH
+// Quads of level-of-detail meshes (see Ship::MakeMeshes) cover a run of
+// pixels along a row, so their records have 9 + 9 bits of coordinate,
+// then 6 bits of run length (minus one), then the palette index.
+#endif
+layout(location=0) in uint pixel;
 
 flat out vec4 color_out;
 
+uniform samplerBuffer palette;
+uniform ivec2 origin;
+uniform int palette_base;
+
 uniform ivec2  window_size;
 uniform ivec2  ship_size;
 
@@ -13,13 +25,48 @@ uniform float scale;
 
 uniform sampler2D pos;
 
+// Positions are blended from prev towards pos by alpha, when it's below 1
+// (used to draw between the last two steps of a simulation thread)
+uniform sampler2D prev;
+uniform float alpha;
+
+// Layout of split state textures (see Ship::MakeLayout): nodes per block
+// side (or 0 if the texture isn't split), number of blocks across the
+// grid, and number of blocks across the atlas
+uniform int block;
+uniform int blocks_x;
+uniform int atlas_columns;
+
+// Returns the texel holding a node's state
+ivec2 Texel(ivec2 node)
+{
+    if (block == 0)     return node;
+
+    ivec2 b = node / block;
+    int n = b.x + b.y * blocks_x;
+    return node - b * block + 1 +
+           ivec2(n % atlas_columns, n / atlas_columns) * (block + 2);
+}
+
 void main()
 {
-    color_out = vec4(color_in, 1.0f);
+    color_out = texelFetch(palette, palette_base + int(pixel >> 24u));
 
-    vec2 xy = texture(pos, vec2(
-        (vertex_position.x + 1.0f) / float(ship_size.x + 2),
-        (vertex_position.y + 1.0f) / float(ship_size.y + 2))).xy;
+    // Each corner of the pixel's quad is positioned by its node
+#ifdef MESH
+    int run = int((pixel >> 18u) & 0x3fu) + 1;
+    ivec2 node = origin + ivec2(pixel & 0x1ffu, (pixel >> 9u) & 0x1ffu) +
+                 ivec2((gl_VertexID & 1) * run, gl_VertexID >> 1);
+#else
+    ivec2 node = origin + ivec2(pixel & 0xfffu, (pixel >> 12u) & 0xfffu) +
+                 ivec2(gl_VertexID & 1, gl_VertexID >> 1);
+#endif
+    ivec2 texel = Texel(node);
+    vec2 xy = texelFetch(pos, texel, 0).xy;
+    if (alpha < 1.0f)
+    {
+        xy = mix(texelFetch(prev, texel, 0).xy, xy, alpha);
+    }
 
     vec2 centered = xy - offset;
 
@@ -0,0 +1,158 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Minimal wrapper around the widest float vector available at compile time.
+// Kernels are written once against vfloat / vmask and get 8 lanes with AVX2,
+// 4 lanes with SSE2, or a plain scalar fallback on other architectures.
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+struct vmask
+{
+    vmask(__m256 m) : m(m) {}
+    vmask operator&(const vmask& o) const { return _mm256_and_ps(m, o.m); }
+    vmask operator|(const vmask& o) const { return _mm256_or_ps(m, o.m); }
+    bool any() const { return _mm256_movemask_ps(m) != 0; }
+    __m256 m;
+};
+
+struct vfloat
+{
+    static const int width = 8;
+
+    vfloat() {}
+    vfloat(__m256 v) : v(v) {}
+    vfloat(float f) : v(_mm256_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    vfloat operator+(const vfloat& o) const { return _mm256_add_ps(v, o.v); }
+    vfloat operator-(const vfloat& o) const { return _mm256_sub_ps(v, o.v); }
+    vfloat operator*(const vfloat& o) const { return _mm256_mul_ps(v, o.v); }
+    vfloat operator/(const vfloat& o) const { return _mm256_div_ps(v, o.v); }
+    vfloat& operator+=(const vfloat& o) { v = _mm256_add_ps(v, o.v); return *this; }
+
+    vmask operator==(const vfloat& o) const
+    { return _mm256_cmp_ps(v, o.v, _CMP_EQ_OQ); }
+    vmask operator!=(const vfloat& o) const
+    { return _mm256_cmp_ps(v, o.v, _CMP_NEQ_UQ); }
+    vmask operator>(const vfloat& o) const
+    { return _mm256_cmp_ps(v, o.v, _CMP_GT_OQ); }
+
+    __m256 v;
+};
+
+inline vfloat sqrt(const vfloat& a) { return _mm256_sqrt_ps(a.v); }
+
+// Returns {base[idx[0]], base[idx[1]], ...}
+inline vfloat gather(const float* base, const int32_t* idx)
+{
+    return _mm256_i32gather_ps(
+            base, _mm256_loadu_si256((const __m256i*)idx), 4);
+}
+
+// Returns a where m is set, otherwise b
+inline vfloat select(const vmask& m, const vfloat& a, const vfloat& b)
+{ return _mm256_blendv_ps(b.v, a.v, m.m); }
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+struct vmask
+{
+    vmask(__m128 m) : m(m) {}
+    vmask operator&(const vmask& o) const { return _mm_and_ps(m, o.m); }
+    vmask operator|(const vmask& o) const { return _mm_or_ps(m, o.m); }
+    bool any() const { return _mm_movemask_ps(m) != 0; }
+    __m128 m;
+};
+
+struct vfloat
+{
+    static const int width = 4;
+
+    vfloat() {}
+    vfloat(__m128 v) : v(v) {}
+    vfloat(float f) : v(_mm_set1_ps(f)) {}
+
+    static vfloat load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    vfloat operator+(const vfloat& o) const { return _mm_add_ps(v, o.v); }
+    vfloat operator-(const vfloat& o) const { return _mm_sub_ps(v, o.v); }
+    vfloat operator*(const vfloat& o) const { return _mm_mul_ps(v, o.v); }
+    vfloat operator/(const vfloat& o) const { return _mm_div_ps(v, o.v); }
+    vfloat& operator+=(const vfloat& o) { v = _mm_add_ps(v, o.v); return *this; }
+
+    vmask operator==(const vfloat& o) const { return _mm_cmpeq_ps(v, o.v); }
+    vmask operator!=(const vfloat& o) const { return _mm_cmpneq_ps(v, o.v); }
+    vmask operator>(const vfloat& o) const { return _mm_cmpgt_ps(v, o.v); }
+
+    __m128 v;
+};
+
+inline vfloat sqrt(const vfloat& a) { return _mm_sqrt_ps(a.v); }
+
+// Returns {base[idx[0]], base[idx[1]], ...}
+inline vfloat gather(const float* base, const int32_t* idx)
+{
+    return _mm_setr_ps(base[idx[0]], base[idx[1]],
+                       base[idx[2]], base[idx[3]]);
+}
+
+// Returns a where m is set, otherwise b
+inline vfloat select(const vmask& m, const vfloat& a, const vfloat& b)
+{ return _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)); }
+
+#else
+
+struct vmask
+{
+    vmask(bool m) : m(m) {}
+    vmask operator&(const vmask& o) const { return m && o.m; }
+    vmask operator|(const vmask& o) const { return m || o.m; }
+    bool any() const { return m; }
+    bool m;
+};
+
+struct vfloat
+{
+    static const int width = 1;
+
+    vfloat() {}
+    vfloat(float f) : v(f) {}
+
+    static vfloat load(const float* p) { return *p; }
+    void store(float* p) const { *p = v; }
+
+    vfloat operator+(const vfloat& o) const { return v + o.v; }
+    vfloat operator-(const vfloat& o) const { return v - o.v; }
+    vfloat operator*(const vfloat& o) const { return v * o.v; }
+    vfloat operator/(const vfloat& o) const { return v / o.v; }
+    vfloat& operator+=(const vfloat& o) { v += o.v; return *this; }
+
+    vmask operator==(const vfloat& o) const { return v == o.v; }
+    vmask operator!=(const vfloat& o) const { return v != o.v; }
+    vmask operator>(const vfloat& o) const { return v > o.v; }
+
+    float v;
+};
+
+inline vfloat sqrt(const vfloat& a) { return std::sqrt(a.v); }
+
+// Returns base[idx[0]]
+inline vfloat gather(const float* base, const int32_t* idx)
+{ return base[idx[0]]; }
+
+// Returns a where m is set, otherwise b
+inline vfloat select(const vmask& m, const vfloat& a, const vfloat& b)
+{ return m.m ? a : b; }
+
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <iostream>
+
+#define GLFW_INCLUDE_GLCOREARB
+#include <GLFW/glfw3.h>
+
+#include "simulation.h"
+#include "ship.h"
+#include "solver.h"
+#include "journal.h"
+#include "trajectory.h"
+#include "constants.h"
+#include "trace.h"
+
+// If the simulation thread falls more than this many steps behind the wall
+// clock, it skips ahead instead of trying to catch up
+static const int MAX_LAG = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+
+Simulation::Simulation(Ship* ship, const float dt, const int steps,
+                       JournalWriter* journal, TrajectoryWriter* trajectory)
+    : ship(ship), dt(dt), steps(steps), journal(journal),
+      trajectory(trajectory), engines(0),
+      ready(0), back(1), front(2), step(0), skipped(0), stopping(false)
+{
+    if (!ship->solver)
+    {
+        std::cerr << "[pixelsim]    Error: A simulation thread needs the "
+                  << "CPU backend" << std::endl;
+        exit(-1);
+    }
+
+    const size_t size = (ship->width + 1)*(ship->height + 1)*4;
+    for (auto& s : snapshots)
+    {
+        s.state.resize(size);
+        s.previous.resize(size);
+        s.engines = 0;
+        s.step = 0;
+    }
+
+    // Draw uses the ship's own centroid until the first snapshot arrives
+    ship->solver->FindPosition(ship->centroid, ship->velocity);
+
+    engines = (ship->thrustEnginesOn ? FLEET_THRUST_BIT : 0) |
+              (ship->leftEnginesOn   ? FLEET_LEFT_BIT   : 0) |
+              (ship->rightEnginesOn  ? FLEET_RIGHT_BIT  : 0);
+    input.Push(engines);
+
+    thread = std::thread(&Simulation::Run, this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Simulation::~Simulation()
+{
+    Stop();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Simulation::Stop()
+{
+    if (!thread.joinable())     return;
+
+    stopping = true;
+    thread.join();
+
+    if (skipped)
+    {
+        std::cerr << "[pixelsim]    Simulation thread fell behind; skipped "
+                  << skipped << " steps" << std::endl;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Simulation::SetEngines(const bool thrust, const bool left,
+                            const bool right)
+{
+    const uint8_t mask = (thrust ? FLEET_THRUST_BIT : 0) |
+                         (left   ? FLEET_LEFT_BIT   : 0) |
+                         (right  ? FLEET_RIGHT_BIT  : 0);
+
+    // If the queue is full, engines is left alone, so the next call
+    // tries again
+    if (mask != engines && input.Push(mask))    engines = mask;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Simulation::Run()
+{
+    Trace::NameThread("simulation");
+
+    Solver* const solver = ship->solver;
+    const Clock::duration period =
+        std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<float>(dt));
+
+    // State and centroid after the last step
+    std::vector<float> last(snapshots[0].state.size());
+    solver->GetState(&last[0]);
+    float last_centroid[2];
+    float unused[2];
+    solver->FindPosition(last_centroid, unused);
+
+    uint8_t mask = 0;
+    Clock::time_point next = Clock::now();
+
+    while (!stopping)
+    {
+        // Only the latest engine flags matter
+        uint8_t m;
+        while (input.Pop(&m))   mask = m;
+        if (journal)    journal->Record(step, mask);
+
+        {
+            TRACE_SCOPE("Simulation::Step");
+            const int firing = FiringEngines(mask & FLEET_THRUST_BIT,
+                                             mask & FLEET_LEFT_BIT,
+                                             mask & FLEET_RIGHT_BIT);
+            solver->Update(dt, steps, firing & FLEET_THRUST_BIT,
+                           firing & FLEET_LEFT_BIT, firing & FLEET_RIGHT_BIT);
+        }
+        step++;
+        next += period;
+
+        {
+            TRACE_SCOPE("Simulation::Publish");
+
+            Snapshot& s = snapshots[back];
+            s.previous.swap(last);
+            solver->GetState(&s.state[0]);
+            last = s.state;
+            if (trajectory)     trajectory->Add(step, &s.state[0]);
+
+            s.previous_centroid[0] = last_centroid[0];
+            s.previous_centroid[1] = last_centroid[1];
+            solver->FindPosition(s.centroid, s.velocity);
+            last_centroid[0] = s.centroid[0];
+            last_centroid[1] = s.centroid[1];
+
+            s.engines = mask;
+            s.step = step;
+            s.due = next;
+
+            back = ready.exchange(back | FRESH) & ~FRESH;
+        }
+
+        const Clock::time_point now = Clock::now();
+        if (now > next + MAX_LAG*period)
+        {
+            skipped += (now - next) / period;
+            next = now;
+        }
+        else
+        {
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Simulation::Draw(const int window_width, const int window_height,
+                      const bool track, const float scale)
+{
+    if (ready.load(std::memory_order_relaxed) & FRESH)
+    {
+        front = ready.exchange(front) & ~FRESH;
+
+        const Snapshot& s = snapshots[front];
+        ship->Upload(&s.previous[0], !ship->tick);
+        ship->Upload(&s.state[0], ship->tick);
+
+        ship->thrustEnginesOn = s.engines & FLEET_THRUST_BIT;
+        ship->leftEnginesOn = s.engines & FLEET_LEFT_BIT;
+        ship->rightEnginesOn = s.engines & FLEET_RIGHT_BIT;
+    }
+
+    // Blend by how far through the step the wall clock is (so drawing lags
+    // the simulation by up to one step)
+    const Snapshot& s = snapshots[front];
+    if (s.step)
+    {
+        const std::chrono::duration<float> remaining = s.due - Clock::now();
+        const float alpha = std::min(1.0f,
+                std::max(0.0f, 1.0f - remaining.count() / dt));
+
+        ship->blend = alpha;
+        for (int i=0; i < 2; ++i)
+        {
+            ship->centroid[i] = s.previous_centroid[i] +
+                alpha * (s.centroid[i] - s.previous_centroid[i]);
+        }
+    }
+
+    ship->Draw(window_width, window_height, track, scale);
+    ship->blend = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Simulation::GetPosition(float centroid[2], float velocity[2]) const
+{
+    const Snapshot& s = snapshots[front];
+    if (!s.step)
+    {
+        ship->GetPosition(centroid, velocity);
+        return;
+    }
+
+    for (int i=0; i < 2; ++i)
+    {
+        centroid[i] = s.centroid[i];
+        velocity[i] = s.velocity[i];
+    }
+}
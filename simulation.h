@@ -0,0 +1,108 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "spsc.h"
+
+class Ship;
+class JournalWriter;
+class TrajectoryWriter;
+
+// Runs a ship's CPU solver on its own thread, at a fixed rate that doesn't
+// depend on how quickly frames are drawn and presented.
+//
+// After each step, the thread publishes a snapshot of the new state (and
+// the state before it) through a triple buffer, so neither side ever waits
+// for the other.  Draw uploads the newest snapshot and blends between its
+// two states, based on how far the wall clock has got through the step.
+// Engine flags are passed to the thread through a lock-free queue, and
+// take effect from its next step.
+class Simulation
+{
+public:
+    // Starts stepping the ship by dt (with the given number of substeps)
+    // every dt seconds.  The ship must use the CPU backend, and while this
+    // object exists, the ship should only be used through it.  If journal
+    // isn't NULL, the simulation thread records each step's engine flags
+    // in it (numbering frames by step).  Likewise, if trajectory isn't
+    // NULL, each step's state is added to it.
+    Simulation(Ship* ship, const float dt, const int steps,
+               JournalWriter* journal=NULL,
+               TrajectoryWriter* trajectory=NULL);
+
+    // Stops the simulation thread (if Stop hasn't already)
+    ~Simulation();
+
+    // Stops the simulation thread, leaving the ship's solver in the state
+    // after its last step
+    void Stop();
+
+    // Returns the number of steps taken.  Only valid after Stop.
+    size_t GetSteps() const { return step; }
+
+    // Queues new engine flags for the simulation thread.  This should only
+    // be called from one thread (the one that calls Draw).
+    void SetEngines(const bool thrust, const bool left, const bool right);
+
+    // Uploads the newest snapshot (if it hasn't been already), then draws
+    // the ship as it was at the current time, interpolated between steps.
+    // Needs the ship's OpenGL context.
+    void Draw(const int window_width, const int window_height,
+              const bool track, const float scale);
+
+    // Returns the centroid and mean velocity from the newest snapshot that
+    // Draw has picked up.
+    void GetPosition(float centroid[2], float velocity[2]) const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Snapshot
+    {
+        std::vector<float> state;       // as from Solver::GetState
+        std::vector<float> previous;    // state one step earlier
+        float centroid[2];
+        float velocity[2];
+        float previous_centroid[2];
+        uint8_t engines;    // bitmask of FLEET_*_BIT values used by the step
+        size_t step;        // number of steps taken to reach state
+        Clock::time_point due;  // wall-clock time at which state is current
+    };
+
+    // Simulation thread loop
+    void Run();
+
+    Ship* const ship;
+    const float dt;
+    const int steps;
+    JournalWriter* const journal;
+    TrajectoryWriter* const trajectory;
+
+    // Engine bitmasks, from SetEngines to the simulation thread
+    SpscQueue<uint8_t, 64> input;
+    uint8_t engines;    // last mask pushed (used by SetEngines only)
+
+    // Triple buffer of snapshots: the simulation thread fills
+    // snapshots[back], then swaps it with the ready index (setting FRESH);
+    // Draw swaps front with the ready index whenever FRESH is set.
+    enum {FRESH=4};
+    Snapshot snapshots[3];
+    std::atomic<int> ready;
+    int back;
+    int front;
+
+    // Steps taken, and steps dropped because the simulation thread fell too
+    // far behind the wall clock (written by the simulation thread only)
+    size_t step;
+    size_t skipped;
+
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,1446 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "solver.h"
+#include "nodes.h"
+#include "simd.h"
+#include "constants.h"
+#include "profiler.h"
+#include "trace.h"
+
+// Smallest step that adaptive stepping will shrink to (which is always
+// accepted, so that a frame can't take forever)
+static const float MIN_STEP = 1e-6f;
+
+// Default number of conjugate gradient iterations per implicit step
+static const int CG_ITERATIONS = 32;
+
+// Implicit steps stop iterating early once the residual has shrunk by
+// this factor
+static const float CG_TOLERANCE = 1e-4f;
+
+// Tiles are this many nodes on a side
+static const size_t TILE_SIZE = 16;
+
+// Tiles fall asleep after this many Updates in a row below the threshold
+static const int SLEEP_FRAMES = 30;
+
+// Fused RK4 steps square tiles of this many nodes on a side, each with a
+// halo of one node per stage, in buffers FUSED_SPAN nodes across (which is
+// a multiple of the SIMD width).  Each buffer's planes have a margin of
+// FUSED_MARGIN floats on either side, so that loading the neighbors of
+// its first and last nodes stays in bounds.
+static const size_t FUSED_TILE = 56;
+static const size_t FUSED_HALO = 4;
+static const size_t FUSED_SPAN = FUSED_TILE + 2*FUSED_HALO;
+static const size_t FUSED_MARGIN = 8;
+
+// Smallest rigid body (in nodes) that a sleeping tile can be.  Smaller ones
+// are simulated instead, since their boundary dampers would be unstable
+// with explicit steps.
+static const size_t MIN_BODY = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Adds the engine acceleration to nodes that are firing, perpendicular to
+// their orientation (a sum of (cos, sin) pairs relative to their links'
+// rest directions).
+static inline void EngineAccel(const vmask& firing,
+                               const vfloat& angle_x, const vfloat& angle_y,
+                               vfloat& ax, vfloat& ay)
+{
+    const vfloat norm = sqrt(angle_x*angle_x + angle_y*angle_y);
+    const vmask valid = norm > vfloat(0);
+    const vfloat a(SHIP_ENGINE_ACCEL);
+    ax += select(firing, select(valid,
+                 vfloat(0) - angle_y / norm * a, vfloat(0)),
+                 vfloat(0));
+    ay += select(firing, select(valid,
+                 angle_x / norm * a, a),
+                 vfloat(0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Solver::Solver(const size_t width, const size_t height, const Nodes& nodes,
+               const size_t threads)
+    : width(width), height(height), count(nodes.size()),
+      index(nodes.index), tick(false), integrator(RK4),
+      iterations(CG_ITERATIONS),
+      spring_k(SHIP_SPRING_K), spring_c(SHIP_SPRING_C),
+      tolerance(0), step_size(0), last_error(0),
+      steps_taken(0), steps_rejected(0),
+      thrustEnginesOn(false), leftEnginesOn(false), rightEnginesOn(false),
+      sleep_threshold(0), tiles_x(width / TILE_SIZE + 1),
+      tiles_y(height / TILE_SIZE + 1),
+      profiler(NULL), pool(threads), barrier(pool.size())
+{
+    // Pad the node list out to a whole number of 8-wide vectors.
+    plane = ((count + 7) / 8) * 8;
+
+    types.resize(plane, 0);
+    for (auto& n : neighbors)   n.resize(plane, 0);
+    for (auto& k : linked)      k.resize(plane, 0);
+
+    for (size_t i=0; i < count; ++i)
+    {
+        types[i] = nodes.types[i];
+        for (int d=0; d < 8; ++d)
+        {
+            if (nodes.links[i] & (1 << d))
+            {
+                neighbors[d][i] = nodes.neighbors[i*8 + d];
+                linked[d][i] = 1;
+            }
+        }
+    }
+
+    // Find vectors of nodes whose neighbors in a given direction are also
+    // consecutive in memory (true for most of a row in dense ships), so that
+    // the derivative kernel can use plain loads instead of gathers.  Lanes
+    // without a neighbor are masked out, so they can point anywhere.
+    const size_t w = vfloat::width;
+    for (int d=0; d < 8; ++d)
+    {
+        contiguous[d].resize(plane / w, 0);
+        for (size_t b=0; b < plane / w; ++b)
+        {
+            int32_t base = 0;
+            bool found = false;
+            bool ok = true;
+            for (size_t k=0; k < w; ++k)
+            {
+                if (!linked[d][b*w + k])
+                {
+                    continue;
+                }
+                else if (!found)
+                {
+                    base = neighbors[d][b*w + k] - int32_t(k);
+                    found = true;
+                }
+                ok &= neighbors[d][b*w + k] == base + int32_t(k);
+            }
+            ok &= base >= 0 && base + w <= plane;
+
+            if (ok)
+            {
+                contiguous[d][b] = 1;
+                for (size_t k=0; k < w; ++k)
+                {
+                    neighbors[d][b*w + k] = base + k;
+                }
+            }
+        }
+    }
+
+    // Initialize every node at its rest position with zero velocity.
+    std::vector<float> pos(plane * 4, 0);
+    for (size_t i=0; i < count; ++i)
+    {
+        Plane(pos, 0)[i] = index[i] % (width+1);
+        Plane(pos, 1)[i] = index[i] / (width+1);
+    }
+
+    for (auto& s : state)       s = pos;
+    for (auto& d : derivative)  d.resize(plane * 4, 0);
+    for (auto& j : jacobian)    j.resize(plane * 3, 0);
+
+    // Assign nodes to tiles, noting which engines each tile holds
+    Tile t;
+    memset(&t, 0, sizeof(t));
+    tiles.resize(tiles_x * tiles_y, t);
+    node_tile.resize(count);
+    for (size_t i=0; i < count; ++i)
+    {
+        const size_t x = index[i] % (width+1);
+        const size_t y = index[i] / (width+1);
+        node_tile[i] = x / TILE_SIZE + (y / TILE_SIZE) * tiles_x;
+
+        uint8_t& engines = tiles[node_tile[i]].engines;
+        if (types[i] == SHIP_ENGINE_THRUST)     engines |= FLEET_THRUST_BIT;
+        else if (types[i] == SHIP_ENGINE_LEFT)  engines |= FLEET_LEFT_BIT;
+        else if (types[i] == SHIP_ENGINE_RIGHT) engines |= FLEET_RIGHT_BIT;
+    }
+    offset.resize(plane * 2, 0);
+    block_awake.resize(plane / 8, 0);
+    WakeTiles();
+
+    // List the live nodes in each fused tile's span
+    std::vector<int32_t> live((width+1)*(height+1), -1);
+    for (size_t i=0; i < count; ++i)    live[index[i]] = i;
+
+    for (size_t ty=0; ty <= height; ty += FUSED_TILE) {
+        for (size_t tx=0; tx <= width; tx += FUSED_TILE) {
+            // Grid position of the span's first cell
+            const int x0 = int(tx) - int(FUSED_HALO);
+            const int y0 = int(ty) - int(FUSED_HALO);
+
+            FusedTile t;
+            t.first = fused_cells.size() / 2;
+            t.rows[0] = t.columns[0] = FUSED_SPAN;
+            t.rows[1] = t.columns[1] = 0;
+
+            bool own = false;
+            for (size_t ly=0; ly < FUSED_SPAN; ++ly) {
+                for (size_t lx=0; lx < FUSED_SPAN; ++lx) {
+                    const int x = x0 + lx;
+                    const int y = y0 + ly;
+                    if (x < 0 || x > int(width) || y < 0 || y > int(height) ||
+                        live[x + y*(width+1)] < 0)
+                    {
+                        continue;
+                    }
+
+                    fused_cells.push_back(lx + ly*FUSED_SPAN);
+                    fused_cells.push_back(live[x + y*(width+1)]);
+                    t.rows[0] = std::min<uint32_t>(t.rows[0], ly);
+                    t.rows[1] = std::max<uint32_t>(t.rows[1], ly + 1);
+                    t.columns[0] = std::min<uint32_t>(t.columns[0], lx);
+                    t.columns[1] = std::max<uint32_t>(t.columns[1], lx + 1);
+                    own |= lx >= FUSED_HALO && lx < FUSED_HALO + FUSED_TILE &&
+                           ly >= FUSED_HALO && ly < FUSED_HALO + FUSED_TILE;
+                }
+            }
+            t.count = fused_cells.size() / 2 - t.first;
+
+            if (own)    fused_tiles.push_back(t);
+            else        fused_cells.resize(t.first * 2);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::SetStiffness(const float scale)
+{
+    spring_k = SHIP_SPRING_K * scale;
+    spring_c = SHIP_SPRING_C * scale;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::Update(const float dt, const int steps,
+                    const bool thrust, const bool left, const bool right)
+{
+    TRACE_SCOPE("Solver::Update");
+
+    thrustEnginesOn = thrust;
+    leftEnginesOn = left;
+    rightEnginesOn = right;
+
+    const float dt_ = dt / steps;
+    steps_taken = steps;
+    steps_rejected = 0;
+
+    // Tiles that were put to sleep under other settings are out of date,
+    // and tiles with engines that are about to fire must be awake to fire
+    if (!Sleeping() && !sleeping_blocks.empty())    WakeTiles();
+    else if (Sleeping())    WakeEngines();
+
+    if (tolerance > 0)
+    {
+        AdaptiveUpdate(dt, dt_);
+    }
+    else if (integrator == RK4_FUSED)
+    {
+        for (int i=0; i < steps; ++i)   FusedStep(dt_);
+    }
+    else if (integrator == IMPLICIT)
+    {
+        for (int i=0; i < steps; ++i)   ImplicitStep(dt_);
+    }
+    else
+    {
+        for (int i=0; i < steps; ++i)
+        {
+            // Update state and swap which buffer is active
+            Step(tick, !tick, dt_, false);
+            tick = !tick;
+
+            if (Sleeping())     AdvanceSleeping(dt_);
+        }
+        if (Sleeping())     UpdateTiles(dt);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::SetSleeping(const float threshold)
+{
+    sleep_threshold = threshold;
+    if (threshold <= 0)     WakeTiles();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+float Solver::GetAwakeFraction() const
+{
+    return count ? float(awake_nodes) / count : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::WakeTiles()
+{
+    for (auto& t : tiles)
+    {
+        t.asleep = false;
+        t.quiet = 0;
+    }
+    SortBlocks();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::WakeEngines()
+{
+    const uint8_t firing = (thrustEnginesOn ? FLEET_THRUST_BIT : 0) |
+                           (leftEnginesOn   ? FLEET_LEFT_BIT   : 0) |
+                           (rightEnginesOn  ? FLEET_RIGHT_BIT  : 0);
+
+    bool woke = false;
+    for (auto& t : tiles)
+    {
+        if (t.asleep && (t.engines & firing))
+        {
+            t.asleep = false;
+            t.quiet = 0;
+            woke = true;
+        }
+    }
+    if (woke)   SortBlocks();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::UpdateTiles(const float dt)
+{
+    TRACE_SCOPE("Solver::UpdateTiles");
+
+    const float* const px = Plane(state[tick], 0);
+    const float* const py = Plane(state[tick], 1);
+    const float* const vx = Plane(state[tick], 2);
+    const float* const vy = Plane(state[tick], 3);
+
+    // Fit a rigid motion to each tile: its centroid, mean velocity and
+    // spin (angular momentum over moment of inertia, about the centroid)
+    const size_t n = tiles.size();
+    std::vector<double> sums(n * 5, 0);    // x, y, dx, dy, count
+    for (size_t i=0; i < count; ++i)
+    {
+        double* const s = &sums[node_tile[i] * 5];
+        s[0] += px[i];
+        s[1] += py[i];
+        s[2] += vx[i];
+        s[3] += vy[i];
+        s[4] += 1;
+    }
+    std::vector<float> centroid(n * 2), velocity(n * 2), spin(n, 0);
+    for (size_t t=0; t < n; ++t)
+    {
+        const double* const s = &sums[t * 5];
+        for (int p=0; p < 2; ++p)
+        {
+            centroid[t*2 + p] = s[4] ? s[p] / s[4] : 0;
+            velocity[t*2 + p] = s[4] ? s[p + 2] / s[4] : 0;
+        }
+    }
+
+    std::vector<double> moment(n * 2, 0);  // angular momentum, inertia
+    for (size_t i=0; i < count; ++i)
+    {
+        const size_t t = node_tile[i];
+        const float rx = px[i] - centroid[t*2];
+        const float ry = py[i] - centroid[t*2 + 1];
+        moment[t*2] += rx * (vy[i] - velocity[t*2 + 1]) -
+                       ry * (vx[i] - velocity[t*2]);
+        moment[t*2 + 1] += rx*rx + ry*ry;
+    }
+    for (size_t t=0; t < n; ++t)
+    {
+        if (moment[t*2 + 1] > 0)    spin[t] = moment[t*2] / moment[t*2 + 1];
+    }
+
+    // Each tile's activity is the largest difference of any of its links
+    // from its rest length, or of any node's movement over the Update from
+    // the tile's rigid motion
+    std::vector<float> activity(n, 0);
+    for (size_t i=0; i < count; ++i)
+    {
+        const size_t t = node_tile[i];
+        float a = activity[t];
+        for (int d=0; d < 8; ++d)
+        {
+            if (!linked[d][i])  continue;
+            const size_t j = neighbors[d][i];
+            const float dx = px[j] - px[i];
+            const float dy = py[j] - py[i];
+            a = std::max(a, std::fabs(std::sqrt(dx*dx + dy*dy) -
+                                      Nodes::lengths[d]));
+        }
+
+        const float rx = px[i] - centroid[t*2];
+        const float ry = py[i] - centroid[t*2 + 1];
+        const float ex = vx[i] - (velocity[t*2] - spin[t] * ry);
+        const float ey = vy[i] - (velocity[t*2 + 1] + spin[t] * rx);
+        activity[t] = std::max(a, std::sqrt(ex*ex + ey*ey) * dt);
+    }
+
+    const uint8_t firing = (thrustEnginesOn ? FLEET_THRUST_BIT : 0) |
+                           (leftEnginesOn   ? FLEET_LEFT_BIT   : 0) |
+                           (rightEnginesOn  ? FLEET_RIGHT_BIT  : 0);
+
+    // Returns true if any tile next to tile t is awake and moving
+    auto disturbed = [&](const size_t t)
+    {
+        const int x = t % tiles_x;
+        const int y = t / tiles_x;
+        for (int j=std::max(y - 1, 0); j <= std::min<int>(y + 1, tiles_y - 1);
+             ++j)
+        {
+            for (int i=std::max(x - 1, 0);
+                 i <= std::min<int>(x + 1, tiles_x - 1); ++i)
+            {
+                const size_t u = i + j*tiles_x;
+                if (!tiles[u].asleep && activity[u] > sleep_threshold)
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    // Decide which tiles sleep, based on the activity from before any of
+    // them changed (so that the order of tiles doesn't matter)
+    std::vector<uint8_t> asleep(n);
+    for (size_t t=0; t < n; ++t)
+    {
+        Tile& tile = tiles[t];
+        const bool active = activity[t] > sleep_threshold ||
+                            (tile.engines & firing);
+        if (tile.asleep)
+        {
+            asleep[t] = !active && !disturbed(t);
+        }
+        else
+        {
+            tile.quiet = active ? 0 : tile.quiet + 1;
+            asleep[t] = tile.quiet >= SLEEP_FRAMES;
+        }
+    }
+    for (size_t t=0; t < n; ++t)
+    {
+        tiles[t].asleep = asleep[t];
+        if (!asleep[t] && tiles[t].quiet >= SLEEP_FRAMES)   tiles[t].quiet = 0;
+    }
+
+    SortBlocks();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::SortBlocks()
+{
+    const float* const px = Plane(state[tick], 0);
+    const float* const py = Plane(state[tick], 1);
+    const float* const vx = Plane(state[tick], 2);
+    const float* const vy = Plane(state[tick], 3);
+
+    // A block is only simulated if one of its nodes is in an awake tile,
+    // or in a tile with too few nodes left to make a rigid body (which
+    // can leave other tiles with too few, so repeat until nothing changes)
+    std::vector<uint8_t> rigid(tiles.size());
+    for (size_t t=0; t < tiles.size(); ++t)     rigid[t] = tiles[t].asleep;
+
+    bool changed = true;
+    while (changed)
+    {
+        for (size_t b=0; b < plane / 8; ++b)
+        {
+            bool awake = false;
+            for (size_t i=b*8; i < std::min(b*8 + 8, count); ++i)
+            {
+                awake |= !rigid[node_tile[i]];
+            }
+            block_awake[b] = awake;
+        }
+
+        std::vector<size_t> size(tiles.size(), 0);
+        for (size_t i=0; i < count; ++i)
+        {
+            if (!block_awake[i / 8])    size[node_tile[i]]++;
+        }
+
+        changed = false;
+        for (size_t t=0; t < tiles.size(); ++t)
+        {
+            if (rigid[t] && size[t] < MIN_BODY)
+            {
+                rigid[t] = 0;
+                changed = true;
+            }
+        }
+    }
+
+    awake_blocks.clear();
+    sleeping_blocks.clear();
+    for (size_t b=0; b < plane / 8; ++b)
+    {
+        (block_awake[b] ? awake_blocks : sleeping_blocks).push_back(b);
+    }
+    awake_nodes = 0;
+    for (size_t i=0; i < count; ++i)    awake_nodes += block_awake[i / 8];
+
+    // Each sleeping tile's rigid body is made of its nodes in sleeping
+    // blocks (the rest are simulated with their blocks).  Those nodes
+    // already move rigidly, unless they've just joined, so rebuilding the
+    // bodies from their current motion doesn't disturb them.
+    for (auto& t : tiles)
+    {
+        memset(t.centroid, 0, sizeof(t.centroid));
+        memset(t.velocity, 0, sizeof(t.velocity));
+        t.angle = t.spin = t.mass = t.inertia = 0;
+    }
+    auto body = [&](const size_t i)
+    {
+        return !block_awake[i / 8];
+    };
+    for (size_t i=0; i < count; ++i)
+    {
+        if (!body(i))   continue;
+        Tile& t = tiles[node_tile[i]];
+        t.centroid[0] += px[i];
+        t.centroid[1] += py[i];
+        t.velocity[0] += vx[i];
+        t.velocity[1] += vy[i];
+        t.mass += 1;
+    }
+    for (auto& t : tiles)
+    {
+        if (!t.mass)    continue;
+        for (int p=0; p < 2; ++p)
+        {
+            t.centroid[p] /= t.mass;
+            t.velocity[p] /= t.mass;
+        }
+    }
+
+    boundary.clear();
+    for (size_t i=0; i < count; ++i)
+    {
+        if (!body(i))   continue;
+        Tile& t = tiles[node_tile[i]];
+        const float rx = px[i] - t.centroid[0];
+        const float ry = py[i] - t.centroid[1];
+        offset[i] = rx;
+        offset[plane + i] = ry;
+        t.spin += rx * (vy[i] - t.velocity[1]) - ry * (vx[i] - t.velocity[0]);
+        t.inertia += rx*rx + ry*ry;
+
+        // Links to nodes outside the body pull on it
+        for (int d=0; d < 8; ++d)
+        {
+            const size_t j = neighbors[d][i];
+            if (linked[d][i] && (!body(j) || node_tile[j] != node_tile[i]))
+            {
+                boundary.push_back(i*8 + d);
+            }
+        }
+    }
+    for (auto& t : tiles)
+    {
+        if (t.inertia > 0)  t.spin /= t.inertia;
+        t.mass *= SHIP_NODE_MASS;
+        t.inertia *= SHIP_NODE_MASS;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::AdvanceSleeping(const float dt)
+{
+    if (sleeping_blocks.empty())    return;
+
+    for (auto& t : tiles)
+    {
+        t.centroid[0] += t.velocity[0] * dt;
+        t.centroid[1] += t.velocity[1] * dt;
+        t.angle += t.spin * dt;
+    }
+
+    const float* const px = Plane(state[tick], 0);
+    const float* const py = Plane(state[tick], 1);
+    const float* const vx = Plane(state[tick], 2);
+    const float* const vy = Plane(state[tick], 3);
+
+    // Apply the force and torque of each boundary link (with the same
+    // spring and damper as the derivative kernel)
+    for (auto b : boundary)
+    {
+        const size_t i = b / 8;
+        const int d = b % 8;
+        const size_t j = neighbors[d][i];
+
+        const float dx = px[j] - px[i];
+        const float dy = py[j] - py[i];
+        const float len = std::sqrt(dx*dx + dy*dy);
+        const float ux = dx / len;
+        const float uy = dy / len;
+        const float f = spring_k * (len - Nodes::lengths[d]) +
+                        spring_c * ((vx[j] - vx[i]) * ux +
+                                    (vy[j] - vy[i]) * uy);
+
+        Tile& t = tiles[node_tile[i]];
+        t.velocity[0] += f * ux / t.mass * dt;
+        t.velocity[1] += f * uy / t.mass * dt;
+        t.spin += ((px[i] - t.centroid[0]) * f * uy -
+                   (py[i] - t.centroid[1]) * f * ux) / t.inertia * dt;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::MoveSleeping(const int out, const float dt)
+{
+    if (sleeping_blocks.empty())    return;
+
+    // Rigid frame of every sleeping tile, dt from now
+    std::vector<float> frames(tiles.size() * 4);
+    for (size_t t=0; t < tiles.size(); ++t)
+    {
+        const Tile& tile = tiles[t];
+        frames[t*4] = tile.centroid[0] + tile.velocity[0] * dt;
+        frames[t*4 + 1] = tile.centroid[1] + tile.velocity[1] * dt;
+        frames[t*4 + 2] = std::cos(tile.angle + tile.spin * dt);
+        frames[t*4 + 3] = std::sin(tile.angle + tile.spin * dt);
+    }
+
+    float* const px = Plane(state[out], 0);
+    float* const py = Plane(state[out], 1);
+    float* const vx = Plane(state[out], 2);
+    float* const vy = Plane(state[out], 3);
+
+    pool.Run(sleeping_blocks.size(), [&](size_t b0, size_t b1)
+    {
+        for (size_t b=b0; b < b1; ++b)
+        {
+            const size_t begin = sleeping_blocks[b] * 8;
+            for (size_t i=begin; i < std::min(begin + 8, count); ++i)
+            {
+                const Tile& t = tiles[node_tile[i]];
+                const float* const f = &frames[node_tile[i] * 4];
+                const float rx = f[2]*offset[i] - f[3]*offset[plane + i];
+                const float ry = f[3]*offset[i] + f[2]*offset[plane + i];
+                px[i] = f[0] + rx;
+                py[i] = f[1] + ry;
+                vx[i] = t.velocity[0] - t.spin * ry;
+                vy[i] = t.velocity[1] + t.spin * rx;
+            }
+        }
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::Step(const int from, const int to, const float dt,
+                  const bool have_k1)
+{
+    if (!have_k1)   GetDerivatives(from, 0);    // k1 = f(y)
+
+    // Sleeping nodes follow their tiles' rigid motion instead (with no
+    // need to move them again for k3, which is at the same time as k2)
+    const bool sleeping = Sleeping();
+
+    ApplyDerivatives(dt/2, 0, from, to);    // Calculate y + dt/2 * k1
+    if (sleeping)   MoveSleeping(to, dt/2);
+    GetDerivatives(to, 1);                  // k2 = f(y + dt/2 * k1)
+
+    ApplyDerivatives(dt/2, 1, from, to);    // Calculate y + dt/2 * k2
+    GetDerivatives(to, 2);                  // k3 = f(y + dt/2 * k2)
+
+    ApplyDerivatives(dt, 2, from, to);      // Calculate y + dt * k3
+    if (sleeping)   MoveSleeping(to, dt);
+    GetDerivatives(to, 3);                  // k4 = f(y + dt * k3)
+
+    GetNextState(dt, from, to);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::AdaptiveUpdate(const float dt, const float initial)
+{
+    // Start from the last frame's step size, if there was one
+    if (step_size <= 0)     step_size = initial;
+
+    steps_taken = 0;
+    bool rejected = false;
+    float t = 0;
+    while (t < dt)
+    {
+        // Take the last step exactly up to the end of the frame (and
+        // stretch the one before it, rather than leaving a tiny step).
+        float h = step_size;
+        const bool last = t + h*1.01f >= dt;
+        if (last)   h = dt - t;
+
+        // Take one full step and two half steps from state[tick].  Both
+        // start with the same k1, so it's only evaluated once.  All three
+        // count as steps, whether or not they're accepted, so that the
+        // total can be compared with fixed substeps.
+        Step(tick, !tick, h, false);
+        Step(tick, 2, h/2, true);
+        Step(2, 3, h/2, false);
+        steps_taken += 3;
+
+        // For RK4, the half steps' error is about 1/15th of the difference
+        // between the two results.  Velocity errors are scaled by the step
+        // size, to turn them into a position error after one step.
+        const float error = GetError(!tick, 3, h) / 15.0f;
+
+        // PI step size controller (with a safety factor), which also looks
+        // at the last accepted step's error.  Steps are usually limited by
+        // the springs' stability rather than by the tolerance, and the
+        // error jumps as a step nears that limit; the second factor keeps
+        // the step size from swinging back and forth across it.  Growth
+        // is also capped at 2x, and at 1x right after a rejection.
+        const float grow = rejected ? 1.0f : 2.0f;
+        const float previous = std::max(last_error, 1e-4f * tolerance);
+        const float scale = error > 0
+            ? std::min(grow, std::max(0.2f,
+                  0.9f * std::pow(tolerance / error, 0.14f)
+                       * std::pow(previous / tolerance, 0.08f)))
+            : grow;
+
+        if (error <= tolerance || h <= MIN_STEP)
+        {
+            // Accept the (more accurate) pair of half steps
+            std::swap(state[!tick], state[3]);
+            tick = !tick;
+            t = last ? dt : t + h;
+            rejected = false;
+            last_error = error;
+
+            // Don't let a short final step shrink the next frame's steps
+            if (!last || scale < 1)     step_size = std::max(h * scale,
+                                                             MIN_STEP);
+        }
+        else
+        {
+            step_size = std::max(h * scale, MIN_STEP);
+            steps_rejected++;
+            rejected = true;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+float Solver::GetError(const int a, const int b, const float dt)
+{
+    const float* const y = &state[a][0];
+    const float* const z = &state[b][0];
+
+    // Maximum error of each block of live nodes (written by that block's
+    // job, so that no locking is needed)
+    std::vector<float> errors(plane / 8, 0);
+
+    Run([&](size_t begin, size_t end)
+    {
+        for (size_t i=begin; i < end; ++i)
+        {
+            float e = 0;
+            for (int p=0; p < 4; ++p)
+            {
+                const float d = std::fabs(y[p*plane + i] - z[p*plane + i]);
+                e = std::max(e, p < 2 ? d : d * dt);
+            }
+            float& block = errors[i / 8];
+            block = std::max(block, e);
+        }
+    });
+
+    return *std::max_element(errors.begin(), errors.end());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::FusedStep(const float dt)
+{
+    const float* const y = &state[tick][0];
+    float* const out = &state[!tick][0];
+
+    // Each thread's buffers: the types of a span's nodes, then four planes
+    // each of its state, two intermediate states (each stage reads one and
+    // writes the other), and the running sum k1 + 2*k2 + 2*k3.  Cells
+    // without a live node have type 0, so they're never linked.
+    const size_t size = FUSED_SPAN*FUSED_SPAN + 2*FUSED_MARGIN;
+    const size_t buffers = size * 17;
+    fused_scratch.resize(buffers * pool.size(), 0);
+
+    // Offset of each neighbor within a buffer
+    int32_t offsets[8];
+    for (int d=0; d < 8; ++d)
+    {
+        offsets[d] = Nodes::offsets[d][0] + Nodes::offsets[d][1]*FUSED_SPAN;
+    }
+
+    // Step size used to find the next stage's state from this stage's k
+    const float h[3] = {dt/2, dt/2, dt};
+
+    pool.RunThreads([&](size_t thread, size_t threads)
+    {
+        float* const scratch = &fused_scratch[buffers * thread];
+        float* const type = &scratch[FUSED_MARGIN];
+        float* const yl = &scratch[size + FUSED_MARGIN];
+        float* const z[2] = {&yl[4*size], &yl[8*size]};
+        float* const sum = &yl[12*size];
+
+        // Neighbors are at fixed offsets, and linked if they're live
+        auto neighbors = [&](const float* const v)
+        {
+            return [&, v](const int d, const size_t i, vfloat f[4])
+            {
+                const size_t j = i + offsets[d];
+                for (int p=0; p < 4; ++p)
+                {
+                    f[p] = vfloat::load(&v[p*size + j]);
+                }
+                return vfloat::load(&type[j]) != vfloat(0);
+            };
+        };
+
+        const size_t n = fused_tiles.size();
+        for (size_t t=n * thread / threads; t < n * (thread + 1) / threads;
+             ++t)
+        {
+            const FusedTile& tile = fused_tiles[t];
+            const uint32_t* const cells = &fused_cells[tile.first * 2];
+
+            for (size_t c=0; c < tile.count; ++c)
+            {
+                const uint32_t cell = cells[c*2];
+                const uint32_t j = cells[c*2 + 1];
+                type[cell] = types[j];
+                for (int p=0; p < 4; ++p)
+                {
+                    yl[p*size + cell] = y[p*plane + j];
+                }
+            }
+
+            // Stages run over the rows and (whole vectors of) columns
+            // holding live nodes, skipping s + 1 rows at each edge of the
+            // span for stage s, since their neighbors aren't known yet.
+            // Nodes in the span's first and last columns read the wrong
+            // neighbors (from the rows beside them), but their errors only
+            // spread by one node per stage, so they never reach the tile.
+            const size_t w = vfloat::width;
+            const size_t column_begin = tile.columns[0] / w * w;
+            const size_t column_end = std::min(
+                    (tile.columns[1] + w - 1) / w * w, FUSED_SPAN);
+            auto first = [&](const int s)
+            {
+                return std::max<size_t>(tile.rows[0], s + 1);
+            };
+            auto last = [&](const int s)
+            {
+                return std::min<size_t>(tile.rows[1], FUSED_SPAN - 1 - s);
+            };
+
+            // k1..k3: accumulate k and find the next stage's state
+            for (int s=0; s < 3; ++s)
+            {
+                const float* const source = s ? z[(s - 1) % 2] : yl;
+                float* const next = z[s % 2];
+                const vfloat two(2);
+                const vfloat step(h[s]);
+
+                auto emit = [&](size_t i, const vfloat k[4])
+                {
+                    for (int p=0; p < 4; ++p)
+                    {
+                        const size_t c = p*size + i;
+                        if (s)  (vfloat::load(&sum[c]) + k[p] * two)
+                                    .store(&sum[c]);
+                        else    k[p].store(&sum[c]);
+                        (vfloat::load(&yl[c]) + k[p] * step).store(&next[c]);
+                    }
+                };
+                for (size_t row=first(s); row < last(s); ++row)
+                {
+                    Derivatives(source, size, type,
+                                row*FUSED_SPAN + column_begin,
+                                row*FUSED_SPAN + column_end,
+                                neighbors(source), emit);
+                }
+            }
+
+            // k4: combine everything into the new state (in the spare
+            // intermediate buffer)
+            const vfloat step(dt / 6.0f);
+            auto emit = [&](size_t i, const vfloat k[4])
+            {
+                for (int p=0; p < 4; ++p)
+                {
+                    const size_t c = p*size + i;
+                    (vfloat::load(&yl[c]) +
+                     (vfloat::load(&sum[c]) + k[p]) * step).store(&z[1][c]);
+                }
+            };
+            for (size_t row=first(3); row < last(3); ++row)
+            {
+                Derivatives(z[0], size, type,
+                            row*FUSED_SPAN + column_begin,
+                            row*FUSED_SPAN + column_end,
+                            neighbors(z[0]), emit);
+            }
+
+            // Copy out the tile's own nodes, and clear the span's types
+            for (size_t c=0; c < tile.count; ++c)
+            {
+                const uint32_t cell = cells[c*2];
+                const uint32_t j = cells[c*2 + 1];
+                type[cell] = 0;
+
+                const size_t lx = cell % FUSED_SPAN;
+                const size_t ly = cell / FUSED_SPAN;
+                if (lx < FUSED_HALO || lx >= FUSED_HALO + FUSED_TILE ||
+                    ly < FUSED_HALO || ly >= FUSED_HALO + FUSED_TILE)
+                {
+                    continue;
+                }
+                for (int p=0; p < 4; ++p)
+                {
+                    out[p*plane + j] = z[1][p*size + cell];
+                }
+            }
+        }
+    });
+
+    tick = !tick;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::ImplicitStep(const float dt)
+{
+    const float* const y = &state[tick][0];
+    float* const out = &state[!tick][0];
+
+    // Conjugate gradient vectors (two planes each): the change in velocity
+    // being solved for, the residual, the search direction, and the
+    // matrix times the search direction.  The change in velocity starts
+    // from the last step's, since engines usually fire for many steps.
+    float* const dv = &derivative[2][0];
+    float* const r = &derivative[0][0];
+    float* const p = &derivative[0][2*plane];
+    float* const ap = &derivative[1][0];
+
+    const vfloat h(dt);
+    const vfloat m(SHIP_NODE_MASS);
+    const vfloat zero(0);
+
+    // Loads a plane's values for the neighbors in direction d of nodes i..
+    auto far = [&](const float* const v, const int d, const size_t i)
+    {
+        return contiguous[d][i / vfloat::width]
+            ? vfloat::load(&v[neighbors[d][i]])
+            : gather(v, &neighbors[d][i]);
+    };
+
+    // Returns the dot product of two-plane vectors over nodes [begin, end)
+    auto dot = [&](const float* const a, const float* const b,
+                   const size_t begin, const size_t end)
+    {
+        vfloat sum(0);
+        for (int q=0; q < 2; ++q)
+        {
+            for (size_t i=q*plane + begin; i < q*plane + end;
+                 i += vfloat::width)
+            {
+                sum += vfloat::load(&a[i]) * vfloat::load(&b[i]);
+            }
+        }
+
+        float lanes[vfloat::width];
+        sum.store(lanes);
+        double total = 0;
+        for (auto f : lanes)    total += f;
+        return total;
+    };
+
+    // Sets out = A*v over nodes [begin, end), where each link contributes
+    // its block of A times the difference between v at its two ends.
+    // Missing links have zero blocks, so don't need to be masked.
+    auto multiply = [&](const float* const v, float* const out,
+                        const size_t begin, const size_t end)
+    {
+        for (size_t i=begin; i < end; i += vfloat::width)
+        {
+            const vfloat vx = vfloat::load(&v[i]);
+            const vfloat vy = vfloat::load(&v[plane + i]);
+
+            vfloat ax = m * vx;
+            vfloat ay = m * vy;
+            for (int d=0; d < 8; ++d)
+            {
+                const float* const a = &jacobian[d][0];
+                const vfloat qx = vx - far(v, d, i);
+                const vfloat qy = vy - far(&v[plane], d, i);
+                const vfloat axy = vfloat::load(&a[plane + i]);
+                ax += vfloat::load(&a[i])*qx + axy*qy;
+                ay += axy*qx + vfloat::load(&a[2*plane + i])*qy;
+            }
+            ax.store(&out[i]);
+            ay.store(&out[plane + i]);
+        }
+    };
+
+    // Each thread's share of the last two dot products.  Every thread
+    // adds them up in the same order, so they all agree on the result
+    // (and on when to stop iterating).
+    std::vector<double> partial[2];
+    for (auto& d : partial)     d.resize(pool.size());
+    auto total = [&](const int which)
+    {
+        double sum = 0;
+        for (auto d : partial[which])   sum += d;
+        return sum;
+    };
+
+    pool.RunThreads([&](size_t thread, size_t threads)
+    {
+        // Split the (8-aligned) node list between threads
+        const size_t blocks = plane / 8;
+        const size_t begin = blocks * thread / threads * 8;
+        const size_t end = blocks * (thread + 1) / threads * 8;
+
+        // We're solving A*dv = h*f(y) + h^2*K*v, with A = M - h*D - h^2*K,
+        // where K and D are the Jacobians of the forces by position and by
+        // velocity.  Start by putting h*f(y) in the residual.
+        Derivatives(y, begin, end,
+            [&](size_t i, const vfloat k[4])
+            {
+                (k[2] * m * h).store(&r[i]);
+                (k[3] * m * h).store(&r[plane + i]);
+            });
+
+        // Find each link's block of A, and add h^2*K*v to the residual
+        for (size_t i=begin; i < end; i += vfloat::width)
+        {
+            const vfloat near_px = vfloat::load(&y[i]);
+            const vfloat near_py = vfloat::load(&y[plane + i]);
+            const vfloat near_vx = vfloat::load(&y[2*plane + i]);
+            const vfloat near_vy = vfloat::load(&y[3*plane + i]);
+
+            vfloat kvx(0), kvy(0);
+            for (int d=0; d < 8; ++d)
+            {
+                const vmask far_filled =
+                    vfloat::load(&linked[d][i]) != zero;
+
+                const vfloat dx = far(y, d, i) - near_px;
+                const vfloat dy = far(&y[plane], d, i) - near_py;
+                const vfloat len = sqrt(dx*dx + dy*dy);
+                const vfloat ux = dx / len;
+                const vfloat uy = dy / len;
+
+                // Spring stiffness along the link, and across it (which
+                // is dropped for compressed links, to keep A positive
+                // definite so that conjugate gradients converges)
+                const vfloat rest(Nodes::lengths[d]);
+                const vfloat along(spring_k);
+                const vfloat across = select(len > rest,
+                        along * (vfloat(1) - rest / len), zero);
+
+                const vfloat kxx = across + (along - across) * ux*ux;
+                const vfloat kxy = (along - across) * ux*uy;
+                const vfloat kyy = across + (along - across) * uy*uy;
+
+                const vfloat dvx = far(&y[2*plane], d, i) - near_vx;
+                const vfloat dvy = far(&y[3*plane], d, i) - near_vy;
+                kvx += select(far_filled, kxx*dvx + kxy*dvy, zero);
+                kvy += select(far_filled, kxy*dvx + kyy*dvy, zero);
+
+                // The damper only acts along the link
+                const vfloat hc = h * vfloat(spring_c);
+                const vfloat hh = h * h;
+                float* const a = &jacobian[d][0];
+                select(far_filled, hc*ux*ux + hh*kxx, zero).store(&a[i]);
+                select(far_filled, hc*ux*uy + hh*kxy, zero)
+                    .store(&a[plane + i]);
+                select(far_filled, hc*uy*uy + hh*kyy, zero)
+                    .store(&a[2*plane + i]);
+            }
+
+            (vfloat::load(&r[i]) + h*h*kvx).store(&r[i]);
+            (vfloat::load(&r[plane + i]) + h*h*kvy).store(&r[plane + i]);
+        }
+
+        // Subtract A*dv from the residual, for the initial guess at dv.
+        // This only needs this thread's blocks of A (and the last step's
+        // dv), so no synchronization is needed yet.
+        multiply(dv, ap, begin, end);
+        for (int q=0; q < 2; ++q)
+        {
+            for (size_t i=q*plane + begin; i < q*plane + end;
+                 i += vfloat::width)
+            {
+                const vfloat ri = vfloat::load(&r[i]) - vfloat::load(&ap[i]);
+                ri.store(&r[i]);
+                ri.store(&p[i]);
+            }
+        }
+
+        partial[1][thread] = dot(r, r, begin, end);
+        barrier.Wait();
+
+        double rr = total(1);
+        const double stop = rr * CG_TOLERANCE * CG_TOLERANCE;
+        for (int n=0; n < iterations && rr > stop; ++n)
+        {
+            multiply(p, ap, begin, end);
+            partial[0][thread] = dot(p, ap, begin, end);
+            barrier.Wait();
+
+            const vfloat alpha(rr / total(0));
+            for (int q=0; q < 2; ++q)
+            {
+                for (size_t i=q*plane + begin; i < q*plane + end;
+                     i += vfloat::width)
+                {
+                    (vfloat::load(&dv[i]) + alpha * vfloat::load(&p[i]))
+                        .store(&dv[i]);
+                    (vfloat::load(&r[i]) - alpha * vfloat::load(&ap[i]))
+                        .store(&r[i]);
+                }
+            }
+
+            partial[1][thread] = dot(r, r, begin, end);
+            barrier.Wait();
+
+            const double rr_next = total(1);
+            const vfloat beta(rr_next / rr);
+            rr = rr_next;
+            for (int q=0; q < 2; ++q)
+            {
+                for (size_t i=q*plane + begin; i < q*plane + end;
+                     i += vfloat::width)
+                {
+                    (vfloat::load(&r[i]) + beta * vfloat::load(&p[i]))
+                        .store(&p[i]);
+                }
+            }
+
+            // Every thread must finish updating p before any thread
+            // reads it as neighbors in the next iteration.
+            barrier.Wait();
+        }
+
+        // Apply the change in velocity, then move with the new velocity
+        for (size_t i=begin; i < end; i += vfloat::width)
+        {
+            for (int q=0; q < 2; ++q)
+            {
+                const size_t n = q*plane + i;
+                const vfloat v = vfloat::load(&y[2*plane + n]) +
+                                 vfloat::load(&dv[n]);
+                v.store(&out[2*plane + n]);
+                (vfloat::load(&y[n]) + v * h).store(&out[n]);
+            }
+        }
+    });
+
+    tick = !tick;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::Run(const std::function<void(size_t, size_t)>& f)
+{
+    if (!Sleeping())
+    {
+        pool.Run(plane / 8, [&](size_t b0, size_t b1){ f(b0 * 8, b1 * 8); });
+        return;
+    }
+
+    // Only run awake blocks, merging runs of consecutive ones
+    pool.Run(awake_blocks.size(), [&](size_t b0, size_t b1)
+    {
+        while (b0 < b1)
+        {
+            size_t b = b0 + 1;
+            while (b < b1 && awake_blocks[b] == awake_blocks[b - 1] + 1)  ++b;
+            f(awake_blocks[b0] * 8, (awake_blocks[b - 1] + 1) * 8);
+            b0 = b;
+        }
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::GetDerivatives(const int source, const int out)
+{
+    if (profiler)   profiler->Begin(Profiler::DERIVATIVES, false);
+
+    const float* const y = &state[source][0];
+
+    float* const dpx = Plane(derivative[out], 0);
+    float* const dpy = Plane(derivative[out], 1);
+    float* const dvx = Plane(derivative[out], 2);
+    float* const dvy = Plane(derivative[out], 3);
+
+    Run([&](size_t begin, size_t end)
+    {
+        Derivatives(y, begin, end,
+            [&](size_t i, const vfloat k[4])
+            {
+                k[0].store(&dpx[i]);
+                k[1].store(&dpy[i]);
+                k[2].store(&dvx[i]);
+                k[3].store(&dvy[i]);
+            });
+    });
+
+    if (profiler)   profiler->End();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename Emit>
+void Solver::Derivatives(const float* const y, const size_t begin,
+                         const size_t end, Emit emit) const
+{
+    // Neighbors come from the tables, loaded directly where they're
+    // consecutive in memory and gathered otherwise
+    auto far = [&](const int d, const size_t i, vfloat v[4])
+    {
+        const int32_t* const j = &neighbors[d][i];
+        const bool direct = contiguous[d][i / vfloat::width];
+        for (int p=0; p < 4; ++p)
+        {
+            v[p] = direct ? vfloat::load(&y[p*plane + *j])
+                          : gather(&y[p*plane], j);
+        }
+        return vfloat::load(&linked[d][i]) != vfloat(0);
+    };
+    Derivatives(y, plane, &types[0], begin, end, far, emit);
+}
+
+template <typename Far, typename Emit>
+void Solver::Derivatives(const float* const y, const size_t stride,
+                         const float* const type, const size_t begin,
+                         const size_t end, Far far, Emit emit) const
+{
+    const float* const px = &y[0];
+    const float* const py = &y[stride];
+    const float* const vx = &y[2*stride];
+    const float* const vy = &y[3*stride];
+
+    // Engine types to fire; -1 never matches a node type.
+    const vfloat thrust(thrustEnginesOn ? SHIP_ENGINE_THRUST : -1);
+    const vfloat left(leftEnginesOn ? SHIP_ENGINE_LEFT : -1);
+    const vfloat right(rightEnginesOn ? SHIP_ENGINE_RIGHT : -1);
+
+    for (size_t i=begin; i < end; i += vfloat::width)
+    {
+        const vfloat near_type = vfloat::load(&type[i]);
+        const vmask near_filled = near_type != vfloat(0);
+
+        const vfloat near_px = vfloat::load(&px[i]);
+        const vfloat near_py = vfloat::load(&py[i]);
+        const vfloat near_vx = vfloat::load(&vx[i]);
+        const vfloat near_vy = vfloat::load(&vy[i]);
+
+        vfloat ax(0), ay(0);
+        vfloat angle_x(0), angle_y(0);
+
+        for (int d=0; d < 8; ++d)
+        {
+            vfloat v[4];
+            const vmask far_filled = far(d, i, v);
+            const vfloat& far_px = v[0];
+            const vfloat& far_py = v[1];
+            const vfloat& far_vx = v[2];
+            const vfloat& far_vy = v[3];
+
+            const vfloat dx = far_px - near_px;
+            const vfloat dy = far_py - near_py;
+            const vfloat len = sqrt(dx*dx + dy*dy);
+            const vfloat ux = dx / len;
+            const vfloat uy = dy / len;
+
+            // Nominal distance and direction to this neighbor
+            const float rest = Nodes::lengths[d];
+            const vfloat rx(Nodes::directions[d][0]);
+            const vfloat ry(Nodes::directions[d][1]);
+
+            // Linear spring and damper forces, along the link
+            const vfloat f =
+                vfloat(spring_k) * (len - vfloat(rest)) +
+                vfloat(spring_c) *
+                    ((far_vx - near_vx) * ux +
+                     (far_vy - near_vy) * uy);
+            ax += select(far_filled,
+                         f * ux / vfloat(SHIP_NODE_MASS), vfloat(0));
+            ay += select(far_filled,
+                         f * uy / vfloat(SHIP_NODE_MASS), vfloat(0));
+
+            // Accumulate the angle between desired and actual
+            // positions as a (cos, sin) pair, which is equivalent
+            // to the shader's difference of atan values.
+            angle_x += select(far_filled, ux*rx + uy*ry, vfloat(0));
+            angle_y += select(far_filled, uy*rx - ux*ry, vfloat(0));
+        }
+
+        // Accelerate engine nodes perpendicular to their orientation
+        const vmask firing = (near_type == thrust) | (near_type == left) |
+                             (near_type == right);
+        if (firing.any())   EngineAccel(firing, angle_x, angle_y, ax, ay);
+
+        const vfloat k[4] = {select(near_filled, near_vx, vfloat(0)),
+                             select(near_filled, near_vy, vfloat(0)),
+                             select(near_filled, ax, vfloat(0)),
+                             select(near_filled, ay, vfloat(0))};
+        emit(i, k);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::ApplyDerivatives(const float dt, const int source,
+                              const int from, const int to)
+{
+    if (profiler)   profiler->Begin(Profiler::EULER, false);
+
+    const float* const y = &state[from][0];
+    const float* const k = &derivative[source][0];
+    float* const out = &state[to][0];
+
+    Run([&](size_t begin, size_t end)
+    {
+        const vfloat h(dt);
+        for (int p=0; p < 4; ++p)
+        {
+            for (size_t i=p*plane + begin; i < p*plane + end;
+                 i += vfloat::width)
+            {
+                (vfloat::load(&y[i]) + vfloat::load(&k[i]) * h).store(&out[i]);
+            }
+        }
+    });
+
+    if (profiler)   profiler->End();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::GetNextState(const float dt, const int from, const int to)
+{
+    if (profiler)   profiler->Begin(Profiler::RK4_SUM, false);
+
+    const float* const y = &state[from][0];
+    const float* const k1 = &derivative[0][0];
+    const float* const k2 = &derivative[1][0];
+    const float* const k3 = &derivative[2][0];
+    const float* const k4 = &derivative[3][0];
+    float* const out = &state[to][0];
+
+    Run([&](size_t begin, size_t end)
+    {
+        const vfloat h(dt / 6.0f);
+        const vfloat two(2);
+        for (int p=0; p < 4; ++p)
+        {
+            for (size_t i=p*plane + begin; i < p*plane + end;
+                 i += vfloat::width)
+            {
+                (vfloat::load(&y[i]) + h *
+                    (vfloat::load(&k1[i]) + two*vfloat::load(&k2[i]) +
+                     two*vfloat::load(&k3[i]) + vfloat::load(&k4[i])))
+                    .store(&out[i]);
+            }
+        }
+    });
+
+    if (profiler)   profiler->End();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::GetState(float* rgba) const
+{
+    size_t i=0;
+    for (size_t y=0; y <= height; ++y)
+    {
+        for (size_t x=0; x <= width; ++x)
+        {
+            rgba[i++] = x;
+            rgba[i++] = y;
+            rgba[i++] = 0;
+            rgba[i++] = 0;
+        }
+    }
+
+    for (size_t n=0; n < count; ++n)
+    {
+        for (int p=0; p < 4; ++p)
+        {
+            rgba[index[n]*4 + p] = Plane(state[tick], p)[n];
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::SetState(const float* rgba)
+{
+    for (size_t n=0; n < count; ++n)
+    {
+        for (int p=0; p < 4; ++p)
+        {
+            Plane(state[tick], p)[n] = rgba[index[n]*4 + p];
+        }
+    }
+    std::fill(derivative[2].begin(), derivative[2].end(), 0);
+    WakeTiles();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Solver::FindPosition(float centroid[2], float velocity[2]) const
+{
+    double sum[4] = {0, 0, 0, 0};
+    for (int p=0; p < 4; ++p)
+    {
+        const float* const v = Plane(state[tick], p);
+        for (size_t n=0; n < count; ++n)
+        {
+            sum[p] += v[n];
+        }
+    }
+
+    centroid[0] = sum[0] / count;
+    centroid[1] = sum[1] / count;
+    velocity[0] = sum[2] / count;
+    velocity[1] = sum[3] / count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t Solver::GetChecksum() const
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int p=0; p < 4; ++p)
+    {
+        const uint8_t* const bytes =
+            reinterpret_cast<const uint8_t*>(Plane(state[tick], p));
+        for (size_t i=0; i < count * sizeof(float); ++i)
+        {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
@@ -0,0 +1,318 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "pool.h"
+
+class Nodes;
+class Profiler;
+
+// CPU implementation of the mass-spring-damper integrator.
+//
+// This mirrors the derivatives.frag / euler.frag / rk4.frag pipeline,
+// but only stores the live nodes (from Nodes), as planes of (x, y, dx, dy),
+// so that every kernel's cost scales with the number of filled nodes.
+// Nodes are processed with SIMD kernels and split across a thread pool,
+// which gives each thread a contiguous run of 8-node vectors.  Since nodes
+// are stored in Nodes' block order, a run covers one part of the grid
+// (which may end partway through a block), and neighbors past its ends or
+// across block edges are read straight from shared memory, so the solver
+// needs no halos.
+//
+// Results track the shader path to within ~1e-4 node widths in position
+// over a few seconds of simulated time (the difference comes from float
+// rounding and operation order).
+class Solver
+{
+public:
+    // RK4 runs the same passes as the shaders (4 derivative evaluations,
+    // 3 Euler steps and a final sum), each as a separate parallel job.
+    // RK4_FUSED runs a whole step as one job, a square tile of the grid
+    // at a time: each tile's state, plus a halo four nodes deep (one per
+    // stage), is copied into the thread's own cache-sized buffers, all
+    // four stages run there (recomputing the halo's stages rather than
+    // waiting for the neighboring tiles), and only the tile's new state
+    // is written back.  So each step reads the state once (plus halos)
+    // and writes it once, and threads never need to synchronize.
+    // IMPLICIT takes linearized backward Euler steps (as in Baraff and
+    // Witkin, "Large Steps in Cloth Simulation"), solving for the change
+    // in velocity with a few conjugate gradient iterations.  It's only
+    // first order accurate, but stays stable at one step per frame however
+    // stiff the springs are.
+    enum Integrator {RK4, RK4_FUSED, IMPLICIT};
+
+    Solver(const size_t width, const size_t height, const Nodes& nodes,
+           const size_t threads=0);
+
+    void SetIntegrator(const Integrator i) { integrator = i; }
+
+    // Sets the maximum number of conjugate gradient iterations per
+    // implicit step
+    void SetIterations(const int n) { iterations = n; }
+
+    // Scales the spring and damper constants (SHIP_SPRING_K and _C)
+    void SetStiffness(const float scale);
+
+    // Times the RK4 integrator's passes with the given profiler (on the
+    // CPU only), or stops timing them if it's NULL.
+    void SetProfiler(Profiler* p) { profiler = p; }
+
+    // If tolerance is positive, Update picks its own step sizes (with
+    // RK4 step doubling), keeping the estimated error of each step below
+    // tolerance.  Errors are measured in node widths of position, with
+    // velocity errors multiplied by the step size.  Adaptive steps always
+    // use the multipass RK4 passes, whichever integrator is selected.
+    void SetTolerance(const float t) { tolerance = t; }
+
+    // If threshold is positive, divides the node grid into square tiles
+    // that fall asleep once they've been still for SLEEP_FRAMES Updates:
+    // every link within threshold node widths of its rest length, and
+    // every node within threshold node widths per Update of the tile's
+    // rigid motion.  Sleeping tiles skip the derivative kernels, and are
+    // advanced as rigid bodies, pushed and turned by the links that cross
+    // their edges.  They wake when their own links stretch past the
+    // threshold, when a neighboring tile is awake and moving past the
+    // threshold, or when one of their engines fires.  Tiles are only
+    // checked once per Update, and only sleep with the fixed-step RK4
+    // integrator.  A threshold of zero wakes every tile.
+    void SetSleeping(const float threshold);
+
+    // Returns the fraction of live nodes that the last Update simulated
+    // (rather than moving rigidly with a sleeping tile)
+    float GetAwakeFraction() const;
+
+    // Returns the number of RK4 steps taken by the last Update.  When
+    // adaptive, that's three per attempt (a full step and two half steps),
+    // counting attempts that were rejected, whose number is also returned.
+    int GetSteps() const { return steps_taken; }
+    int GetRejectedSteps() const { return steps_rejected; }
+
+    // Run a set of RK4 steps with the given engine states.  When adaptive
+    // stepping is on, steps is only used to pick the first step size.
+    void Update(const float dt, const int steps,
+                const bool thrust, const bool left, const bool right);
+
+    // Copy the current state into an interleaved RGBA array of
+    // (width+1)*(height+1) nodes (the layout used by state_tex).
+    // Empty nodes are left at their rest positions.
+    void GetState(float* rgba) const;
+
+    // Replaces the state of every live node with values from an array in
+    // the same layout as GetState's.  This also resets the implicit
+    // integrator's starting guess, so a restored run only matches an
+    // uninterrupted one exactly for the RK4 integrators.
+    void SetState(const float* rgba);
+
+    // Find the centroid and mean velocity of filled nodes.
+    void FindPosition(float centroid[2], float velocity[2]) const;
+
+    // Returns a 64-bit FNV-1a hash of the bits of every live node's
+    // position and velocity, so that runs can be checked for exact
+    // agreement.  Runs with the same settings and inputs hash the same,
+    // except that implicit steps also depend on the number of threads
+    // (which changes the order of their sums).
+    uint64_t GetChecksum() const;
+
+private:
+    // Same contracts as the Ship functions of the same name, except that
+    // the source and destination states are passed in explicitly (and
+    // GetNextState doesn't change tick).
+    void GetDerivatives(const int source, const int out);
+    void ApplyDerivatives(const float dt, const int source,
+                          const int from, const int to);
+    void GetNextState(const float dt, const int from, const int to);
+
+    // Returns true if tiles can sleep with the current settings
+    bool Sleeping() const
+    { return sleep_threshold > 0 && integrator == RK4 && tolerance <= 0; }
+
+    // Checks every tile's motion after an Update, putting quiet tiles to
+    // sleep and waking disturbed ones.
+    void UpdateTiles(const float dt);
+
+    // Wakes every tile, so that every block is simulated
+    void WakeTiles();
+
+    // Wakes the tiles holding engines that are firing
+    void WakeEngines();
+
+    // Rebuilds the lists of awake and sleeping blocks from the tiles'
+    // flags, then the rigid bodies and boundary links of sleeping tiles
+    // from state[tick].
+    void SortBlocks();
+
+    // Advances the sleeping tiles' rigid bodies by dt (to where
+    // MoveSleeping put their nodes), then accelerates them by the forces
+    // from their boundary links in state[tick].
+    void AdvanceSleeping(const float dt);
+
+    // Writes the rigid motion of the nodes in sleeping blocks into
+    // state[out], as it will be dt after the tiles' current time.
+    void MoveSleeping(const int out, const float dt);
+
+    // Runs one RK4 step from state[from] into state[to] (which is also
+    // used for the intermediate stages).  If have_k1 is true, derivative[0]
+    // already holds f(state[from]).
+    void Step(const int from, const int to, const float dt,
+              const bool have_k1);
+
+    // Advances by dt with adaptive step sizes (see SetTolerance), starting
+    // with the given step size if there's none from a previous frame.
+    void AdaptiveUpdate(const float dt, const float initial);
+
+    // Returns the largest difference between state[a] and state[b]
+    // over live nodes, with velocity differences multiplied by dt.
+    float GetError(const int a, const int b, const float dt);
+
+    // Runs a full RK4 step as a single job (see RK4_FUSED)
+    void FusedStep(const float dt);
+
+    // Runs an implicit step as a single job, with threads waiting at a
+    // barrier wherever they need each other's results.  The solver's
+    // vectors are stored in the planes of derivative[0] and [1].
+    void ImplicitStep(const float dt);
+
+    // Evaluates derivatives for live nodes [begin, end) of the state y,
+    // calling emit(i, k) with the four planes of k for each vector.
+    template <typename Emit>
+    void Derivatives(const float* const y, const size_t begin,
+                     const size_t end, Emit emit) const;
+
+    // Same, for nodes [begin, end) of any state whose planes are stride
+    // floats apart, with their types in type.  far(d, i, v) loads the
+    // four planes of the neighbors in direction d of nodes i.. into v,
+    // and returns which of them are linked.
+    template <typename Far, typename Emit>
+    void Derivatives(const float* const y, const size_t stride,
+                     const float* const type, const size_t begin,
+                     const size_t end, Far far, Emit emit) const;
+
+    // Calls f(begin, end) on blocks of live nodes across the thread pool.
+    // Blocks are aligned to the widest SIMD vector.  When tiles are
+    // sleeping, only awake blocks are passed to f.
+    void Run(const std::function<void(size_t, size_t)>& f);
+
+    // Returns a pointer to plane p (0-3 = x, y, dx, dy) of a buffer.
+    float* Plane(std::vector<float>& buf, const int p) const
+    { return &buf[p * plane]; }
+    const float* Plane(const std::vector<float>& buf, const int p) const
+    { return &buf[p * plane]; }
+
+    const size_t width;
+    const size_t height;
+
+    // Number of live nodes, and that number rounded up to a multiple of
+    // the SIMD width (the extra nodes are empty padding).
+    size_t count;
+    size_t plane;
+
+    // Grid index of each live node
+    std::vector<uint32_t> index;
+
+    // Node types (as floats, to be compared in SIMD registers)
+    std::vector<float> types;
+
+    // Neighbor tables, one plane per direction in Nodes::offsets.
+    // Missing neighbors point at some valid node and are masked by
+    // linked = 0.
+    std::vector<int32_t> neighbors[8];
+    std::vector<float> linked[8];
+
+    // For each SIMD vector of nodes and each direction, whether the
+    // neighbors are consecutive in memory (so can be loaded directly).
+    std::vector<uint8_t> contiguous[8];
+
+    // Tiles of the grid holding live nodes, for RK4_FUSED.  Each tile's
+    // span (the tile and its halo) lists the live nodes in it as pairs of
+    // cell (x + y*FUSED_SPAN) and live index in fused_cells, along with
+    // the range of rows and columns that they cover.
+    struct FusedTile
+    {
+        size_t first;       // index of the tile's first pair
+        size_t count;
+        uint32_t rows[2];
+        uint32_t columns[2];
+    };
+    std::vector<FusedTile> fused_tiles;
+    std::vector<uint32_t> fused_cells;
+
+    // Each pool thread's buffers for stepping a tile (see FusedStep)
+    std::vector<float> fused_scratch;
+
+    // state[tick] is the current state, and state[!tick] is the next one
+    // (which is also used for intermediate stages).  The others are only
+    // used by adaptive stepping.
+    std::vector<float> state[4];
+    std::vector<float> derivative[4];
+    bool tick;
+
+    Integrator integrator;
+    int iterations;     // per implicit step
+
+    // Spring and damper constants
+    float spring_k;
+    float spring_c;
+
+    // Symmetric 2x2 block (xx, xy, yy planes) of the implicit system's
+    // matrix for each link, one buffer per direction.  Each link is
+    // stored at both of its ends (with the same values).
+    std::vector<float> jacobian[8];
+
+    float tolerance;    // zero for fixed steps
+    float step_size;    // last step size picked by AdaptiveUpdate
+    float last_error;   // error of the last step that it accepted
+    int steps_taken;
+    int steps_rejected;
+
+    bool thrustEnginesOn;
+    bool leftEnginesOn;
+    bool rightEnginesOn;
+
+    // Tile sleeping (see SetSleeping)
+    struct Tile
+    {
+        // Rigid body of the tile's nodes in sleeping blocks: its centroid
+        // and the angle it has turned since SortBlocks, the velocity and
+        // spin they change at, and its mass and moment of inertia
+        float centroid[2];
+        float angle;
+        float velocity[2];
+        float spin;
+        float mass;
+        float inertia;
+
+        uint8_t engines;    // FLEET_*_BIT mask of engine types in the tile
+        bool asleep;
+        int quiet;          // number of Updates in a row below threshold
+    };
+    float sleep_threshold;      // zero if tiles never sleep
+    size_t tiles_x;
+    size_t tiles_y;
+    std::vector<Tile> tiles;
+    std::vector<uint32_t> node_tile;    // tile of each live node
+
+    // Offset of each node (in two planes) from its tile's centroid, when
+    // the tile's angle was zero.  Only valid for nodes in sleeping blocks.
+    std::vector<float> offset;
+
+    // Links from nodes in sleeping blocks to nodes outside their rigid
+    // bodies, as node * 8 + direction
+    std::vector<uint32_t> boundary;
+
+    // SIMD blocks (of 8 nodes) containing a node in an awake tile, which
+    // are simulated, and the other blocks, which are moved rigidly
+    std::vector<uint32_t> awake_blocks;
+    std::vector<uint32_t> sleeping_blocks;
+    std::vector<uint8_t> block_awake;
+    size_t awake_nodes;     // live nodes in awake blocks
+
+    Profiler* profiler;
+
+    ThreadPool pool;
+    Barrier barrier;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <atomic>
+#include <cstddef>
+
+// Fixed-size lock-free queue between exactly one producer thread and one
+// consumer thread.  Neither side ever blocks: Push fails when the queue is
+// full, and Pop fails when it's empty.
+template <typename T, size_t N>
+class SpscQueue
+{
+public:
+    SpscQueue() : head(0), tail(0) {}
+
+    // Adds an item, returning false if the queue is full.  Only call this
+    // from the producer thread.
+    bool Push(const T& item)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N)  return false;
+
+        items[h % N] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Removes the oldest item into item, returning false if the queue is
+    // empty.  Only call this from the consumer thread.
+    bool Pop(T* item)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))  return false;
+
+        *item = items[t % N];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T items[N];
+
+    // Counts of items pushed and popped, padded onto separate cache lines
+    // so that the two threads don't contend for them
+    std::atomic<size_t> head;
+    char padding[64];
+    std::atomic<size_t> tail;
+};
+
+#endif
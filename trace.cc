@@ -0,0 +1,212 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+#define GLFW_INCLUDE_GLCOREARB
+#include <GLFW/glfw3.h>
+
+#include "trace.h"
+
+// From KHR_debug, which may not be in the GL 3.3 headers
+#ifndef GL_DEBUG_SOURCE_APPLICATION
+#define GL_DEBUG_SOURCE_APPLICATION 0x824A
+#endif
+
+std::atomic<bool> Trace::recording(false);
+
+// A completed scope
+struct Event
+{
+    // One more than the index of the event in this slot, which is stored
+    // after the rest of the event (and cleared before overwriting it), so
+    // that Write can skip slots that are being written.
+    std::atomic<uint64_t> seq;
+
+    const char* name;
+    uint32_t thread;
+    int64_t start;      // ns since Trace::Start
+    int64_t duration;   // ns
+};
+
+// Ring of recorded events; event i goes in slot i % capacity
+static Event* events = NULL;
+static size_t capacity = 0;
+static std::atomic<uint64_t> head(0);
+
+static std::chrono::steady_clock::time_point origin;
+
+// Small per-thread ids, in the order that threads first record an event
+static std::atomic<uint32_t> next_thread(0);
+static thread_local uint32_t thread_id = next_thread++;
+
+static std::mutex thread_names_mutex;
+static std::map<uint32_t, std::string> thread_names;
+
+typedef void (APIENTRY *PushDebugGroupProc)(GLenum, GLuint, GLsizei,
+                                            const GLchar*);
+typedef void (APIENTRY *PopDebugGroupProc)();
+static PushDebugGroupProc push_debug_group = NULL;
+static PopDebugGroupProc pop_debug_group = NULL;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns nanoseconds since Trace::Start
+static int64_t Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin).count();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Returns a string as a quoted JSON string
+static std::string Quote(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')  out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Trace::Start(const size_t size)
+{
+    if (recording)  return;
+
+    capacity = size;
+    events = new Event[capacity];
+    for (size_t i=0; i < capacity; ++i)
+    {
+        events[i].seq.store(0, std::memory_order_relaxed);
+    }
+
+    origin = std::chrono::steady_clock::now();
+    recording.store(true, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Trace::InitGL(Loader loader)
+{
+    GLint major = 0;
+    GLint minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    bool supported = major > 4 || (major == 4 && minor >= 3);
+
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i=0; i < count && !supported; ++i)
+    {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        supported = ext && !strcmp(ext, "GL_KHR_debug");
+    }
+
+    if (supported)
+    {
+        push_debug_group = (PushDebugGroupProc)loader("glPushDebugGroup");
+        pop_debug_group = (PopDebugGroupProc)loader("glPopDebugGroup");
+    }
+
+    if (!push_debug_group || !pop_debug_group)
+    {
+        push_debug_group = NULL;
+        pop_debug_group = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Trace::NameThread(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(thread_names_mutex);
+    thread_names[thread_id] = name;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Trace::Scope::Begin()
+{
+    if (gl && push_debug_group)
+    {
+        push_debug_group(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+    }
+    start = Now();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Trace::Scope::End()
+{
+    const int64_t end = Now();
+    if (gl && pop_debug_group)  pop_debug_group();
+
+    const uint64_t i = head.fetch_add(1, std::memory_order_relaxed);
+    Event& e = events[i % capacity];
+    e.seq.store(0, std::memory_order_relaxed);
+    e.name = name;
+    e.thread = thread_id;
+    e.start = start;
+    e.duration = end - start;
+    e.seq.store(i + 1, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Trace::Write(const std::string& filename)
+{
+    std::ofstream out(filename);
+    if (!out)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot write trace to '"
+                  << filename << "'" << std::endl;
+        return false;
+    }
+
+    const uint64_t end = head.load(std::memory_order_acquire);
+    const uint64_t begin = end > capacity ? end - capacity : 0;
+
+    // Timestamps are in microseconds
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\": [";
+
+    const char* separator = "\n";
+    {
+        std::lock_guard<std::mutex> lock(thread_names_mutex);
+        for (auto& t : thread_names)
+        {
+            out << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", "
+                << "\"pid\": 1, \"tid\": " << t.first << ", "
+                << "\"args\": {\"name\": " << Quote(t.second) << "}}";
+            separator = ",\n";
+        }
+    }
+
+    for (uint64_t i=begin; i < end; ++i)
+    {
+        const Event& e = events[i % capacity];
+        if (e.seq.load(std::memory_order_acquire) != i + 1)     continue;
+
+        out << separator << "{\"name\": " << Quote(e.name)
+            << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+            << ", \"ts\": " << e.start / 1.0e3
+            << ", \"dur\": " << e.duration / 1.0e3 << "}";
+        separator = ",\n";
+    }
+    out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+
+    if (begin)
+    {
+        std::cerr << "[pixelsim]    Trace ring was full; dropped the "
+                  << begin << " oldest events" << std::endl;
+    }
+    return out.good();
+}
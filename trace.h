@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Lightweight scoped trace markers.
+//
+// TRACE_SCOPE("name") times the rest of the enclosing block, and
+// TRACE_GL_SCOPE("name") also wraps it in an OpenGL debug group (so that
+// it lines up with GPU captures).  Names must be string literals.  Markers
+// cost one acquire load (a plain load on x86) unless recording has been
+// started with Trace::Start, and are compiled out entirely unless
+// PIXELSIM_TRACE is defined.  The acquire pairs with Start's release
+// store, so a thread that sees recording also sees the ring it writes to.
+// Events go into a fixed-size lock-free ring (so the newest ones are
+// kept), which Trace::Write dumps as Chrome trace JSON.
+class Trace
+{
+public:
+    typedef void (*Proc)();
+    typedef Proc (*Loader)(const char*);
+
+    // Starts recording, keeping the most recent capacity events.
+    static void Start(const size_t capacity=1 << 20);
+
+    // Looks up the debug group functions (from GL 4.3 or KHR_debug) with
+    // the given loader, if the current context supports them.  Without
+    // them, TRACE_GL_SCOPE only records CPU events.
+    static void InitGL(Loader loader);
+
+    // Names the calling thread in the trace.
+    static void NameThread(const std::string& name);
+
+    // Writes every recorded event as Chrome trace JSON (which can be
+    // loaded in chrome://tracing or Perfetto).  This should only be called
+    // when no other threads are recording events.  Returns false if the
+    // file can't be written.
+    static bool Write(const std::string& filename);
+
+    class Scope
+    {
+    public:
+        Scope(const char* name, const bool gl)
+            : name(name), active(recording.load(std::memory_order_acquire)),
+              gl(gl)
+        { if (active) Begin(); }
+        ~Scope() { if (active) End(); }
+    private:
+        void Begin();
+        void End();
+
+        const char* const name;
+        const bool active;
+        const bool gl;
+        int64_t start;
+    };
+
+private:
+    static std::atomic<bool> recording;
+};
+
+#ifdef PIXELSIM_TRACE
+#define TRACE_CAT_(a, b) a ## b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+#define TRACE_SCOPE(name) \
+    Trace::Scope TRACE_CAT(trace_scope_, __LINE__)(name, false)
+#define TRACE_GL_SCOPE(name) \
+    Trace::Scope TRACE_CAT(trace_scope_, __LINE__)(name, true)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_GL_SCOPE(name)
+#endif
+
+#endif
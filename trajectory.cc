@@ -0,0 +1,612 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "trajectory.h"
+#include "nodes.h"
+#include "trace.h"
+
+static const char MAGIC[8] = {'p', 'i', 'x', 'e', 'l', 't', 'r', 'j'};
+static const char CHUNK_MAGIC[4] = {'C', 'H', 'N', 'K'};
+static const char INDEX_MAGIC[8] = {'t', 'r', 'j', 'i', 'n', 'd', 'e', 'x'};
+static const uint32_t TRAJECTORY_VERSION = 1;
+
+// A chunk is written once it holds this many frames or bytes
+static const size_t CHUNK_FRAMES = 64;
+static const size_t CHUNK_BYTES = 4 << 20;
+
+// Number of frame buffers that Add can fill before the writer catches up
+static const size_t FRAME_BUFFERS = 8;
+
+// Quanta of x, y, dx and dy in QUANTIZED files (in node widths, and node
+// widths per second)
+static const float QUANTA[4] = {1/1024.0f, 1/1024.0f, 1/256.0f, 1/256.0f};
+
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t mode;
+    uint32_t compression;
+    uint32_t stride;
+    uint32_t width;
+    uint32_t height;
+    uint64_t node_count;
+    uint64_t values_per_frame;
+    float quantum[4];
+};
+
+struct ChunkHeader
+{
+    char magic[4];
+    uint32_t frames;
+    uint64_t bytes;     // size of the chunk after this header
+};
+
+struct IndexEntry
+{
+    uint64_t offset;
+    uint64_t first_frame;
+    uint64_t frames;
+};
+
+struct Trailer
+{
+    uint64_t index_offset;
+    uint64_t chunk_count;
+    char magic[8];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Appends a signed value as a zigzag-encoded LEB128 varint
+static void PutVarint(std::vector<uint8_t>& out, const int32_t value)
+{
+    uint32_t v = (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+    while (v >= 0x80)
+    {
+        out.push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+// Reads a varint written by PutVarint, advancing p.  Returns false if the
+// varint runs past end or is longer than any that PutVarint writes.
+static bool GetVarint(const uint8_t*& p, const uint8_t* end, int32_t* out)
+{
+    uint32_t v = 0;
+    for (int shift=0; ; shift += 7)
+    {
+        if (p == end || shift >= 35)    return false;
+        const uint8_t b = *p++;
+        v |= uint32_t(b & 0x7f) << shift;
+        if (!(b & 0x80))    break;
+    }
+    *out = int32_t(v >> 1) ^ -int32_t(v & 1);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TrajectoryWriter::TrajectoryWriter(const std::string& filename,
+                                   const size_t width, const size_t height,
+                                   const Nodes& nodes,
+                                   const Trajectory::Mode mode,
+                                   const Trajectory::Compression compression,
+                                   const size_t stride)
+    : file(fopen(filename.c_str(), "wb")), mode(mode),
+      compression(mode == Trajectory::NODES ? compression : Trajectory::RAW),
+      stride(stride),
+      values_per_frame(mode == Trajectory::NODES ? nodes.size() * 4
+                                                 : Trajectory::SUMMARY_VALUES),
+      index(nodes.index), neighbors(nodes.neighbors), links(nodes.links),
+      done(false), copied(0), waits(0)
+{
+    if (!file)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot write trajectory to '"
+                  << filename << "'" << std::endl;
+        exit(-1);
+    }
+
+    FileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = TRAJECTORY_VERSION;
+    h.mode = mode;
+    h.compression = this->compression;
+    h.stride = stride;
+    h.width = width;
+    h.height = height;
+    h.node_count = index.size();
+    h.values_per_frame = values_per_frame;
+    memcpy(h.quantum, QUANTA, sizeof(QUANTA));
+    fwrite(&h, sizeof(h), 1, file);
+
+    if (mode == Trajectory::NODES)
+    {
+        fwrite(&index[0], sizeof(index[0]), index.size(), file);
+    }
+
+    frames.resize(FRAME_BUFFERS);
+    for (auto& f : frames)
+    {
+        f.values.resize(index.size() * 4);
+        free_frames.push_back(&f);
+    }
+
+    thread = std::thread(&TrajectoryWriter::Run, this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    queue_ready.notify_one();
+    thread.join();
+
+    WriteChunk();
+
+    Trailer t;
+    t.index_offset = ftello(file);
+    t.chunk_count = chunks.size();
+    memcpy(t.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    for (auto& c : chunks)
+    {
+        const IndexEntry e = {c.offset, c.first_frame, c.frames};
+        fwrite(&e, sizeof(e), 1, file);
+    }
+    fwrite(&t, sizeof(t), 1, file);
+    fclose(file);
+
+    if (waits)
+    {
+        std::cerr << "[pixelsim]    Trajectory writer fell behind "
+                  << waits << " times" << std::endl;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TrajectoryWriter::Frame* TrajectoryWriter::GetFrame()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (free_frames.empty())
+    {
+        waits++;
+        frame_freed.wait(lock, [&]{ return !free_frames.empty(); });
+    }
+    Frame* f = free_frames.back();
+    free_frames.pop_back();
+    return f;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::Queue(Frame* f)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(f);
+    }
+    queue_ready.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::Add(const uint64_t frame, const float* rgba)
+{
+    if (!Wants(frame))  return;
+    TRACE_SCOPE("TrajectoryWriter::Add");
+
+    Frame* f = GetFrame();
+    f->number = frame;
+    f->texels = NULL;
+    for (size_t n=0; n < index.size(); ++n)
+    {
+        memcpy(&f->values[n*4], &rgba[index[n]*4], 4*sizeof(float));
+    }
+    Queue(f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::AddTexels(const uint64_t frame, const float* texels)
+{
+    if (!Wants(frame))  return;
+    TRACE_SCOPE("TrajectoryWriter::AddTexels");
+
+    Frame* f = GetFrame();
+    f->number = frame;
+    f->texels = texels;
+    Queue(f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::SetTexelIndex(const std::vector<uint32_t>& index)
+{
+    texel_index = index;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool TrajectoryWriter::Copied(const uint64_t frame, const bool wait)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (wait)   frame_copied.wait(lock, [&]{ return frame < copied; });
+    return frame < copied;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::Run()
+{
+    Trace::NameThread("trajectory writer");
+
+    float summary[Trajectory::SUMMARY_VALUES];
+    while (true)
+    {
+        Frame* f;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_ready.wait(lock, [&]{ return done || !queue.empty(); });
+            if (queue.empty())  return;
+
+            f = queue.front();
+            queue.pop_front();
+        }
+
+        if (f->texels)
+        {
+            TRACE_SCOPE("TrajectoryWriter::Copy");
+            for (size_t n=0; n < texel_index.size(); ++n)
+            {
+                memcpy(&f->values[n*4], &f->texels[texel_index[n]*4],
+                       4*sizeof(float));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                copied = f->number + 1;
+            }
+            frame_copied.notify_all();
+        }
+
+        if (mode == Trajectory::NODES)
+        {
+            Encode(f->number, &f->values[0]);
+        }
+        else
+        {
+            Summarize(f->values, summary);
+            Encode(f->number, summary);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_frames.push_back(f);
+        }
+        frame_freed.notify_one();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::Summarize(const std::vector<float>& nodes,
+                                 float* out) const
+{
+    TRACE_SCOPE("TrajectoryWriter::Summarize");
+
+    const size_t count = index.size();
+    double sum[4] = {0, 0, 0, 0};
+    double strain_sum = 0;
+    float strain_max = 0;
+    size_t link_count = 0;
+
+    for (size_t n=0; n < count; ++n)
+    {
+        for (int p=0; p < 4; ++p)   sum[p] += nodes[n*4 + p];
+
+        // Every link is stored at both of its ends, so this counts each
+        // one twice (which doesn't change the mean or maximum).
+        for (int d=0; d < 8; ++d)
+        {
+            if (!(links[n] & (1 << d)))     continue;
+
+            const size_t m = neighbors[n*8 + d];
+            const float dx = nodes[m*4] - nodes[n*4];
+            const float dy = nodes[m*4 + 1] - nodes[n*4 + 1];
+            const float strain = std::fabs(std::sqrt(dx*dx + dy*dy) -
+                                           Nodes::lengths[d]) /
+                                 Nodes::lengths[d];
+            strain_sum += strain;
+            strain_max = std::max(strain_max, strain);
+            link_count++;
+        }
+    }
+
+    for (int p=0; p < 4; ++p)   out[p] = count ? sum[p] / count : 0;
+    out[4] = link_count ? strain_sum / link_count : 0;
+    out[5] = strain_max;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::Encode(const uint64_t number, const float* values)
+{
+    TRACE_SCOPE("TrajectoryWriter::Encode");
+
+    if (compression == Trajectory::RAW)
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values);
+        chunk_data.insert(chunk_data.end(), bytes,
+                          bytes + values_per_frame * sizeof(float));
+    }
+    else
+    {
+        // Each chunk's first frame is relative to zero
+        if (chunk_frames.empty())   previous.assign(values_per_frame, 0);
+
+        for (size_t i=0; i < values_per_frame; ++i)
+        {
+            const int32_t q = std::lround(values[i] / QUANTA[i % 4]);
+            PutVarint(chunk_data, q - previous[i]);
+            previous[i] = q;
+        }
+    }
+    chunk_frames.push_back(number);
+
+    if (chunk_frames.size() >= CHUNK_FRAMES ||
+        chunk_data.size() >= CHUNK_BYTES)
+    {
+        WriteChunk();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryWriter::WriteChunk()
+{
+    if (chunk_frames.empty())   return;
+    TRACE_SCOPE("TrajectoryWriter::WriteChunk");
+
+    ChunkEntry c;
+    c.offset = ftello(file);
+    c.first_frame = chunk_frames.front();
+    c.frames = chunk_frames.size();
+    chunks.push_back(c);
+
+    ChunkHeader h;
+    memcpy(h.magic, CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+    h.frames = chunk_frames.size();
+    h.bytes = chunk_frames.size() * sizeof(uint64_t) + chunk_data.size();
+
+    fwrite(&h, sizeof(h), 1, file);
+    fwrite(&chunk_frames[0], sizeof(uint64_t), chunk_frames.size(), file);
+    fwrite(&chunk_data[0], 1, chunk_data.size(), file);
+    fflush(file);
+
+    chunk_frames.clear();
+    chunk_data.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TrajectoryReader::TrajectoryReader(const std::string& filename)
+    : file(fopen(filename.c_str(), "rb")), frame_count(0), cached(-1)
+{
+    auto fail = [&](const std::string& reason)
+    {
+        std::cerr << "[pixelsim]    Error: Cannot read trajectory '"
+                  << filename << "': " << reason << std::endl;
+        exit(-1);
+    };
+
+    if (!file)  fail("can't open file");
+
+    FileHeader h;
+    if (fread(&h, sizeof(h), 1, file) != 1 ||
+        memcmp(h.magic, MAGIC, sizeof(MAGIC)))
+    {
+        fail("not a trajectory");
+    }
+    else if (h.version != TRAJECTORY_VERSION)
+    {
+        fail("unsupported version " + std::to_string(h.version));
+    }
+
+    else if (h.mode > Trajectory::SUMMARY ||
+             h.compression > Trajectory::QUANTIZED ||
+             h.values_per_frame != (h.mode == Trajectory::NODES
+                                        ? h.node_count * 4
+                                        : Trajectory::SUMMARY_VALUES) ||
+             h.node_count > uint64_t(h.width + 1) * (h.height + 1))
+    {
+        fail("invalid header");
+    }
+
+    mode = Trajectory::Mode(h.mode);
+    compression = Trajectory::Compression(h.compression);
+    width = h.width;
+    height = h.height;
+    stride = h.stride;
+    values_per_frame = h.values_per_frame;
+    memcpy(quantum, h.quantum, sizeof(quantum));
+
+    if (mode == Trajectory::NODES)
+    {
+        index.resize(h.node_count);
+        if (fread(&index[0], sizeof(index[0]), index.size(), file) !=
+            index.size())
+        {
+            fail("truncated node index");
+        }
+    }
+    const uint64_t first_chunk = ftello(file);
+
+    // Read the index from the trailer, if there is one
+    Trailer t;
+    fseeko(file, 0, SEEK_END);
+    const uint64_t end = ftello(file);
+    bool indexed = false;
+    if (end >= first_chunk + sizeof(t))
+    {
+        fseeko(file, end - sizeof(t), SEEK_SET);
+        indexed = fread(&t, sizeof(t), 1, file) == 1 &&
+                  !memcmp(t.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    }
+
+    if (indexed)
+    {
+        fseeko(file, t.index_offset, SEEK_SET);
+        for (uint64_t i=0; i < t.chunk_count; ++i)
+        {
+            IndexEntry e;
+            if (fread(&e, sizeof(e), 1, file) != 1)    fail("truncated index");
+            chunks.push_back({e.offset, e.first_frame, e.frames, 0});
+        }
+    }
+    else
+    {
+        // Otherwise, walk the chunks until the file runs out
+        std::cerr << "[pixelsim]    Trajectory '" << filename
+                  << "' has no index; scanning its chunks" << std::endl;
+        uint64_t offset = first_chunk;
+        ChunkHeader c;
+        fseeko(file, offset, SEEK_SET);
+        while (fread(&c, sizeof(c), 1, file) == 1 &&
+               !memcmp(c.magic, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) &&
+               offset + sizeof(c) + c.bytes <= end)
+        {
+            uint64_t first;
+            if (fread(&first, sizeof(first), 1, file) != 1)    break;
+            chunks.push_back({offset, first, c.frames, 0});
+
+            offset += sizeof(c) + c.bytes;
+            fseeko(file, offset, SEEK_SET);
+        }
+    }
+
+    for (auto& c : chunks)
+    {
+        c.first_index = frame_count;
+        frame_count += c.frames;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TrajectoryReader::~TrajectoryReader()
+{
+    fclose(file);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TrajectoryReader::Load(const size_t c)
+{
+    if (c == cached)    return;
+    TRACE_SCOPE("TrajectoryReader::Load");
+
+    const ChunkEntry& e = chunks[c];
+    auto fail = [&](const std::string& reason)
+    {
+        std::cerr << "[pixelsim]    Error: " << reason
+                  << " trajectory chunk at " << e.offset << std::endl;
+        exit(-1);
+    };
+
+    // The chunk's size comes from the file, so check it against the frame
+    // count before trusting it (RAW chunks have an exact size, and
+    // QUANTIZED chunks hold at least one byte per value).
+    ChunkHeader h;
+    fseeko(file, e.offset, SEEK_SET);
+    if (fread(&h, sizeof(h), 1, file) != 1 ||
+        memcmp(h.magic, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) ||
+        h.frames != e.frames)
+    {
+        fail("Invalid");
+    }
+    const uint64_t frame_bytes = e.frames * sizeof(uint64_t);
+    const uint64_t value_bytes = e.frames * values_per_frame *
+        (compression == Trajectory::RAW ? sizeof(float) : 1);
+    if (compression == Trajectory::RAW
+            ? h.bytes != frame_bytes + value_bytes
+            : h.bytes < frame_bytes + value_bytes)
+    {
+        fail("Invalid");
+    }
+
+    std::vector<uint8_t> data(h.bytes);
+    if (fread(data.data(), 1, h.bytes, file) != h.bytes)    fail("Truncated");
+
+    cache_frames.resize(e.frames);
+    memcpy(cache_frames.data(), data.data(), frame_bytes);
+    const uint8_t* p = data.data() + frame_bytes;
+    const uint8_t* end = data.data() + data.size();
+
+    cache_values.resize(e.frames * values_per_frame);
+    if (compression == Trajectory::RAW)
+    {
+        memcpy(cache_values.data(), p, value_bytes);
+    }
+    else
+    {
+        std::vector<int32_t> q(values_per_frame, 0);
+        int32_t d;
+        for (size_t f=0; f < e.frames; ++f)
+        {
+            for (size_t i=0; i < values_per_frame; ++i)
+            {
+                if (!GetVarint(p, end, &d))     fail("Corrupt");
+                q[i] += d;
+                cache_values[f*values_per_frame + i] = q[i] * quantum[i % 4];
+            }
+        }
+    }
+    cached = c;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool TrajectoryReader::Read(const size_t i, std::vector<float>* values,
+                            uint64_t* number)
+{
+    if (i >= frame_count)   return false;
+
+    // Find the last chunk starting at or before frame i
+    const auto c = std::upper_bound(chunks.begin(), chunks.end(), i,
+            [](const size_t i, const ChunkEntry& c)
+            { return i < c.first_index; }) - 1;
+    Load(c - chunks.begin());
+
+    const size_t f = i - c->first_index;
+    values->assign(&cache_values[f*values_per_frame],
+                   &cache_values[(f + 1)*values_per_frame]);
+    if (number)     *number = cache_frames[f];
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+size_t TrajectoryReader::Find(const uint64_t frame)
+{
+    // Find the last chunk starting at or before the frame, then search it
+    auto c = std::upper_bound(chunks.begin(), chunks.end(), frame,
+            [](const uint64_t f, const ChunkEntry& c)
+            { return f < c.first_frame; });
+    if (c == chunks.begin())    return 0;
+    --c;
+
+    Load(c - chunks.begin());
+    const size_t f = std::lower_bound(cache_frames.begin(),
+                                      cache_frames.end(), frame) -
+                     cache_frames.begin();
+    return c->first_index + f;
+}
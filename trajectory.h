@@ -0,0 +1,212 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Nodes;
+
+// Streaming binary trajectories, for analyzing runs offline.
+//
+// A trajectory file is a header (and, for NODES, the grid index of every
+// live node), followed by chunks of consecutive recorded frames, then an
+// index of the chunks and a trailer pointing at it.  Each chunk starts with
+// the frame numbers it holds, then the frames' values.  Values are floats,
+// or in QUANTIZED NODES files, integer multiples of a fixed quantum stored
+// as zigzag varints of their change since the previous frame (the first
+// frame of each chunk is stored in full, so that any chunk can be decoded
+// on its own).  Summaries are always stored as floats, since they're small
+// and strains are too fine to quantize.  A file without a trailer (from a
+// run that crashed) can still be read, by scanning its chunks.
+namespace Trajectory
+{
+    // NODES records x, y, dx, dy for every live node (in Nodes order).
+    // SUMMARY records the centroid, mean velocity, and mean and maximum
+    // strain of the springs (|length - rest| / rest).
+    enum Mode {NODES, SUMMARY};
+    enum Compression {RAW, QUANTIZED};
+
+    // Number of values per frame in SUMMARY mode
+    enum {SUMMARY_VALUES=6};
+}
+
+class TrajectoryWriter
+{
+public:
+    // Opens a trajectory file and starts the thread that encodes and writes
+    // frames, exiting if the file can't be written.  Frames are recorded
+    // when their number is a multiple of stride.
+    TrajectoryWriter(const std::string& filename, const size_t width,
+                     const size_t height, const Nodes& nodes,
+                     const Trajectory::Mode mode,
+                     const Trajectory::Compression compression,
+                     const size_t stride=1);
+
+    // Writes every queued frame, then the index and trailer.
+    ~TrajectoryWriter();
+
+    // Returns true if the given frame should be recorded
+    bool Wants(const uint64_t frame) const { return frame % stride == 0; }
+
+    // Queues a frame for recording, if Wants(frame).  rgba is the state of
+    // every node in state_tex's layout; only live nodes are copied, so
+    // this is the only cost to the calling thread (unless every buffer is
+    // waiting to be encoded, in which case it blocks).  This must only be
+    // called from one thread at a time, with increasing frame numbers.
+    void Add(const uint64_t frame, const float* rgba);
+
+    // Like Add, but leaves copying the frame to the writer thread: texels
+    // is a state in a texture's layout (such as a mapped readback from
+    // Ship::MapState), holding each live node at the texel given by
+    // SetTexelIndex, and must stay valid until Copied(frame) is true.
+    void AddTexels(const uint64_t frame, const float* texels);
+    void SetTexelIndex(const std::vector<uint32_t>& index);
+
+    // Returns true once the writer thread has copied every frame up to
+    // the given one that was queued by AddTexels (blocking until it has,
+    // if wait is true).
+    bool Copied(const uint64_t frame, const bool wait);
+
+private:
+    struct Frame
+    {
+        uint64_t number;
+        std::vector<float> values;  // x, y, dx, dy per live node
+        const float* texels;    // values to copy in, if queued by AddTexels
+    };
+
+    // Takes a free frame buffer, waiting for one if there isn't any
+    Frame* GetFrame();
+
+    // Queues a frame for the writer thread
+    void Queue(Frame* f);
+
+    // Writer thread loop
+    void Run();
+
+    // Computes a SUMMARY frame's values from a frame of node values
+    void Summarize(const std::vector<float>& nodes, float* out) const;
+
+    // Adds a frame's values to the chunk being built, writing the chunk
+    // when it's full
+    void Encode(const uint64_t number, const float* values);
+
+    // Writes the chunk being built (if it isn't empty) and starts another
+    void WriteChunk();
+
+    FILE* file;
+    const Trajectory::Mode mode;
+    const Trajectory::Compression compression;
+    const size_t stride;
+    const size_t values_per_frame;
+
+    // Live node grid indices and links, for copying and summarizing
+    std::vector<uint32_t> index;
+    std::vector<int32_t> neighbors;
+    std::vector<uint8_t> links;
+
+    // Texel holding each live node, for frames queued by AddTexels
+    std::vector<uint32_t> texel_index;
+
+    // The chunk being built, and the quantized values of the last frame
+    // added to it (which the next frame's values are relative to)
+    std::vector<uint64_t> chunk_frames;
+    std::vector<uint8_t> chunk_data;
+    std::vector<int32_t> previous;
+
+    // Offset, first frame and frame count of every chunk written so far
+    struct ChunkEntry
+    {
+        uint64_t offset;
+        uint64_t first_frame;
+        uint64_t frames;
+    };
+    std::vector<ChunkEntry> chunks;
+
+    // Frame buffers, shared with the writer thread (guarded by mutex)
+    std::vector<Frame> frames;
+    std::vector<Frame*> free_frames;
+    std::deque<Frame*> queue;
+    bool done;
+    uint64_t copied;    // one past the last frame copied from its texels
+    std::mutex mutex;
+    std::condition_variable queue_ready;
+    std::condition_variable frame_freed;
+    std::condition_variable frame_copied;
+
+    size_t waits;   // number of times Add blocked for a free buffer
+
+    std::thread thread;
+};
+
+class TrajectoryReader
+{
+public:
+    // Opens a trajectory file and reads its index (or rebuilds it, if the
+    // file has no trailer), exiting if it isn't a valid trajectory.
+    TrajectoryReader(const std::string& filename);
+    ~TrajectoryReader();
+
+    Trajectory::Mode GetMode() const { return mode; }
+    Trajectory::Compression GetCompression() const { return compression; }
+    size_t GetWidth() const { return width; }
+    size_t GetHeight() const { return height; }
+    size_t GetStride() const { return stride; }
+
+    // Grid index (x + y*(width+1)) of each live node, for NODES files
+    const std::vector<uint32_t>& GetNodeIndex() const { return index; }
+
+    // Number of values in each frame
+    size_t GetValueCount() const { return values_per_frame; }
+
+    // Number of recorded frames
+    size_t size() const { return frame_count; }
+
+    // Reads the i'th recorded frame's values (decoding at most one chunk),
+    // optionally returning its frame number.  Returns false if i is out
+    // of range.
+    bool Read(const size_t i, std::vector<float>* values,
+              uint64_t* number=NULL);
+
+    // Returns the index of the first recorded frame numbered at or after
+    // the given frame (or size(), if there isn't one).
+    size_t Find(const uint64_t frame);
+
+private:
+    struct ChunkEntry
+    {
+        uint64_t offset;
+        uint64_t first_frame;
+        uint64_t frames;
+        size_t first_index;     // index of the chunk's first frame
+    };
+
+    // Loads and decodes chunk c into the cache, if it isn't already
+    void Load(const size_t c);
+
+    FILE* file;
+    Trajectory::Mode mode;
+    Trajectory::Compression compression;
+    size_t width;
+    size_t height;
+    size_t stride;
+    size_t values_per_frame;
+    float quantum[4];
+
+    std::vector<uint32_t> index;
+    std::vector<ChunkEntry> chunks;
+    size_t frame_count;
+
+    // The last chunk decoded
+    size_t cached;
+    std::vector<uint64_t> cache_frames;
+    std::vector<float> cache_values;
+};
+
+#endif